@@ -0,0 +1,19 @@
+#!/usr/bin/env bash
+
+# Builds the benchmarks. Run it from the repository root: bench/build.sh
+
+set -e
+
+CXX="${CXX:-c++}"
+CXXFLAGS="-std=gnu++17 -O3 -Wall -Wextra -pedantic -Wno-unused-parameter -Wno-reorder"
+CXXFLAGS="${CXXFLAGS} -Iinclude -I/usr/include/irrlicht -D_PROJECT_VERSION=\"$(cat version.txt)\""
+LIBS="-lpthread"
+
+# Engine sources the benchmarks are linked with
+common="src/log/log.cpp src/log/log_stream.cpp src/util/wstring_cast.cpp src/util/base64.cpp"
+net="src/net/socketlib.cpp src/net/connection.cpp src/net/shm_connection.cpp"
+net="${net} src/module/module_arg_io.cpp"
+
+${CXX} ${CXXFLAGS} bench/module_transport.cpp ${common} ${net} ${LIBS} -o bench/module_transport
+${CXX} ${CXXFLAGS} bench/handle_storage.cpp -o bench/handle_storage
+${CXX} ${CXXFLAGS} bench/draw_queue.cpp ${LIBS} -o bench/draw_queue
@@ -0,0 +1,214 @@
+/**
+ * Draw queue benchmark
+ *
+ * Compares the lock-free MpscQueue the draw thread takes its tasks from with the vector of
+ * std::packaged_task under a recursive mutex it replaced. Several producer threads queue
+ * tasks, some of them waiting for the result as graphicsLoadTexture() does, while a consumer
+ * drains the queue once a "frame", each task taking a little time. Reported are the time a
+ * producer spends queueing a task, the round trip of a task that is waited for, and the
+ * longest time the consumer has been stuck draining a single frame.
+ *
+ * Build and run from the repository root:
+ *     bench/build.sh && bench/draw_queue [producers] [tasks per producer]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <modbox/util/mpsc_queue.hpp>
+
+using Clock = std::chrono::steady_clock;
+
+static const auto taskCost = std::chrono::nanoseconds(300);
+static const auto framePeriod = std::chrono::microseconds(500);
+static const auto frameBudget = std::chrono::microseconds(200);
+// Every WAIT_EVERY-th task is waited for
+static const size_t WAIT_EVERY = 16;
+
+static std::atomic<uint64_t> sink(0);
+
+static void work()
+{
+    auto end = Clock::now() + taskCost;
+    while (Clock::now() < end) {
+        sink.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+struct Result
+{
+    double pushNs = 0.0;
+    double roundTripUs = 0.0;
+    double longestFrameUs = 0.0;
+};
+
+/// The draw queue as it used to be
+class LegacyQueue
+{
+public:
+    void push()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        tasks.emplace_back(work);
+    }
+
+    void pushAndWait()
+    {
+        std::future<void> future;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            tasks.emplace_back(work);
+            future = tasks.back().get_future();
+        }
+        future.wait();
+    }
+
+    void drain()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        for (auto& task : tasks) {
+            task();
+        }
+        tasks.clear();
+    }
+
+protected:
+    std::recursive_mutex mutex;
+    std::vector<std::packaged_task<void()>> tasks;
+};
+
+/// What game_loop does with MpscQueue, without the engine around it
+class LockFreeQueue
+{
+public:
+    void push()
+    {
+        queue.push(Task{nullptr});
+    }
+
+    void pushAndWait()
+    {
+        Completion completion;
+        queue.push(Task{&completion});
+        std::unique_lock<std::mutex> lock(completion.mutex);
+        completion.condition.wait(lock, [&completion]() { return completion.done; });
+    }
+
+    void drain()
+    {
+        auto deadline = Clock::now() + frameBudget;
+        Task task;
+        while (queue.pop(task)) {
+            work();
+            if (task.completion != nullptr) {
+                std::lock_guard<std::mutex> lock(task.completion->mutex);
+                task.completion->done = true;
+                task.completion->condition.notify_one();
+            }
+            if (Clock::now() >= deadline) {
+                break;
+            }
+        }
+    }
+
+protected:
+    struct Completion
+    {
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool done = false;
+    };
+
+    struct Task
+    {
+        Completion* completion;
+    };
+
+    MpscQueue<Task> queue;
+};
+
+template <typename Queue>
+Result run(size_t producers, size_t tasks)
+{
+    Queue queue;
+    std::atomic<bool> stop(false);
+    double longestFrame = 0.0;
+    std::thread consumer([&]() {
+        auto next = Clock::now();
+        while (!stop) {
+            auto start = Clock::now();
+            queue.drain();
+            longestFrame = std::max(
+                    longestFrame, std::chrono::duration<double>(Clock::now() - start).count());
+            next += framePeriod;
+            std::this_thread::sleep_until(next);
+        }
+        queue.drain();
+    });
+
+    std::vector<double> pushSeconds(producers, 0.0);
+    std::vector<double> waitSeconds(producers, 0.0);
+    std::vector<std::thread> threads;
+    for (size_t producer = 0; producer < producers; ++producer) {
+        threads.emplace_back([&, producer]() {
+            for (size_t i = 0; i < tasks; ++i) {
+                auto start = Clock::now();
+                if (i % WAIT_EVERY == 0) {
+                    queue.pushAndWait();
+                    waitSeconds[producer]
+                            += std::chrono::duration<double>(Clock::now() - start).count();
+                } else {
+                    queue.push();
+                    pushSeconds[producer]
+                            += std::chrono::duration<double>(Clock::now() - start).count();
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    stop = true;
+    consumer.join();
+
+    size_t waited = (tasks + WAIT_EVERY - 1) / WAIT_EVERY;
+    Result result;
+    for (size_t producer = 0; producer < producers; ++producer) {
+        result.pushNs += pushSeconds[producer] * 1e9 / (tasks - waited) / producers;
+        result.roundTripUs += waitSeconds[producer] * 1e6 / waited / producers;
+    }
+    result.longestFrameUs = longestFrame * 1e6;
+    return result;
+}
+
+static void print(const char* name, const Result& result)
+{
+    printf("%-16s push %9.1f ns   waited round trip %9.1f us   longest frame %9.1f us\n",
+           name,
+           result.pushNs,
+           result.roundTripUs,
+           result.longestFrameUs);
+}
+
+int main(int argc, char** argv)
+{
+    size_t producers = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4;
+    size_t tasks = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000;
+    printf("%zu producers, %zu tasks each, every %zu-th waited for\n",
+           producers,
+           tasks,
+           WAIT_EVERY);
+
+    print("mutex + vector", run<LegacyQueue>(producers, tasks));
+    print("MpscQueue", run<LockFreeQueue>(producers, tasks));
+    return 0;
+}
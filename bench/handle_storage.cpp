@@ -0,0 +1,187 @@
+/**
+ * HandleStorage benchmark
+ *
+ * Compares the slot map HandleStorage with the std::map based one it replaced, on the
+ * access patterns of the engine: bulk insertion, lookups by handle, removal of random
+ * values followed by new insertions (objects being created and destroyed) and walking
+ * over all values every frame. It also counts stale handles (those of removed values) that
+ * are still accepted because the handle has been given to a new value.
+ *
+ * Build and run from the repository root:
+ *     bench/build.sh && bench/handle_storage [values]
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include <modbox/util/handle_storage.hpp>
+
+/// HandleStorage as it used to be: std::map of values and std::set of free handles
+template <typename Handle, typename Value>
+class LegacyHandleStorage
+{
+public:
+    Handle insert(const Value& v)
+    {
+        Handle h = allocateHandle();
+        storageMap.insert(std::make_pair(h, v));
+        if (freeHandles.count(h)) {
+            freeHandles.erase(h);
+        }
+        return h;
+    }
+
+    const Value& access(Handle h)
+    {
+        return storageMap.at(h);
+    }
+
+    void remove(Handle h)
+    {
+        if (h < storageMap.crbegin()->first) {
+            freeHandles.insert(h);
+        }
+        storageMap.erase(h);
+    }
+
+    auto begin()
+    {
+        return storageMap.begin();
+    }
+    auto end()
+    {
+        return storageMap.end();
+    }
+
+protected:
+    Handle allocateHandle()
+    {
+        if (freeHandles.empty()) {
+            return Handle(storageMap.size());
+        } else {
+            return *freeHandles.begin();
+        }
+    }
+
+    std::map<Handle, Value> storageMap;
+    std::set<Handle> freeHandles;
+};
+
+// Roughly a scene object: a few coordinates and a pointer
+struct Payload
+{
+    double x, y, z;
+    void* node;
+};
+
+struct Timings
+{
+    double insert;
+    double access;
+    double churn;
+    double iterate;
+    uint64_t checksum;
+    uint64_t staleHandlesAccepted;
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+template <typename Storage>
+static Timings run(size_t count)
+{
+    Timings t = {};
+    Storage storage;
+    std::mt19937_64 random(42);
+    std::vector<uint64_t> handles;
+    handles.reserve(count);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        handles.push_back(storage.insert(Payload{double(i), 0.0, 0.0, nullptr}));
+    }
+    t.insert = secondsSince(start);
+
+    std::vector<uint64_t> lookups(count * 4);
+    for (auto& h : lookups) {
+        h = handles[random() % handles.size()];
+    }
+    start = std::chrono::steady_clock::now();
+    for (uint64_t h : lookups) {
+        t.checksum += static_cast<uint64_t>(storage.access(h).x);
+    }
+    t.access = secondsSince(start);
+
+    // Remove a random value and create a new one, as the game does with its objects
+    std::vector<uint64_t> removed;
+    removed.reserve(count);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        size_t index = random() % handles.size();
+        storage.remove(handles[index]);
+        removed.push_back(handles[index]);
+        handles[index] = storage.insert(Payload{double(i), 1.0, 0.0, nullptr});
+    }
+    t.churn = secondsSince(start);
+
+    std::set<uint64_t> live(handles.begin(), handles.end());
+    for (uint64_t h : removed) {
+        try {
+            storage.access(h);
+            if (live.count(h)) {
+                ++t.staleHandlesAccepted;
+            }
+        } catch (const std::out_of_range& e) {
+        }
+    }
+
+    const int frames = 100;
+    start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; ++frame) {
+        for (auto& [handle, value] : storage) {
+            t.checksum += static_cast<uint64_t>(value.x + value.y) ^ handle;
+        }
+    }
+    t.iterate = secondsSince(start) / frames;
+    return t;
+}
+
+static void report(const char* name, const Timings& t, size_t count)
+{
+    std::printf("%-10s insert %8.1f ns  access %8.1f ns  remove+insert %8.1f ns  "
+                "iterate %8.2f ns/value  (checksum %llu)\n",
+                name,
+                t.insert * 1e9 / count,
+                t.access * 1e9 / (count * 4),
+                t.churn * 1e9 / count,
+                t.iterate * 1e9 / count,
+                static_cast<unsigned long long>(t.checksum));
+    std::printf("%-10s %llu of %zu stale handles accepted\n",
+                "",
+                static_cast<unsigned long long>(t.staleHandlesAccepted),
+                count);
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    if (count == 0) {
+        throw std::invalid_argument("Nothing to benchmark");
+    }
+
+    Timings legacy = run<LegacyHandleStorage<uint64_t, Payload>>(count);
+    report("std::map", legacy, count);
+    Timings slotMap = run<HandleStorage<uint64_t, Payload>>(count);
+    report("slot map", slotMap, count);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/**
+ * Module transport benchmark
+ *
+ * Measures round trips per second of a small binary (v2) protocol call, the
+ * kind the engine makes every tick, over a socketpair and over shared memory
+ * rings. The "module" is a forked copy of this process echoing the argument
+ * back, just like ModuleWorker::runModuleFunc() talks to a module.
+ *
+ * Build and run from the repository root:
+ *     bench/build.sh && bench/module_transport [calls]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <modbox/log/log.hpp>
+#include <modbox/modules/module_io.hpp>
+#include <modbox/net/connection.hpp>
+#include <modbox/net/shm_connection.hpp>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The benchmark does not link src/core/destroy.cpp, which drags in the whole engine
+std::atomic<bool> doWeNeedToShutDown(false);
+std::atomic<bool> areWeShuttingDown(false);
+
+void destroy()
+{
+    _exit(1);
+}
+
+static void serve(Connection& conn)
+{
+    while (true) {
+        MessageReader request(conn);
+        std::string command = request.readString();
+        int64_t value = request.readInt();
+
+        MessageWriter reply;
+        reply.writeByte(0);
+        reply.writeInt(value);
+        reply.send(conn);
+        conn.flush();
+    }
+}
+
+static double measure(Connection& conn, uint64_t calls)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < calls; ++i) {
+        MessageWriter request;
+        request.writeString("bench.echo");
+        request.writeInt(i);
+        request.send(conn);
+        conn.flush();
+
+        MessageReader reply(conn);
+        if (reply.readByte() != 0 || reply.readInt() != static_cast<int64_t>(i)) {
+            throw std::runtime_error("Invalid reply");
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return calls / elapsed.count();
+}
+
+static double benchSocketPair(uint64_t calls)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        throw std::runtime_error("socketpair() failed");
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        SocketConnection conn(fds[1]);
+        try {
+            serve(conn);
+        } catch (const std::exception& e) {
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+    SocketConnection conn(fds[0]);
+    double result = measure(conn, calls);
+    conn.close();
+    waitpid(pid, nullptr, 0);
+    return result;
+}
+
+static double benchShm(uint64_t calls)
+{
+    auto segment = ShmSegment::create();
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        ShmConnection conn(segment, SHM_RING_REVERSE_OUT, SHM_RING_REVERSE_IN, parent);
+        try {
+            serve(conn);
+        } catch (const std::exception& e) {
+            _exit(0);
+        }
+    }
+    ShmConnection conn(segment, SHM_RING_REVERSE_IN, SHM_RING_REVERSE_OUT, pid);
+    double result = measure(conn, calls);
+    conn.close();
+    waitpid(pid, nullptr, 0);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t calls = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+    areWeShuttingDown = true; // Keep the connection statistics out of the output
+
+    double socketRate = benchSocketPair(calls);
+    std::printf("socketpair:    %12.0f calls/sec\n", socketRate);
+    double shmRate = benchShm(calls);
+    std::printf("shared memory: %12.0f calls/sec (x%.2f)\n", shmRate, shmRate / socketRate);
+    return 0;
+}
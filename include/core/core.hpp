@@ -1,9 +1,14 @@
 #ifndef CORE_CORE_HPP
 #define CORE_CORE_HPP
 
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
@@ -39,19 +44,63 @@ private:
     func_type func;
 };
 
+class MessageReader;
+class MessageWriter;
+
+/**
+ * Fast path for requests of the binary protocol: reads the arguments right from the request
+ * and appends the results to the reply, skipping their text form
+ */
+using BinaryFuncProvider = std::function<void(MessageReader& request, MessageWriter& reply)>;
+
+/// Dense number assigned to a command when its FuncProvider is registered
+using CommandId = uint32_t;
+
+/**
+ * A registered FuncProvider along with its signature
+ *
+ * Entries are never modified, moved or destroyed once registered, so references to them
+ * may be kept and used without holding any lock
+ */
+struct FuncProviderEntry
+{
+    CommandId id;
+    FuncProvider provider;
+    ArgsSpec argsSpec;
+    ArgsSpec retSpec;
+    BinaryFuncProvider binaryProvider;
+};
+
 // === Initialization function ===
 
 void initilaizeCore(std::vector<std::string>& args);
 
 // === Working with FuncProviders ===
 
-void registerFuncProvider(const FuncProvider& provider, ArgsSpec args, ArgsSpec ret);
+CommandId registerFuncProvider(const FuncProvider& provider,
+                               ArgsSpec args,
+                               ArgsSpec ret,
+                               const BinaryFuncProvider& binaryProvider = BinaryFuncProvider());
+
+/// Find a command by its name. "#<id>" refers to the command by its ID instead
+const FuncProviderEntry& getFuncProviderEntry(const std::string& command);
+
+/// Find a command by its ID. Takes no locks
+const FuncProviderEntry& getFuncProviderEntry(CommandId id);
+
+CommandId resolveCommand(const std::string& command);
+
 const FuncProvider& getFuncProvider(const std::string& command);
 ArgsSpec getArgsSpec(const std::string& command);
 ArgsSpec getRetSpec(const std::string& command);
 
 void funcProvidersCleanup();
 
+// Blobs of NUL-terminated fields, as passed to core.batch, bound methods and timer callbacks
+
+std::vector<std::string> splitBlobFields(const std::vector<uint8_t>& blob);
+void appendBlobField(std::vector<uint8_t>& blob, const std::string& field);
+
 struct ModuleClassMember
 {
     char type;
@@ -64,6 +113,8 @@ struct ModuleClassMethod
     std::string return_type;
 };
 
+class ModuleClassLayout;
+
 struct ModuleClass
 {
     ModuleClass(const std::unordered_map<std::string, ModuleClassMember>& _members,
@@ -75,6 +126,7 @@ struct ModuleClass
     std::unordered_map<std::string, ModuleClassMember> members;
     std::unordered_map<std::string, ModuleClassMethod> methods;
     std::unordered_map<std::string, std::string> boundMethods;
+    std::shared_ptr<ModuleClassLayout> layout;
 };
 
 template <typename T>
@@ -98,80 +150,161 @@ TYPECHAR(std::vector<uint8_t>, 'b');
 
 #undef TYPECHAR
 
-struct ModuleClassMemberData
+/// Where a member lives in an instance record
+struct ModuleClassSlot
 {
-    ModuleClassMemberData(char t)
-    {
-        type = t;
-    }
+    std::string name;
+    char type;
+    size_t versionOffset;
+    size_t valueOffset;
+};
 
-    template <typename T>
-    explicit ModuleClassMemberData(const T& val)
-    {
-        LOG("ModuleClassMemberData::ModuleClassMemberData(" << val << "): " << TypeChar<T>::value);
-        static_assert(TypeChar<T>::value != '?');
-        value = DyntypeCaster<std::string>::get(val);
-        type = TypeChar<T>::value;
-    }
+/// Memory taken by the instances of a module class
+struct ModuleClassMemoryStats
+{
+    uint64_t instances;
+    uint64_t recordSize;
+    uint64_t pooledBytes;
+};
+
+/**
+ * Fixed layout of the instances of a module class, computed once when the class is added
+ *
+ * An instance is a record of bytes: the version of the instance, the versions synced to each
+ * bound method and then the version and the value of every member. Numbers take 8 bytes,
+ * strings and blobs are std::string objects (blobs keep raw bytes, not base64). Records are
+ * carved out of chunks owned by the layout and reused once their instances are deleted
+ */
+class ModuleClassLayout
+{
+public:
+    ModuleClassLayout(const std::unordered_map<std::string, ModuleClassMember>& members,
+                      size_t _boundMethodCount);
+    ModuleClassLayout(const ModuleClassLayout& other) = delete;
+    ~ModuleClassLayout();
 
-    ModuleClassMemberData(const ModuleClassMemberData& other) = default;
-    ModuleClassMemberData(ModuleClassMemberData&& other) = default;
-    virtual ~ModuleClassMemberData() = default;
+    ModuleClassLayout& operator=(const ModuleClassLayout& other) = delete;
 
-    ModuleClassMemberData& operator=(const ModuleClassMemberData& other);
-    ModuleClassMemberData& operator=(ModuleClassMemberData&& other) = delete;
+    size_t getSlotIndex(const std::string& name) const;
+    const ModuleClassSlot& getSlot(size_t slotIndex) const;
+    const std::vector<ModuleClassSlot>& getSlots() const;
+    size_t getBoundMethodCount() const;
+
+    /// Allocate a record with every member set to zero or to an empty string
+    uint8_t* allocateRecord();
+    void releaseRecord(uint8_t* record);
+
+    ModuleClassMemoryStats getMemoryStats() const;
+
+private:
+    std::vector<ModuleClassSlot> slots;
+    std::unordered_map<std::string, size_t> slotIndices;
+    size_t boundMethodCount;
+    size_t recordSize;
+
+    mutable std::mutex poolMutex;
+    std::vector<std::unique_ptr<uint8_t[]>> chunks;
+    std::vector<uint8_t*> freeRecords;
+    size_t liveRecords = 0;
+};
+
+class ModuleClassInstance
+{
+public:
+    explicit ModuleClassInstance(const std::string& _className);
+    ModuleClassInstance(const ModuleClassInstance& other);
+    ModuleClassInstance(ModuleClassInstance&& other) noexcept;
+    ~ModuleClassInstance();
+
+    ModuleClassInstance& operator=(const ModuleClassInstance& other) = delete;
+    ModuleClassInstance& operator=(ModuleClassInstance&& other) noexcept;
+
+    const std::string& getClassName() const;
+    const ModuleClassLayout& getLayout() const;
 
-    char type;
-    std::string value;
     template <typename T>
-    T get() const
+    T get(size_t slotIndex) const
     {
-        if (type != TypeChar<T>::value) {
-            logStackTrace();
-            throw std::runtime_error(std::string("Type mismatch(get const): expected ")
-                                     + TypeChar<T>::value + ", got " + type);
+        const auto& slot = getTypedSlot(slotIndex, TypeChar<T>::value);
+        if constexpr (std::is_same_v<T, std::string>) {
+            return valueAt<std::string>(slot);
+        } else if constexpr (std::is_same_v<T, std::vector<uint8_t>>) {
+            const auto& bytes = valueAt<std::string>(slot);
+            return std::vector<uint8_t>(bytes.begin(), bytes.end());
         } else {
-            return DyntypeCaster<T>::get(value);
+            T value;
+            memcpy(&value, record + slot.valueOffset, sizeof(T));
+            return value;
         }
     }
 
-    std::string genericGet() const;
-
     template <typename T>
-    void set(const T& x)
+    void set(size_t slotIndex, const T& value)
     {
-        if (type != TypeChar<T>::value) {
-            logStackTrace();
-            throw std::runtime_error(std::string("Type mismatch(set): expected ")
-                                     + TypeChar<T>::value + ", got " + type);
+        const auto& slot = getTypedSlot(slotIndex, TypeChar<T>::value);
+        if constexpr (std::is_same_v<T, std::string>) {
+            valueAt<std::string>(slot) = value;
+        } else if constexpr (std::is_same_v<T, std::vector<uint8_t>>) {
+            valueAt<std::string>(slot).assign(value.begin(), value.end());
         } else {
-            value = DyntypeCaster<std::string>::get(x);
+            memcpy(record + slot.valueOffset, &value, sizeof(T));
         }
+        stamp(slot);
     }
 
-    void genericSet(const std::string& x);
-};
+    template <typename T>
+    T get(const std::string& name) const
+    {
+        return get<T>(layout->getSlotIndex(name));
+    }
 
-struct ModuleClassInstance
-{
-    explicit ModuleClassInstance(const std::string& _className);
-    ModuleClassInstance(const ModuleClassInstance& other) = default;
-    ModuleClassInstance(ModuleClassInstance&& other) = default;
-    ~ModuleClassInstance() = default;
+    template <typename T>
+    void set(const std::string& name, const T& value)
+    {
+        set<T>(layout->getSlotIndex(name), value);
+    }
 
-    std::string className;
+    /// Get a member of any type in its text form
+    std::string genericGet(size_t slotIndex) const;
 
-    std::unordered_map<std::string, ModuleClassMemberData> members;
+    /// Set a member of any type from its text form
+    void genericSet(size_t slotIndex, const std::string& value);
+
+    /**
+     * Version of the instance, incremented on every change of a member
+     *
+     * Bound methods only get the members changed since the version their module has seen,
+     * that version is kept for each bound method (see syncedVersion())
+     */
+    uint64_t getVersion() const;
+    uint64_t getMemberVersion(size_t slotIndex) const;
+    uint64_t& syncedVersion(size_t boundMethod);
+
+private:
+    const ModuleClassSlot& getTypedSlot(size_t slotIndex, char type) const;
+    void stamp(const ModuleClassSlot& slot);
+
+    template <typename T>
+    T& valueAt(const ModuleClassSlot& slot) const
+    {
+        return *reinterpret_cast<T*>(record + slot.valueOffset);
+    }
+
+    std::string className;
+    std::shared_ptr<ModuleClassLayout> layout;
+    uint8_t* record;
 };
 
 void addModuleClass(const std::string& name, const ModuleClass& moduleClass);
 void removeModuleClass(const std::string& name);
 const ModuleClass& getModuleClass(const std::string& className);
 uint64_t instantiateModuleClass(const std::string& className);
+/// The reference is only valid until an instance is created or deleted
 ModuleClassInstance& getModuleClassInstance(uint64_t instanceId);
 void deleteModuleClassInstance(uint64_t instanceId);
 
 std::tuple<std::string, std::string, std::string> moduleClassBindMethod(const std::string& className,
+                                                                        size_t boundMethod,
                                                                         const std::string& command,
                                                                         std::string argTypes,
                                                                         std::string retTypes);
@@ -0,0 +1,19 @@
+#ifndef CORE_OPTIONS_HPP
+#define CORE_OPTIONS_HPP
+
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * Command line options of the engine
+ *
+ * Every option looks like `--name=value`, other arguments are ignored
+ */
+
+void initializeOptions(const std::vector<std::string>& args);
+
+std::optional<std::string> getOption(const std::string& name);
+std::string getOption(const std::string& name, const std::string& defaultValue);
+
+#endif /* end of include guard: CORE_OPTIONS_HPP */
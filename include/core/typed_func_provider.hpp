@@ -0,0 +1,207 @@
+#ifndef CORE_TYPED_FUNC_PROVIDER_HPP
+#define CORE_TYPED_FUNC_PROVIDER_HPP
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <modbox/core/core.hpp>
+#include <modbox/modules/module_io.hpp>
+
+/**
+ * Registration of FuncProviders from plain typed functions
+ *
+ *     uint64_t handlerAddEnemy(const std::string& kind, uint64_t drawableHandle);
+ *     registerFuncProvider("enemy.add", handlerAddEnemy);  // ArgsSpec "su", RetSpec "u"
+ *
+ * Argument and return types must have a TypeChar. A function may return nothing, a single
+ * value or an std::tuple of values. The ArgsSpec and the RetSpec are derived from the
+ * signature, and the marshalling code is generated for both protocols: the text one goes
+ * through FuncProvider as usual, the binary one reads the arguments right from the request
+ * and writes the results right into the reply
+ */
+
+/// Reading and writing a value of type T in the binary protocol
+template <typename T>
+struct WireValue;
+
+template <>
+struct WireValue<int64_t>
+{
+    static int64_t read(MessageReader& reader)
+    {
+        return reader.readInt();
+    }
+    static void write(MessageWriter& writer, int64_t value)
+    {
+        writer.writeInt(value);
+    }
+};
+
+template <>
+struct WireValue<uint64_t>
+{
+    static uint64_t read(MessageReader& reader)
+    {
+        return reader.readUint();
+    }
+    static void write(MessageWriter& writer, uint64_t value)
+    {
+        writer.writeUint(value);
+    }
+};
+
+template <>
+struct WireValue<double>
+{
+    static double read(MessageReader& reader)
+    {
+        return reader.readFloat();
+    }
+    static void write(MessageWriter& writer, double value)
+    {
+        writer.writeFloat(value);
+    }
+};
+
+template <>
+struct WireValue<std::string>
+{
+    static std::string read(MessageReader& reader)
+    {
+        return reader.readString();
+    }
+    static void write(MessageWriter& writer, const std::string& value)
+    {
+        writer.writeString(value);
+    }
+};
+
+template <>
+struct WireValue<std::vector<uint8_t>>
+{
+    static std::vector<uint8_t> read(MessageReader& reader)
+    {
+        return reader.readBlob();
+    }
+    static void write(MessageWriter& writer, const std::vector<uint8_t>& value)
+    {
+        writer.writeBlob(value);
+    }
+};
+
+template <typename T>
+using ValueType = std::decay_t<T>;
+
+template <typename... Ts>
+ArgsSpec makeArgsSpec()
+{
+    static_assert(((TypeChar<ValueType<Ts>>::value != '?') && ...),
+                  "FuncProvider argument and return types must have a TypeChar");
+    return ArgsSpec{TypeChar<ValueType<Ts>>::value...};
+}
+
+/// How the results of a typed function are passed back: nothing, a single value or a tuple
+template <typename Ret>
+struct TypedReturn
+{
+    static ArgsSpec spec()
+    {
+        return makeArgsSpec<Ret>();
+    }
+    static FuncResult toText(const Ret& value)
+    {
+        FuncResult result;
+        result.data.resize(1);
+        setReturn(result, 0, value);
+        return result;
+    }
+    static void toBinary(MessageWriter& reply, const Ret& value)
+    {
+        WireValue<Ret>::write(reply, value);
+    }
+};
+
+template <typename... Ts>
+struct TypedReturn<std::tuple<Ts...>>
+{
+    static ArgsSpec spec()
+    {
+        return makeArgsSpec<Ts...>();
+    }
+    static FuncResult toText(const std::tuple<Ts...>& values)
+    {
+        FuncResult result;
+        result.data.reserve(sizeof...(Ts));
+        std::apply(
+                [&](const Ts&... value) {
+                    (result.data.push_back(DyntypeCaster<std::string>::get(value)), ...);
+                },
+                values);
+        return result;
+    }
+    static void toBinary(MessageWriter& reply, const std::tuple<Ts...>& values)
+    {
+        std::apply([&](const Ts&... value) { (WireValue<Ts>::write(reply, value), ...); }, values);
+    }
+};
+
+template <typename Ret, typename... Args, size_t... I>
+FuncResult callTypedFromText(Ret (*func)(Args...),
+                             const std::vector<std::string>& args,
+                             std::index_sequence<I...>)
+{
+    if constexpr (std::is_void_v<Ret>) {
+        func(getArgument<ValueType<Args>>(args, I)...);
+        return FuncResult();
+    } else {
+        return TypedReturn<Ret>::toText(func(getArgument<ValueType<Args>>(args, I)...));
+    }
+}
+
+template <typename Ret, typename... Args>
+void callTypedFromBinary(const std::string& command,
+                         Ret (*func)(Args...),
+                         MessageReader& request,
+                         MessageWriter& reply)
+{
+    // Elements of a braced initializer list are evaluated in order, so the arguments are read
+    // in the order they come in
+    std::tuple<ValueType<Args>...> args{WireValue<ValueType<Args>>::read(request)...};
+    // Extra operands are as wrong as missing ones, which the reads above have already caught
+    if (!request.atEnd()) {
+        throw std::logic_error("Wrong number of arguments for " + command);
+    }
+    if constexpr (std::is_void_v<Ret>) {
+        std::apply(func, std::move(args));
+    } else {
+        TypedReturn<Ret>::toBinary(reply, std::apply(func, std::move(args)));
+    }
+}
+
+template <typename Ret, typename... Args>
+CommandId registerFuncProvider(const std::string& command, Ret (*func)(Args...))
+{
+    ArgsSpec retSpec;
+    if constexpr (!std::is_void_v<Ret>) {
+        retSpec = TypedReturn<Ret>::spec();
+    }
+
+    auto textFunc = [command, func](const std::vector<std::string>& args) {
+        if (args.size() != sizeof...(Args)) {
+            throw std::logic_error("Wrong number of arguments for " + command);
+        }
+        return callTypedFromText(func, args, std::index_sequence_for<Args...>());
+    };
+    auto binaryFunc = [command, func](MessageReader& request, MessageWriter& reply) {
+        callTypedFromBinary(command, func, request, reply);
+    };
+    return registerFuncProvider(
+            FuncProvider(command, textFunc), makeArgsSpec<Args...>(), retSpec, binaryFunc);
+}
+
+#endif /* end of include guard: CORE_TYPED_FUNC_PROVIDER_HPP */
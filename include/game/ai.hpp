@@ -1,9 +1,165 @@
 #ifndef GAME_AI_HPP
 #define GAME_AI_HPP
 
+#include <cstdint>
 #include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <modbox/geometry/game_position.hpp>
+#include <modbox/util/double_buffer.hpp>
+#include <modbox/util/frame_timing.hpp>
+
+using EnemyId = uint64_t;
+
 std::function<GamePosition()> getDefaultAiFunc();
 
+/// Decides what an enemy does, given its position and the player's one
+using EnemyAiFunction = std::function<std::string(
+        EnemyId id, const GamePosition& position, const GamePosition& playerPosition)>;
+
+struct EnemyAiInput
+{
+    EnemyId id;
+    GamePosition position;
+};
+
+/// Decides for a number of enemies at once. Returns the reply of the module as is: a blob of
+/// (enemy, action) field pairs, or a NUL byte followed by a command buffer (see EnemyAction)
+using EnemyBatchAiFunction = std::function<std::vector<uint8_t>(
+        const std::vector<EnemyAiInput>& enemies, const GamePosition& playerPosition)>;
+
+/// The AI of an enemy kind: one of the functions is set
+struct EnemyKindAi
+{
+    EnemyAiFunction perEnemy;
+    EnemyBatchAiFunction batched;
+    // perEnemy returns the bytes of a command buffer without enemy ids, not a text action
+    bool binary = false;
+};
+
+/// The state enemy AI decisions are made on, taken by the render thread
+struct EnemyAiSnapshot
+{
+    struct Entry
+    {
+        EnemyId id;
+        std::string kind;
+        GamePosition position;
+    };
+
+    std::vector<Entry> enemies;
+    GamePosition playerPosition;
+};
+
+/**
+ * A single decision of an enemy AI
+ *
+ * Actions are passed around in command buffers: for each action, the enemy id (8 bytes), the
+ * opcode (1 byte) and as many operands as the opcode takes (8-byte doubles), all of them
+ * little-endian. Modules send the same, except that the per-enemy AI leaves the ids out
+ */
+struct EnemyAction
+{
+    enum class Type : uint8_t
+    {
+        JUMP = 1,          // args: speed
+        LOOK_AT = 2,       // args: x, y, z
+        SET_SPEED = 3,     // args: speed
+        ATTACK_PLAYER = 4, // args: max distance, damage
+    };
+
+    static const size_t MAX_ARGS = 3;
+
+    EnemyId enemy;
+    Type type;
+    double args[MAX_ARGS];
+};
+
+void appendEnemyAction(std::vector<uint8_t>& buffer, const EnemyAction& action);
+
+/// Decodes the action at `position` and moves past it. Returns false at the end of the
+/// buffer, throws if the action is malformed. Does not allocate
+bool readEnemyAction(const std::vector<uint8_t>& buffer, size_t& position, EnemyAction& action);
+
+struct EnemyAiResults
+{
+    // A command buffer
+    std::vector<uint8_t> actions;
+    // Enemies whose AI has thrown, they are to be removed
+    std::vector<EnemyId> failed;
+};
+
+/// Parses a text action, such as "lookAt 1 2 3". "pass" is no action
+std::optional<EnemyAction> parseEnemyAction(EnemyId enemy, const std::string& action);
+
+/**
+ * Runs enemy AI functions on a thread of its own
+ *
+ * AI functions call modules, which takes a round trip each, so the render thread does not
+ * call them. Instead it takes a snapshot of the enemies and the player every 1/rate seconds
+ * of simulation time, and the AI thread calls the functions on it. The actions they return
+ * are collected and published as a whole; the render thread applies them when it finds
+ * them published, without waiting for them. Enemies keep moving the way they did until then.
+ *
+ * Kinds with a batched AI function get a single call for all of their enemies per snapshot.
+ *
+ * Not every enemy gets into every snapshot. Enemies closer to the player than `lodDistance`
+ * do, and every doubling of the distance halves their rate, down to 1/MAX_LOD_PERIOD of it.
+ * Enemies with the same period are spread over its snapshots by their ids, so that the AI
+ * work per snapshot stays about the same instead of coming in bursts
+ */
+class EnemyAi
+{
+public:
+    static const uint64_t MAX_LOD_PERIOD = 8;
+
+    EnemyAi(double rate, double _lodDistance);
+    EnemyAi(const EnemyAi& other) = delete;
+    EnemyAi(EnemyAi&& other) = delete;
+
+    EnemyAi& operator=(const EnemyAi& other) = delete;
+    EnemyAi& operator=(EnemyAi&& other) = delete;
+
+    /// Render thread. Whether a snapshot is due after a simulation step of `dt` seconds
+    bool isSnapshotDue(double dt);
+    /// Render thread, after isSnapshotDue(). Whether an enemy `distance` away from the player
+    /// gets into the snapshot
+    bool isEnemyDue(EnemyId id, double distance) const;
+    /// Render thread. The snapshot to fill; it holds an old one, which has to be cleared
+    EnemyAiSnapshot& getSnapshot();
+    void publishSnapshot();
+
+    /// Render thread. Takes the results published since the last call, if any
+    bool takeResults(EnemyAiResults& results);
+
+protected:
+    void loop() noexcept;
+    void think(const EnemyAiSnapshot& snapshot, EnemyAiResults& results);
+    void thinkBatch(const std::string& kind,
+                    std::vector<EnemyAiInput>& batch,
+                    const GamePosition& playerPosition,
+                    EnemyAiResults& results);
+    const EnemyKindAi& getKindAi(const std::string& kind);
+
+    FixedTimestep schedule;
+    uint64_t snapshotCount = 0;
+    double lodDistance;
+    DoubleBuffer<EnemyAiSnapshot> snapshots;
+    DoubleBuffer<EnemyAiResults> results;
+
+    // AI thread only. Kinds cannot be changed once added, so they are looked up once
+    std::unordered_map<std::string, EnemyKindAi> aiByKind;
+    // AI thread only. Enemies of batched kinds, collected from a snapshot
+    std::unordered_map<std::string, std::vector<EnemyAiInput>> batches;
+
+    std::thread thread;
+};
+
+EnemyAi& getEnemyAi();
+
 #endif /* end of include guard: GAME_AI_HPP */
@@ -3,13 +3,13 @@
 
 #include <functional>
 #include <mutex>
+#include <optional>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <modbox/game/ai.hpp>
 #include <modbox/geometry/game_position.hpp>
 
-using EnemyId = uint64_t;
-
 // XXX: maybe rename to Mob
 
 /**
@@ -44,7 +44,10 @@ public:
 
     irr::scene::ISceneNode* sceneNode() const;
 
-    virtual void ai();
+    /// Carry out a decision of the AI
+    virtual void apply(const EnemyAction& action);
+    /// One simulation step of `dt` seconds
+    virtual void step(double dt);
 
 protected:
     EnemyId id;
@@ -76,19 +79,38 @@ public:
 
     void addKind(const std::string& kind,
                  const std::function<void(EnemyId)>& creationFunction,
-                 const std::function<std::string(EnemyId)>& aiFunction,
-                 double healthMax);
-    std::function<std::string(EnemyId)> getAiFunction(const std::string& kind);
-
-    void processAi();
+                 const EnemyAiFunction& aiFunction,
+                 double healthMax,
+                 bool binary = false);
+    void addBatchedKind(const std::string& kind,
+                        const std::function<void(EnemyId)>& creationFunction,
+                        const EnemyBatchAiFunction& aiFunction,
+                        double healthMax);
+    EnemyKindAi getKindAi(const std::string& kind);
+
+    /// Applies the AI decisions made since the last call and moves the enemies
+    void processAi(double dt);
 
 private:
+    /// Re-sorts the enemies into active and frozen ones if the player has changed chunk
+    void updateActiveEnemies(const GamePosition& playerPosition);
+
+    void registerKind(const std::string& kind,
+                      const std::function<void(EnemyId)>& creationFunction,
+                      const EnemyKindAi& ai,
+                      double healthMax);
+
     mutable std::recursive_mutex mutex;
-    std::unordered_map<std::string, std::function<std::string(EnemyId)>> aiFunctionsByKind;
+    std::unordered_map<std::string, EnemyKindAi> aiByKind;
     std::unordered_map<std::string, std::function<void(EnemyId)>> creationFunctionsByKind;
     std::unordered_map<EnemyId, Enemy> enemies;
+    // Enemies in the chunks loaded around activeAreaCenter, the only ones processAi() walks.
+    // The others are frozen: they are only looked at again when the player changes chunk
+    std::unordered_set<EnemyId> activeEnemies;
+    std::optional<GamePosition> activeAreaCenter;
     std::unordered_map<std::string, double> healthMaximumsByKind;
     std::vector<EnemyId> deferredDeleteQueue;
+    EnemyAiResults aiResults;
     EnemyId idCounter = 0;
 };
 
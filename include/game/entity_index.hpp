@@ -0,0 +1,66 @@
+#ifndef GAME_ENTITY_INDEX_HPP
+#define GAME_ENTITY_INDEX_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+#include <modbox/game/ai.hpp>
+#include <modbox/game/game_object.hpp>
+
+#include <irrlicht_wrapper.hpp>
+
+/**
+ * Tells what a scene node is: a drawable, an enemy, a game object
+ *
+ * Ray intersections give scene nodes, which used to be looked up by scanning the drawables,
+ * the enemies and the game objects. The managers of those keep this index up to date as
+ * they create and delete them instead, so a node is resolved in constant time.
+ *
+ * A node may be a drawable and an enemy (or a game object) at once, as modules make
+ * enemies out of drawables. Forgetting an entity takes its id as well as its node, so that a
+ * node reused by a newer entity is not forgotten by mistake
+ */
+class EntityIndex
+{
+public:
+    EntityIndex() = default;
+    EntityIndex(const EntityIndex& other) = delete;
+    EntityIndex(EntityIndex&& other) = delete;
+
+    EntityIndex& operator=(const EntityIndex& other) = delete;
+    EntityIndex& operator=(EntityIndex&& other) = delete;
+
+    void addDrawable(irr::scene::ISceneNode* node, uint64_t handle);
+    void addEnemy(irr::scene::ISceneNode* node, EnemyId id);
+    void addGameObject(irr::scene::ISceneNode* node, GameObjectId id);
+
+    void forgetDrawable(irr::scene::ISceneNode* node, uint64_t handle);
+    void forgetEnemy(irr::scene::ISceneNode* node, EnemyId id);
+    void forgetGameObject(irr::scene::ISceneNode* node, GameObjectId id);
+
+    std::optional<uint64_t> findDrawable(irr::scene::ISceneNode* node) const;
+    std::optional<EnemyId> findEnemy(irr::scene::ISceneNode* node) const;
+    std::optional<GameObjectId> findGameObject(irr::scene::ISceneNode* node) const;
+
+protected:
+    struct Entry
+    {
+        std::optional<uint64_t> drawable;
+        std::optional<EnemyId> enemy;
+        std::optional<GameObjectId> gameObject;
+    };
+
+    // Clears `field` of the node's entry if it holds `id`, and drops the entry once it is empty
+    void forget(irr::scene::ISceneNode* node, std::optional<uint64_t> Entry::*field, uint64_t id);
+    std::optional<uint64_t> find(irr::scene::ISceneNode* node,
+                                 std::optional<uint64_t> Entry::*field) const;
+
+    mutable std::mutex mutex;
+    std::unordered_map<irr::scene::ISceneNode*, Entry> entries;
+};
+
+EntityIndex& getEntityIndex();
+
+#endif /* end of include guard: GAME_ENTITY_INDEX_HPP */
@@ -1,21 +1,29 @@
 #ifndef GAME_GAME_LOOP_HPP
 #define GAME_GAME_LOOP_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <exception>
 #include <functional>
-#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <vector>
 
 #include <modbox/core/destroy.hpp>
 #include <modbox/game/player.hpp>
 #include <modbox/log/log.hpp>
+#include <modbox/util/mpsc_queue.hpp>
 #include <modbox/util/util.hpp>
 
 void drawBarrier();
 
-std::recursive_mutex& getDrawFunctionsMutex();
 std::recursive_mutex& getIrrlichtMutex();
 extern std::atomic<bool> safeDrawFunctionsRun; // Костыль, но работает
 
@@ -23,66 +31,139 @@ std::thread::id getDrawThreadId();
 
 Player& getPlayer();
 
+/**
+ * A function queued for the draw thread
+ *
+ * It is a plain value, so that the queue nodes can hold it without allocating: `run` gets
+ * the task itself and finds what to call in `data`. That is either the function itself,
+ * when it is small and trivially copyable, or a pointer to it. `run` must not throw
+ */
+struct DrawTask
+{
+    static const size_t DATA_SIZE = 48;
+
+    void (*run)(DrawTask& task) = nullptr;
+    alignas(std::max_align_t) unsigned char data[DATA_SIZE];
+};
+
+MpscQueue<DrawTask>& getDrawTaskQueue();
+
+/// Lets a thread wait for a draw task to be done, and get the exception it has thrown
+class DrawTaskCompletion
+{
+public:
+    void complete(std::exception_ptr _exception) noexcept;
+    void wait();
+
+protected:
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool done = false;
+    std::exception_ptr exception;
+};
+
+// Runs `body` on the draw thread and waits for it. Nothing is allocated: the task only holds
+// a pointer into the stack of the waiting thread
+template <typename Body>
+void runDrawTaskAndWait(Body& body)
+{
+    struct Context
+    {
+        Body* body;
+        DrawTaskCompletion completion;
+    };
+    Context context;
+    context.body = &body;
+
+    DrawTask task;
+    task.run = [](DrawTask& self) {
+        Context* context = *std::launder(reinterpret_cast<Context**>(self.data));
+        std::exception_ptr exception;
+        try {
+            (*context->body)();
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        context->completion.complete(exception);
+    };
+    new (task.data) Context*(&context);
+    getDrawTaskQueue().push(task);
+    context.completion.wait();
+}
+
+// Nobody waits for a detached draw function, so its exceptions are only logged
+template <typename F>
+void callDetachedDrawFunction(const F& func) noexcept
+{
+    try {
+        func();
+    } catch (const std::exception& e) {
+        LOG("Draw function threw exception: " << wstring_cast(e.what()));
+    } catch (...) {
+        LOG("Draw function threw unknown exception");
+    }
+}
+
+// Queues a copy of `func` for the draw thread without waiting for it
+template <typename F>
+void runDrawTaskDetached(const F& func)
+{
+    DrawTask task;
+    if constexpr (std::is_trivially_copyable_v<F> && sizeof(F) <= DrawTask::DATA_SIZE
+                  && alignof(F) <= alignof(std::max_align_t)) {
+        task.run = [](DrawTask& self) {
+            callDetachedDrawFunction(*std::launder(reinterpret_cast<F*>(self.data)));
+        };
+        new (task.data) F(func);
+    } else {
+        task.run = [](DrawTask& self) {
+            std::unique_ptr<F> f(*std::launder(reinterpret_cast<F**>(self.data)));
+            callDetachedDrawFunction(*f);
+        };
+        new (task.data) F*(new F(func));
+    }
+    getDrawTaskQueue().push(task);
+}
+
 template <typename F>
 auto addDrawFunction(const F& func, bool barrier = false) -> decltype(func())
 {
     LOG("Adding draw function");
     using ReturnType = decltype(func());
-    extern std::vector<std::packaged_task<void()>> drawFunctions;
-    extern std::recursive_mutex drawFunctionsMutex;
 
     static_assert(
             std::is_same_v<
                     ReturnType,
-                    void> || std::is_default_constructible_v<ReturnType> || (std::is_copy_assignable_v<ReturnType> && std::is_copy_constructible_v<ReturnType>),
-            "ReturnType is neither void, nor default constructible, nor copy "
-            "constructible&assignable");
+                    void> || std::is_default_constructible_v<ReturnType> || std::is_copy_constructible_v<ReturnType>,
+            "ReturnType is neither void, nor default constructible, nor copy constructible");
     if (!safeDrawFunctionsRun || std::this_thread::get_id() == getDrawThreadId()) {
         LOG("Running draw function in-place");
         return func();
     }
     if constexpr (std::is_same_v<ReturnType, void>) {
-        {
-            std::lock_guard<std::recursive_mutex> lock(drawFunctionsMutex);
-            drawFunctions.emplace_back([=]() { func(); });
-        }
         if (barrier) {
-            std::future<void> future = drawFunctions.back().get_future();
-            future.wait();
+            runDrawTaskAndWait(func);
+        } else {
+            runDrawTaskDetached(func);
         }
         LOG("Draw function called");
         return;
     } else if constexpr (std::is_default_constructible_v<ReturnType>) {
         ReturnType ret;
-        std::future<void> future;
-        {
-            std::lock_guard<std::recursive_mutex> lock(drawFunctionsMutex);
-            drawFunctions.emplace_back([&]() { ret = func(); });
-            future = drawFunctions.back().get_future();
-        }
-        future.wait();
+        auto body = [&]() { ret = func(); };
+        runDrawTaskAndWait(body);
         LOG("Draw function called");
         return ret;
-
-    } else if constexpr (std::is_copy_assignable_v<
-                                 ReturnType> && std::is_copy_constructible_v<ReturnType>) {
-        ReturnType* ret;
-        std::future<void> future;
-        {
-            std::lock_guard<std::recursive_mutex> lock(drawFunctionsMutex);
-            drawFunctions.emplace_back([&]() { ret = new ReturnType(func()); });
-            future = drawFunctions.back().get_future();
-        }
-        future.wait();
-        ReturnType retval(*ret);
-        delete ret;
+    } else if constexpr (std::is_copy_constructible_v<ReturnType>) {
+        std::optional<ReturnType> ret;
+        auto body = [&]() { ret.emplace(func()); };
+        runDrawTaskAndWait(body);
         LOG("Draw function called");
-        return retval;
+        return *ret;
     }
 }
 
 void gameLoop();
 void drawLoop();
-void eachTickWithParam(const std::string& name, uint64_t param);
 
 #endif /* end of include guard: GAME_GAME_LOOP_HPP */
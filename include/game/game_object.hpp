@@ -55,6 +55,10 @@ public:
     const GameObject& access(GameObjectId id);
     GameObject& mutableAccess(GameObjectId id);
     std::optional<GameObjectId> reverseLookup(irr::scene::ISceneNode* drawable);
+    /// Render thread. Updates the positions of game objects in the spatial index, as they may
+    /// have been moved through their drawables or by physics. Does nothing if the manager is
+    /// busy, so as not to block
+    void updatePositions();
 
     void addKind(const std::string& kind);
     void addRecipe(const std::string& kind,
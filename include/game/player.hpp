@@ -26,6 +26,16 @@ public:
     void setHealthMax(double health);
     bool isDead() const;
 
+    /// Record where the simulation step has left the player. Call it at the end of each step
+    void step();
+
+    /**
+     * Put the camera `alpha` of the way from where the player was before the last simulation
+     * step to where that step has moved it. Only the drawn camera is moved, getPosition() still
+     * returns the position after the last step
+     */
+    void interpolate(double alpha);
+
     GamePosition getPosition();
     core::vector3df getRotation();
     GamePosition getCameraTarget();
@@ -37,7 +47,10 @@ private:
     irr::scene::ICameraSceneNode* camera;
     irr::scene::ISceneNode* pseudoCamera;
     irr::core::vector3df rotation;
-    irr::core::vector3df cachedPosition;
+    // Positions before and after the last simulation step. The latter is the one the
+    // simulation sees, the camera is drawn between them
+    irr::core::vector3df previousStepPosition;
+    irr::core::vector3df lastStepPosition;
 };
 
 #endif /* end of include guard: INCLUDE_GAME_PLAYER_HPP */
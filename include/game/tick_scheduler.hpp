@@ -0,0 +1,104 @@
+#ifndef GAME_TICK_SCHEDULER_HPP
+#define GAME_TICK_SCHEDULER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <modbox/core/core.hpp>
+#include <modbox/util/handle_storage.hpp>
+#include <modbox/util/thread_pool.hpp>
+
+/// Latency accounting of a single each-tick callback
+struct TickCallbackStats
+{
+    uint64_t calls = 0;
+    // Ticks on which the callback was not called because it was late
+    uint64_t skipped = 0;
+    // Calls that finished after the deadline of their tick
+    uint64_t overruns = 0;
+    double totalSeconds = 0.0;
+    double maxSeconds = 0.0;
+};
+
+/**
+ * Calls each-tick FuncProviders
+ *
+ * Callbacks are grouped into lanes: one per module that added them, plus one per
+ * callback added by the engine itself. Lanes run concurrently on a thread pool, callbacks
+ * of a lane run one after another in the order they were added, so one slow module only
+ * delays itself, and a module is never called by the scheduler from two threads at once.
+ *
+ * tick() does not wait for the lanes. Each tick has a deadline `budget` away from its
+ * start: a lane does not start callbacks after the deadline, except its first one, the rest
+ * of them are skipped, and the next time the lane starts with the first skipped one, so
+ * that none of them starves, even in a lane that is always dispatched late. A lane that is still running when the next tick comes is not dispatched again:
+ * the ticks it misses are coalesced into the one it is running.
+ *
+ * A callback that throws is logged and removed, the others are not affected
+ */
+class TickScheduler
+{
+public:
+    TickScheduler(size_t threadCount, std::chrono::steady_clock::duration _budget);
+    TickScheduler(const TickScheduler& other) = delete;
+    TickScheduler(TickScheduler&& other) = delete;
+
+    TickScheduler& operator=(const TickScheduler& other) = delete;
+    TickScheduler& operator=(TickScheduler&& other) = delete;
+
+    /// Call `command` with `param` every tick, in lane `laneName`. Returns the callback handle
+    uint64_t add(const std::string& command, uint64_t param, const std::string& laneName);
+    void remove(uint64_t handle);
+    TickCallbackStats getStats(uint64_t handle);
+
+    /// Dispatch the lanes which are not busy with previous ticks
+    void tick();
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    struct Callback
+    {
+        CommandId command;
+        std::string commandName;
+        uint64_t param;
+        std::string laneName;
+        TickCallbackStats stats;
+    };
+
+    struct Lane
+    {
+        // Callback handles in the order of execution
+        std::vector<uint64_t> callbacks;
+        // Handle of the callback to start the next run with, 0 means the first one
+        uint64_t resumeFrom = 0;
+        bool running = false;
+    };
+
+    void runLane(const std::string& laneName,
+                 const std::vector<uint64_t>& order,
+                 Clock::time_point deadline);
+    void finishCall(uint64_t handle, double seconds, bool overrun);
+    void removeLocked(uint64_t handle);
+
+    Clock::duration budget;
+
+    std::mutex mutex;
+    HandleStorage<uint64_t, Callback> callbacks;
+    std::unordered_map<std::string, Lane> lanes;
+
+    ThreadPool pool;
+};
+
+TickScheduler& getTickScheduler();
+
+/// Call FuncProvider `name` with `param` every tick. Returns the callback handle
+uint64_t eachTickWithParam(const std::string& name, uint64_t param);
+
+void initializeTickScheduler();
+
+#endif /* end of include guard: GAME_TICK_SCHEDULER_HPP */
@@ -0,0 +1,111 @@
+#ifndef GAME_TIMER_SERVICE_HPP
+#define GAME_TIMER_SERVICE_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <modbox/core/core.hpp>
+#include <modbox/util/handle_storage.hpp>
+#include <modbox/util/thread_pool.hpp>
+#include <modbox/util/timer_wheel.hpp>
+
+/**
+ * One-shot and periodic timers for modules
+ *
+ * Timers live in a TimerWheel driven by a thread of its own, `resolution` being the length
+ * of a wheel tick. When a timer expires, its callback FuncProvider (ArgsSpec "b") is called
+ * with a blob of NUL-terminated fields: the timer handle and its parameter, for each timer.
+ * Expirations with the same owner (the module that added the timer) and the same callback
+ * are coalesced: they come in a single call, and while a call is in progress the new ones
+ * are collected for the next call instead of calling the module again concurrently.
+ *
+ * A periodic timer is rescheduled from its previous expiry, not from the moment it was
+ * handled, so it does not drift. If it falls behind, the periods it has missed are dropped.
+ *
+ * A callback that throws is logged, and all the timers of its owner that call it are
+ * cancelled, the others are not affected
+ */
+class TimerService
+{
+public:
+    TimerService(std::chrono::steady_clock::duration _resolution, size_t threadCount);
+    TimerService(const TimerService& other) = delete;
+    TimerService(TimerService&& other) = delete;
+
+    TimerService& operator=(const TimerService& other) = delete;
+    TimerService& operator=(TimerService&& other) = delete;
+
+    /// Call `callback` after `delay` seconds, then every `period` seconds unless it is 0
+    uint64_t add(const std::string& owner,
+                 const std::string& callback,
+                 uint64_t param,
+                 double delay,
+                 double period);
+
+    /**
+     * Returns false if the timer has already expired or been cancelled. Only `owner`, the one
+     * who has added the timer, may cancel it, anybody else gets an exception
+     */
+    bool cancel(uint64_t timer, const std::string& owner);
+
+    /// Cancel all the timers of `owner`, returns how many there were
+    size_t cancelOwned(const std::string& owner);
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    struct Timer
+    {
+        std::string owner;
+        CommandId callback;
+        uint64_t param;
+        // 0 for one-shot timers
+        uint64_t periodTicks;
+        uint64_t wheelTimer;
+    };
+
+    /// Expirations waiting to be delivered to a single callback of a single owner
+    struct Batch
+    {
+        std::string owner;
+        CommandId callback;
+        std::vector<uint8_t> blob;
+        bool running = false;
+    };
+
+    void loop() noexcept;
+    void expire(const TimerWheel::Expiration& expiration);
+    void deliver(const std::string& batchKey) noexcept;
+    /// Cancel the timers of `owner` which call `callback`, or all of them if it is nullptr
+    size_t cancelOwnedLocked(const std::string& owner, const CommandId* callback);
+
+    uint64_t tickAt(Clock::time_point time) const;
+    uint64_t ticksFor(double seconds) const;
+
+    Clock::time_point start;
+    Clock::duration resolution;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    TimerWheel wheel;
+    HandleStorage<uint64_t, Timer> timers;
+    std::unordered_map<std::string, Batch> batches;
+
+    ThreadPool pool;
+    std::thread thread;
+};
+
+TimerService& getTimerService();
+
+void initializeTimerService();
+
+/// Cancel the timers of a module which has exited
+void cancelModuleTimers(const std::string& moduleName);
+
+#endif /* end of include guard: GAME_TIMER_SERVICE_HPP */
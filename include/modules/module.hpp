@@ -5,6 +5,21 @@
 #include <mutex>
 #include <string>
 #include <vector>
+
+#include <modbox/net/connection.hpp>
+
+/**
+ * Wire protocol spoken by a module, chosen by the module in its header
+ *
+ * mpText: every value is a NUL-terminated string (header "ModBox/m")
+ * mpBinary: length-prefixed frames with native values (header "ModBv2/m")
+ */
+enum ModuleProtocol
+{
+    mpText = 1,
+    mpBinary = 2
+};
+
 /**
  * Represents a module
  */
@@ -12,10 +27,11 @@
 class Module
 {
 public:
-    Module(int _mainSocket,
-           int _reverseSocket,
+    Module(std::shared_ptr<Connection> _mainConnection,
+           std::shared_ptr<Connection> _reverseConnection,
            const std::string& _name,
-           const std::vector<std::string>& _dependencies);
+           const std::vector<std::string>& _dependencies,
+           ModuleProtocol _protocol = mpText);
     Module(const Module& other);
     Module(Module&& other) = default;
     virtual ~Module() = default;
@@ -27,16 +43,19 @@ public:
 
     std::string getName() const;
 
-    int getMainSocket() const;
-    int getReverseSocket() const;
+    std::shared_ptr<Connection> getMainConnection() const;
+    std::shared_ptr<Connection> getReverseConnection() const;
 
     std::vector<std::string> getDependencies() const;
 
+    ModuleProtocol getProtocol() const;
+
 protected:
-    int mainSocket;
-    int reverseSocket;
+    std::shared_ptr<Connection> mainConnection;
+    std::shared_ptr<Connection> reverseConnection;
     std::string name;
     std::vector<std::string> dependencies;
+    ModuleProtocol protocol;
     mutable std::recursive_mutex mtx;
 };
 
@@ -4,15 +4,78 @@
 #include <cassert>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 #include <modbox/core/core.hpp>
 #include <modbox/core/dyntype.hpp>
 #include <modbox/core/memory_manager.hpp>
 #include <modbox/log/log.hpp>
+#include <modbox/modules/module.hpp>
+#include <modbox/net/connection.hpp>
 
-void readModuleHeader(int sock);
-void readReverseModuleHeader(int sock);
-std::string readModuleName(int sock);
+ModuleProtocol readModuleHeader(Connection& conn);
+ModuleProtocol readReverseModuleHeader(Connection& conn);
+std::string readModuleName(Connection& conn);
+
+/**
+ * Builds a single frame of the binary (v2) module protocol
+ *
+ * A frame is a 32-bit little-endian payload length followed by the payload.
+ * Integers and floats are stored as 8 little-endian bytes, strings and blobs
+ * as a 32-bit length followed by raw bytes
+ */
+class MessageWriter
+{
+public:
+    MessageWriter() = default;
+
+    void writeByte(uint8_t value);
+    void writeUint32(uint32_t value);
+    void writeInt(int64_t value);
+    void writeUint(uint64_t value);
+    void writeFloat(double value);
+    void writeString(const std::string& value);
+    void writeBlob(const std::vector<uint8_t>& value);
+
+    /// Write a value given in its text form as the type `type` from an ArgsSpec
+    void writeValue(char type, const std::string& value);
+
+    /// Put the frame into the send buffer of the connection. Does not flush it
+    void send(Connection& conn) const;
+
+protected:
+    void writeRaw(const void* data, size_t length);
+
+    std::vector<uint8_t> payload;
+};
+
+/**
+ * Receives a single frame of the binary (v2) module protocol and parses values out of it
+ */
+class MessageReader
+{
+public:
+    explicit MessageReader(Connection& conn);
+
+    uint8_t readByte();
+    uint32_t readUint32();
+    int64_t readInt();
+    uint64_t readUint();
+    double readFloat();
+    std::string readString();
+    std::vector<uint8_t> readBlob();
+
+    /// Read a value of the type `type` from an ArgsSpec and return its text form
+    std::string readValue(char type);
+
+    bool atEnd() const;
+
+protected:
+    void readRaw(void* data, size_t length);
+
+    std::vector<uint8_t> payload;
+    size_t position = 0;
+};
 
 template <typename T>
 T getArgument(const std::vector<std::string>& args, size_t idx)
@@ -1,6 +1,7 @@
 #ifndef MODULES_MODULE_MANAGER_HPP
 #define MODULES_MODULE_MANAGER_HPP
 
+#include <condition_variable>
 #include <functional>
 #include <string>
 #include <thread>
@@ -10,6 +11,7 @@
 
 #include <modbox/core/core.hpp>
 #include <modbox/modules/module.hpp>
+#include <modbox/util/counting_mutex.hpp>
 #include <modbox/util/handle_storage.hpp>
 
 // TEMP: maybe we should change it to something more complex
@@ -32,9 +34,9 @@ public:
     // ModuleId addModule(int sock);
     // void deleteModule(ModuleId id);
 
-    void registerModuleWorker(ModuleWorker& worker,
-                              std::thread::id threadId = std::this_thread::get_id());
-    ModuleWorker& getModuleWorkerByThreadId(std::thread::id threadId);
+    /// Set the worker whose module the current thread is serving (nullptr if none)
+    void setCurrentModuleWorker(ModuleWorker* worker);
+    ModuleWorker& getCurrentModuleWorker();
 
     void registerModule(const Module& module);
     void unregisterModule(const std::string& moduleName);
@@ -60,9 +62,15 @@ public:
     ModuleWorker& operator=(ModuleWorker&& other) = default;
     ~ModuleWorker();
 
-    void work();
+    /// Serve the module in the current thread until it disconnects, then finish()
     void please_work() noexcept;
 
+    /// Read one request from the main connection and execute it (or submit it, if pipelined)
+    void serveRequest();
+
+    /// Clean up after the module has disconnected
+    void finish() noexcept;
+
     std::function<FuncResult(const std::vector<std::string>&)> registerModuleFuncProvider(
             const std::string& name,
             std::string argTypes,
@@ -74,8 +82,56 @@ public:
     Module& getModule();
 
 private:
-    mutable std::mutex reverseMutex;
+    void submitRequest(uint32_t requestId, std::function<void()> execute);
+    void executeRequest(uint32_t requestId,
+                        const FuncProviderEntry& entry,
+                        const std::vector<std::string>& args);
+    void executeBinaryRequest(uint32_t requestId,
+                              const FuncProviderEntry& entry,
+                              MessageReader& request);
+    void work();
+    void waitForPendingRequests();
+
+    std::vector<std::string> runModuleFuncMultiplexed(const std::string& command,
+                                                      const std::string& argTypes,
+                                                      const std::string& retTypes,
+                                                      const std::vector<std::string>& arguments);
+    void readReverseReply();
+    void failReverseCalls(const std::string& error);
+
+    /// An engine->module call waiting for its reply (binary protocol)
+    struct ReverseCall
+    {
+        std::string retTypes;
+        bool done = false;
+        bool failed = false;
+        std::string error;
+        std::vector<std::string> result;
+    };
+
+    // Held while sending a reverse request. With the text protocol also held until the reply
+    // is received, since there is no way to tell replies apart
+    mutable CountingMutex reverseMutex;
     mutable std::recursive_mutex mainMutex;
+
+    // Replies to pipelined requests are sent from pool threads
+    CountingMutex mainSendMutex;
+
+    // Pipelined requests which are still being executed
+    std::mutex pendingMutex;
+    std::condition_variable pendingCondition;
+    size_t pendingRequests = 0;
+
+    // Reverse calls waiting for replies, by correlation ID. One of the waiting callers at a time
+    // reads the replies, see runModuleFuncMultiplexed()
+    std::mutex reverseCallsMutex;
+    std::condition_variable reverseCallsCondition;
+    std::unordered_map<uint32_t, ReverseCall*> reverseCalls;
+    uint32_t nextReverseCallId = 1;
+    bool reverseReading = false;
+    bool reverseBroken = false;
+    std::string reverseError;
+
     std::unordered_set<std::string> moduleFuncs;
     Module module;
 };
@@ -0,0 +1,65 @@
+#ifndef MODULES_MODULE_REACTOR_HPP
+#define MODULES_MODULE_REACTOR_HPP
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <modbox/modules/module.hpp>
+#include <modbox/modules/module_manager.hpp>
+#include <modbox/util/thread_pool.hpp>
+
+/**
+ * Serves the main connections of socket-connected modules with a fixed number of threads
+ *
+ * One thread waits on all the sockets with epoll. When a module sends something, a
+ * pool thread serves its requests: up to MAX_REQUESTS_PER_TURN of them, while more data
+ * is already there, and then the socket goes back to epoll. A module is served by at
+ * most one thread at a time (EPOLLONESHOT), so its requests are still executed in order,
+ * except for the pipelined ones, which have never been ordered anyway.
+ *
+ * A module that sends half a request keeps its pool thread waiting for the rest. A request
+ * which calls a module function waits for the reply in a ThreadPool::BlockingSection, so
+ * nested calls between modules cannot use up the pool
+ */
+class ModuleReactor
+{
+public:
+    explicit ModuleReactor(size_t workerCount);
+    ModuleReactor(const ModuleReactor& other) = delete;
+    ModuleReactor(ModuleReactor&& other) = delete;
+
+    ModuleReactor& operator=(const ModuleReactor& other) = delete;
+    ModuleReactor& operator=(ModuleReactor&& other) = delete;
+
+    /// Start serving a module. Its main connection must be a SocketConnection
+    void addModule(Module&& module);
+
+    static const size_t MAX_REQUESTS_PER_TURN = 64;
+
+protected:
+    struct Entry
+    {
+        std::shared_ptr<ModuleWorker> worker;
+        // Tells this module from an earlier one which had the same socket number
+        uint32_t generation;
+    };
+
+    void loop() noexcept;
+    void serve(int sock, uint32_t generation, std::shared_ptr<ModuleWorker> worker) noexcept;
+    void removeModule(int sock, std::shared_ptr<ModuleWorker> worker) noexcept;
+    void arm(int sock, uint32_t generation, int operation);
+
+    int epollFd;
+    ThreadPool pool;
+
+    // Workers by the socket of their main connection
+    std::mutex workersMutex;
+    std::unordered_map<int, Entry> workers;
+    uint32_t nextGeneration = 0;
+
+    std::thread thread;
+};
+
+#endif /* end of include guard: MODULES_MODULE_REACTOR_HPP */
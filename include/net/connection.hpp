@@ -0,0 +1,83 @@
+#ifndef NET_CONNECTION_HPP
+#define NET_CONNECTION_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <modbox/net/socketlib.hpp>
+
+/**
+ * Byte stream between the engine and a module
+ *
+ * Writes are buffered until flush(). Reads block until enough data arrives and
+ * throw std::runtime_error on EOF or after shutdown(). One thread may read and
+ * another one may write at the same time; several writers must take turns
+ * themselves, connections have no locks of their own
+ */
+class Connection
+{
+public:
+    Connection() = default;
+    Connection(const Connection& other) = delete;
+    Connection(Connection&& other) = delete;
+    virtual ~Connection() = default;
+
+    Connection& operator=(const Connection& other) = delete;
+    Connection& operator=(Connection&& other) = delete;
+
+    virtual void send(const void* data, size_t length) = 0;
+    virtual void flush() = 0;
+    virtual void recv(void* data, size_t length) = 0;
+
+    /// Read a NUL-terminated string (the terminator is dropped)
+    virtual std::string recvString() = 0;
+
+    /// Whether a read would return at least one byte (or fail) without waiting
+    virtual bool hasIncomingData() = 0;
+
+    /// Make blocked and future reads and writes fail, including the ones in other threads
+    virtual void shutdown() noexcept = 0;
+
+    /// Release the underlying resources. Must not be called while other threads use the connection
+    virtual void close() noexcept = 0;
+
+    void sendString(const std::string& s);
+    void sendFixed(const std::string& s);
+};
+
+// Blocks at least this large bypass the send buffer of SocketConnection
+const size_t SOCKET_DIRECT_SEND_SIZE = 64 * 1024;
+
+/**
+ * Connection over a stream socket (TCP or AF_UNIX)
+ *
+ * Owns its send and receive buffers and syscall statistics, so the I/O path
+ * takes no locks shared with other connections. Blocks of at least
+ * SOCKET_DIRECT_SEND_SIZE bytes are not copied into the send buffer: they are
+ * written out right away, together with whatever is buffered, by a single
+ * writev-like call
+ */
+class SocketConnection : public Connection
+{
+public:
+    explicit SocketConnection(int _sock);
+
+    void send(const void* data, size_t length) override;
+    void flush() override;
+    void recv(void* data, size_t length) override;
+    std::string recvString() override;
+    bool hasIncomingData() override;
+    void shutdown() noexcept override;
+    void close() noexcept override;
+
+    int getSocket() const;
+
+protected:
+    int sock;
+    std::vector<uint8_t> sendBuffer;
+    ReadBuffer readBuffer;
+    AtomicSocketStats stats;
+};
+
+#endif /* end of include guard: NET_CONNECTION_HPP */
@@ -1,9 +1,12 @@
 #ifndef NET_NET_HPP
 #define NET_NET_HPP
 
+#include <memory>
+#include <string>
 #include <thread>
 
 #include <modbox/modules/module.hpp>
+#include <modbox/net/connection.hpp>
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -13,4 +16,14 @@ void createModuleListenerThread();
 void joinModuleListenerThread();
 void createModuleServerThread(Module&& module);
 
+/**
+ * Finish the handshake with a module spawned by us and start serving it
+ *
+ * The connections lead to the module process we have just started (our ends of
+ * its socketpairs or its shared memory rings). They are closed if the handshake fails
+ */
+void connectSpawnedModule(const std::string& expectedName,
+                          std::shared_ptr<Connection> mainConnection,
+                          std::shared_ptr<Connection> reverseConnection);
+
 #endif /* end of include guard: NET_NET_HPP */
@@ -0,0 +1,122 @@
+#ifndef NET_SHM_CONNECTION_HPP
+#define NET_SHM_CONNECTION_HPP
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <modbox/net/connection.hpp>
+
+#include <sys/types.h>
+
+// Rings of a segment. Main channel: requests from the module and replies to them,
+// reverse channel: requests to the module and its replies
+const size_t SHM_RING_MAIN_IN = 0;
+const size_t SHM_RING_MAIN_OUT = 1;
+const size_t SHM_RING_REVERSE_OUT = 2;
+const size_t SHM_RING_REVERSE_IN = 3;
+const size_t SHM_RING_COUNT = 4;
+
+const size_t SHM_DEFAULT_RING_CAPACITY = 256 * 1024;
+
+/**
+ * Header of a single-producer single-consumer byte ring in shared memory
+ *
+ * `head` and `tail` only grow, the position in the ring is the value modulo
+ * its capacity. A side that is going to sleep sets its waiting flag and waits
+ * on it with futex(2); the other side clears the flag and wakes it up after
+ * moving `head` or `tail`. Fields are kept on separate cache lines
+ */
+struct ShmRingHeader
+{
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> dataWaiting;
+    alignas(64) std::atomic<uint32_t> spaceWaiting;
+};
+
+/**
+ * Memory shared with a module process: a 256-byte header followed by SHM_RING_COUNT rings,
+ * each being a ShmRingHeader followed by `ringCapacity` bytes of data
+ *
+ * The segment is backed by a memfd, its descriptor is passed to the module as --shm-fd=N
+ */
+class ShmSegment
+{
+public:
+    /// Create a new segment. `ringCapacity` must be a power of two
+    static std::shared_ptr<ShmSegment> create(size_t ringCapacity = SHM_DEFAULT_RING_CAPACITY);
+
+    /// Map a segment created by another process
+    static std::shared_ptr<ShmSegment> open(int fd);
+
+    ShmSegment(const ShmSegment& other) = delete;
+    ShmSegment(ShmSegment&& other) = delete;
+    ~ShmSegment();
+
+    ShmSegment& operator=(const ShmSegment& other) = delete;
+    ShmSegment& operator=(ShmSegment&& other) = delete;
+
+    int getFd() const;
+    size_t getRingCapacity() const;
+
+    ShmRingHeader& getRing(size_t index);
+    uint8_t* getRingData(size_t index);
+
+    /// Make every wait on this segment fail, in both processes
+    void shutdown() noexcept;
+    bool isShutDown() const;
+
+protected:
+    ShmSegment(int _fd, size_t _size, uint8_t* _memory);
+
+    int fd;
+    size_t size;
+    uint8_t* memory;
+};
+
+/**
+ * Connection over a pair of rings of a shared memory segment
+ *
+ * Small calls do not touch the kernel at all when the other side is quick
+ * enough to answer while we spin. Otherwise we sleep on a futex, waking up
+ * now and then to check that the peer process is still alive
+ */
+class ShmConnection : public Connection
+{
+public:
+    ShmConnection(std::shared_ptr<ShmSegment> _segment, size_t inRing, size_t outRing, pid_t _peer);
+
+    void send(const void* data, size_t length) override;
+    void flush() override;
+    void recv(void* data, size_t length) override;
+    std::string recvString() override;
+    bool hasIncomingData() override;
+    void shutdown() noexcept override;
+    void close() noexcept override;
+
+protected:
+    void waitForData();
+    void waitForSpace();
+    void checkAlive(bool checkPeer) const;
+    void consume(uint64_t newTail);
+
+    std::shared_ptr<ShmSegment> segment;
+    ShmRingHeader& in;
+    uint8_t* inData;
+    ShmRingHeader& out;
+    uint8_t* outData;
+    uint64_t mask;
+    pid_t peer;
+
+    std::vector<uint8_t> sendBuffer;
+
+    // Statistics, logged on close()
+    std::atomic<uint64_t> bytesSent{0};
+    std::atomic<uint64_t> bytesReceived{0};
+    std::atomic<uint64_t> futexWaits{0};
+    std::atomic<uint64_t> futexWakes{0};
+};
+
+#endif /* end of include guard: NET_SHM_CONNECTION_HPP */
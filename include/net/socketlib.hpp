@@ -1,19 +1,62 @@
 #ifndef NET_SOCKET_LIB_HPP
 #define NET_SOCKET_LIB_HPP
 
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <vector>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 
-void sendBuf(int sock, const void* buf, size_t length);
-void recvBuf(int sock, void* buf, size_t length);
-std::string recvString(int sock);
-void sendString(int sock, const std::string& s);
-void sendFixed(int sock, const std::string& s);
-void flushBuffer(int sock);
+/// Number of syscalls made on a socket and the amount of data they moved
+struct SocketStats
+{
+    uint64_t sendCalls;
+    uint64_t sendBytes;
+    uint64_t recvCalls;
+    uint64_t recvBytes;
+};
 
-void sendByte(int sock, uint8_t byte);
-uint8_t recvByte(int sock);
+/// Per-socket syscall accounting, kept by the owner of the socket
+struct AtomicSocketStats
+{
+    std::atomic<uint64_t> sendCalls{0};
+    std::atomic<uint64_t> sendBytes{0};
+    std::atomic<uint64_t> recvCalls{0};
+    std::atomic<uint64_t> recvBytes{0};
+
+    SocketStats get() const;
+};
+
+/**
+ * Receive-side buffer of a socket, kept by the owner of the socket
+ *
+ * Filled by bulk recv() calls, strings and fixed-size blocks are then parsed
+ * out of it without touching the kernel. Only one thread reads from a socket
+ * at a time, so the buffer itself is not protected by a mutex
+ */
+struct ReadBuffer
+{
+    std::vector<uint8_t> data;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+void sendBuf(int sock, AtomicSocketStats& stats, const void* buf, size_t length);
+
+/// Send all the blocks with as few syscalls as possible. `iov` is modified
+void sendBufs(int sock, AtomicSocketStats& stats, iovec* iov, size_t count);
+
+void recvBuf(int sock, ReadBuffer& rb, AtomicSocketStats& stats, void* buf, size_t length);
+std::string recvString(int sock, ReadBuffer& rb, AtomicSocketStats& stats);
+
+uint8_t recvByte(int sock, ReadBuffer& rb, AtomicSocketStats& stats);
+
+/// Whether recvBuf() would return at least some data (or fail) without blocking
+bool hasIncomingData(int sock, const ReadBuffer& rb);
+
+/// Log the statistics and close the socket
+void closeSocket(int sock, const AtomicSocketStats& stats);
 
 #endif /* end of include guard: NET_SOCKET_LIB_HPP */
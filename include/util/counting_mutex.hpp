@@ -0,0 +1,56 @@
+#ifndef UTIL_COUNTING_MUTEX_HPP
+#define UTIL_COUNTING_MUTEX_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * std::mutex which counts how often it has been locked and how often a thread
+ * had to wait for it because someone else was holding it
+ *
+ * Satisfies Lockable, so it works with std::lock_guard and std::unique_lock
+ */
+class CountingMutex
+{
+public:
+    void lock()
+    {
+        if (!mutex.try_lock()) {
+            ++contentions;
+            mutex.lock();
+        }
+        ++acquisitions;
+    }
+
+    bool try_lock()
+    {
+        if (!mutex.try_lock()) {
+            return false;
+        }
+        ++acquisitions;
+        return true;
+    }
+
+    void unlock()
+    {
+        mutex.unlock();
+    }
+
+    uint64_t getAcquisitions() const
+    {
+        return acquisitions;
+    }
+
+    uint64_t getContentions() const
+    {
+        return contentions;
+    }
+
+private:
+    std::mutex mutex;
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contentions{0};
+};
+
+#endif /* end of include guard: UTIL_COUNTING_MUTEX_HPP */
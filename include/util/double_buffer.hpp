@@ -0,0 +1,79 @@
+#ifndef UTIL_DOUBLE_BUFFER_HPP
+#define UTIL_DOUBLE_BUFFER_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+
+/**
+ * Hands values of T over from one thread (the writer) to another one (the reader)
+ *
+ * The writer fills back() and publish()es it, which swaps it with the front buffer. The
+ * reader swaps the front buffer with a value of its own. The lock is only held for the
+ * swaps, so neither side waits for the other one to produce or process a value, and with
+ * containers inside T no memory is allocated once their capacities have grown: the
+ * buffers are passed around, not copied.
+ *
+ * A value published before the reader has taken the previous one replaces it. back() holds
+ * some old value after publish(), the writer has to overwrite or clear it.
+ *
+ * Located in header file, because it is a template
+ */
+template <typename T>
+class DoubleBuffer
+{
+public:
+    DoubleBuffer() = default;
+    DoubleBuffer(const DoubleBuffer& other) = delete;
+    DoubleBuffer(DoubleBuffer&& other) = delete;
+
+    DoubleBuffer& operator=(const DoubleBuffer& other) = delete;
+    DoubleBuffer& operator=(DoubleBuffer&& other) = delete;
+
+    /// Writer only
+    T& back()
+    {
+        return backValue;
+    }
+
+    /// Writer only
+    void publish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::swap(backValue, frontValue);
+            fresh = true;
+        }
+        condition.notify_one();
+    }
+
+    /// Reader only. Takes the published value if there is a new one. Never blocks
+    bool tryConsume(T& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !fresh) {
+            return false;
+        }
+        std::swap(value, frontValue);
+        fresh = false;
+        return true;
+    }
+
+    /// Reader only. Waits for a new value to be published and takes it
+    void consume(T& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]() { return fresh; });
+        std::swap(value, frontValue);
+        fresh = false;
+    }
+
+protected:
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool fresh = false;
+    T frontValue;
+    T backValue;
+};
+
+#endif /* end of include guard: UTIL_DOUBLE_BUFFER_HPP */
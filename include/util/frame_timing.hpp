@@ -0,0 +1,61 @@
+#ifndef UTIL_FRAME_TIMING_HPP
+#define UTIL_FRAME_TIMING_HPP
+
+#include <chrono>
+#include <cstddef>
+
+/**
+ * Accumulator of a fixed-timestep simulation
+ *
+ * Real time is added with advance(), which says how many steps of getStep() seconds the
+ * simulation has to make to catch up. What is left over, less than a step, is getAlpha()
+ * of a step: the fraction to interpolate rendering by between the last two steps.
+ *
+ * No more than `maxSteps` steps are asked for at once: when the simulation cannot keep up
+ * (or the process has been stopped for a while) the backlog is dropped instead of making
+ * every following frame longer still
+ */
+class FixedTimestep
+{
+public:
+    explicit FixedTimestep(double rate, size_t _maxSteps = 8);
+
+    size_t advance(double seconds);
+
+    double getStep() const;
+    double getAlpha() const;
+
+protected:
+    double step;
+    size_t maxSteps;
+    double accumulator = 0.0;
+};
+
+/**
+ * Frame rate limiter
+ *
+ * Frames are due every 1/rate seconds, counted from the previous deadline rather than from
+ * the moment wait() is called, so that the time spent on a frame does not add up with the
+ * sleep. The thread sleeps until `spin` before the deadline, and yields in a loop for the
+ * rest: sleeps overshoot by up to a scheduler tick, which would show up as jitter. A frame
+ * that is late by more than a period is not caught up with
+ */
+class FramePacer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit FramePacer(double rate,
+                        Clock::duration _spin = std::chrono::microseconds(1500));
+
+    void wait();
+
+    Clock::duration getPeriod() const;
+
+protected:
+    Clock::duration period;
+    Clock::duration spin;
+    Clock::time_point deadline;
+};
+
+#endif /* end of include guard: UTIL_FRAME_TIMING_HPP */
@@ -1,110 +1,256 @@
 #ifndef UTIL_HANDLE_STORAGE_HPP
 #define UTIL_HANDLE_STORAGE_HPP
 
-#include <map>
-#include <set>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-// Located in header file, because it is a template
+/**
+ * Slot map: values addressed by handles that are never reused while the value is alive
+ *
+ * A handle is `(generation << 32) | slot`. Every slot counts how many times it has been
+ * taken and freed: the generation is odd while the slot is taken and even while it is free,
+ * so a handle of a removed value (or one that has never been given out) no longer matches
+ * its slot and access() throws std::out_of_range instead of returning someone else's value.
+ * Since a live generation is odd, 0 is never a valid handle.
+ *
+ * Values are kept packed in a vector together with their handles, so insert(), remove()
+ * and access() are O(1) and iteration walks contiguous memory. Values are iterated in the
+ * order they were inserted until remove() moves the last value into the freed place.
+ * removeKeepingOrder() keeps the order instead, at O(n) cost. References to values are
+ * invalidated by insert() and by removal. Iterators are indices:
+ * they stay valid when values are inserted during iteration (those are visited as well),
+ * and when the current value is removed the one moved into its place is skipped
+ *
+ * Located in header file, because it is a template
+ */
 template <typename Handle, typename Value>
 class HandleStorage
 {
+    static_assert(std::is_integral_v<Handle> && std::is_unsigned_v<Handle>
+                          && sizeof(Handle) == sizeof(uint64_t),
+                  "Handles must be 64-bit unsigned integers");
+
 public:
-    HandleStorage() = default;
-    virtual ~HandleStorage() = default;
+    using Entry = std::pair<Handle, Value>;
 
-    HandleStorage(const HandleStorage<Handle, Value>& other) : storageMap(other.storageMap)
+    template <typename Storage, typename EntryType>
+    class Iterator
     {
-    }
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Entry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = EntryType*;
+        using reference = EntryType&;
+
+        Iterator(Storage* _storage, size_t _index) : storage(_storage), index(_index)
+        {
+        }
+
+        reference operator*() const
+        {
+            return storage->entries[index];
+        }
+        pointer operator->() const
+        {
+            return &storage->entries[index];
+        }
+
+        Iterator& operator++()
+        {
+            ++index;
+            return *this;
+        }
+        Iterator operator++(int)
+        {
+            Iterator old = *this;
+            ++index;
+            return old;
+        }
+
+        // end() is not a fixed position: an iterator reaches it whenever it runs past the
+        // values that are there now
+        bool operator==(const Iterator& other) const
+        {
+            bool atEnd = index >= storage->entries.size();
+            bool otherAtEnd = other.index >= other.storage->entries.size();
+            return atEnd == otherAtEnd && (atEnd || index == other.index);
+        }
+        bool operator!=(const Iterator& other) const
+        {
+            return !(*this == other);
+        }
 
-    HandleStorage(HandleStorage<Handle, Value>&& other) : storageMap(std::move(other.storageMap))
+    private:
+        Storage* storage;
+        size_t index;
+    };
+
+    using iterator = Iterator<HandleStorage, Entry>;
+    using const_iterator = Iterator<const HandleStorage, const Entry>;
+
+    Handle insert(const Value& v)
     {
+        return emplaceEntry(v);
     }
 
-    Handle insert(const Value& v)
+    Handle insert(Value&& v)
     {
-        Handle h = allocateHandle();
-        storageMap.insert(std::make_pair(h, v));
-        if (freeHandles.count(h)) {
-            freeHandles.erase(h);
-        }
-        return h;
+        return emplaceEntry(std::move(v));
     }
 
-    const Value& access(Handle h)
+    const Value& access(Handle h) const
     {
-        return storageMap.at(h);
+        return entries[findEntry(h)].second;
     }
 
     Value& mutableAccess(Handle h)
     {
-        return storageMap.at(h);
+        return entries[findEntry(h)].second;
     }
 
-    void remove(Handle h)
+    bool contains(Handle h) const
     {
-        maybeAddFreeHandle(h);
-        storageMap.erase(h);
+        uint32_t slot = slotOf(h);
+        return (generationOf(h) & 1) && slot < slots.size()
+               && slots[slot].generation == generationOf(h);
     }
 
-    auto begin()
+    void remove(Handle h)
     {
-        return storageMap.begin();
+        uint32_t entryIndex = findEntry(h);
+        uint32_t slot = slotOf(h);
+
+        uint32_t lastIndex = entries.size() - 1;
+        if (entryIndex != lastIndex) {
+            entries[entryIndex] = std::move(entries[lastIndex]);
+            slots[slotOf(entries[entryIndex].first)].entry = entryIndex;
+        }
+        entries.pop_back();
+
+        ++slots[slot].generation;
+        slots[slot].entry = firstFreeSlot;
+        firstFreeSlot = slot;
     }
-    auto end()
+
+    /// The same as remove(), but keeps the order of the other values at O(n) cost
+    void removeKeepingOrder(Handle h)
     {
-        return storageMap.end();
+        uint32_t entryIndex = findEntry(h);
+        uint32_t slot = slotOf(h);
+
+        entries.erase(entries.begin() + entryIndex);
+        for (uint32_t i = entryIndex; i < entries.size(); ++i) {
+            slots[slotOf(entries[i].first)].entry = i;
+        }
+
+        ++slots[slot].generation;
+        slots[slot].entry = firstFreeSlot;
+        firstFreeSlot = slot;
     }
-    auto rbegin()
+
+    size_t size() const
     {
-        return storageMap.rbegin();
+        return entries.size();
     }
-    auto rend()
+
+    bool empty() const
     {
-        return storageMap.rend();
+        return entries.empty();
     }
 
-    auto cbegin()
+    iterator begin()
     {
-        return storageMap.cbegin();
+        return iterator(this, 0);
     }
-    auto cend()
+    iterator end()
     {
-        return storageMap.cend();
+        return iterator(this, NO_SLOT);
     }
-    auto crbegin()
+    const_iterator begin() const
     {
-        return storageMap.crbegin();
+        return const_iterator(this, 0);
     }
-    auto crend()
+    const_iterator end() const
     {
-        return storageMap.crend();
+        return const_iterator(this, NO_SLOT);
+    }
+    const_iterator cbegin() const
+    {
+        return begin();
+    }
+    const_iterator cend() const
+    {
+        return end();
     }
 
 protected:
-    void maybeAddFreeHandle(Handle h)
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    struct Slot
     {
-        if (storageMap.size() <= 0) {
-            throw std::logic_error("storageMap.size() <= 0, which isn't expected");
-        }
-        auto iter = storageMap.crbegin();
-        Handle maxUsedHandle = iter->first;
-        if (h < maxUsedHandle) {
-            // If not last element was deleted
-            freeHandles.insert(h);
+        // Odd while the slot is taken
+        uint32_t generation;
+        // Index in `entries` while taken, next free slot while free
+        uint32_t entry;
+    };
+
+    static uint32_t slotOf(Handle h)
+    {
+        return static_cast<uint32_t>(h);
+    }
+
+    static uint32_t generationOf(Handle h)
+    {
+        return static_cast<uint32_t>(h >> 32);
+    }
+
+    static Handle makeHandle(uint32_t slot, uint32_t generation)
+    {
+        return (Handle(generation) << 32) | slot;
+    }
+
+    uint32_t findEntry(Handle h) const
+    {
+        if (!contains(h)) {
+            throw std::out_of_range("No value with handle " + std::to_string(h));
         }
+        return slots[slotOf(h)].entry;
     }
 
-    Handle allocateHandle()
+    template <typename V>
+    Handle emplaceEntry(V&& v)
     {
-        if (freeHandles.empty()) {
-            return Handle(storageMap.size());
+        if (entries.size() >= NO_SLOT) {
+            throw std::length_error("Too many values in HandleStorage");
+        }
+
+        uint32_t slot;
+        if (firstFreeSlot != NO_SLOT) {
+            slot = firstFreeSlot;
+            firstFreeSlot = slots[slot].entry;
         } else {
-            return *freeHandles.begin();
+            slot = slots.size();
+            slots.push_back(Slot{0, NO_SLOT});
         }
+
+        uint32_t generation = slots[slot].generation + 1;
+        Handle h = makeHandle(slot, generation);
+        entries.emplace_back(h, std::forward<V>(v));
+        slots[slot].generation = generation;
+        slots[slot].entry = entries.size() - 1;
+        return h;
     }
 
-    std::map<Handle, Value> storageMap;
-    std::set<Handle> freeHandles;
+    std::vector<Entry> entries;
+    std::vector<Slot> slots;
+    uint32_t firstFreeSlot = NO_SLOT;
 };
 
 #endif /* end of include guard: UTIL_HANDLE_STORAGE_HPP */
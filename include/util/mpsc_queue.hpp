@@ -0,0 +1,156 @@
+#ifndef UTIL_MPSC_QUEUE_HPP
+#define UTIL_MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * Lock-free multi-producer single-consumer FIFO queue
+ *
+ * Any number of threads may push(), only one thread at a time may pop(). This is the
+ * queue of D. Vyukov: producers swap themselves into `head` and then link the previous
+ * node to theirs, the consumer follows the links from `tail`. The node at `tail` is a
+ * dummy whose value has already been popped. A producer that has swapped `head` but has
+ * not linked the node yet makes the queue look empty to the consumer until it does.
+ *
+ * Nodes come from a pool and go back to it after they are popped, so pushing does not
+ * allocate, except when the pool runs dry and grows by a chunk (under a mutex, which is
+ * the only lock here). The free list is a stack of node indices tagged with a counter, so
+ * a node popped and pushed back while another producer looks at it does not fool that
+ * producer (the ABA problem). Memory of the pool is returned when the queue is destroyed.
+ *
+ * Located in header file, because it is a template
+ */
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue()
+    {
+        for (auto& chunk : chunks) {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+        tail = allocateNode();
+        head.store(tail, std::memory_order_relaxed);
+    }
+
+    MpscQueue(const MpscQueue& other) = delete;
+    MpscQueue(MpscQueue&& other) = delete;
+
+    ~MpscQueue()
+    {
+        for (auto& chunk : chunks) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue& operator=(const MpscQueue& other) = delete;
+    MpscQueue& operator=(MpscQueue&& other) = delete;
+
+    void push(T value)
+    {
+        uint32_t index = allocateNode();
+        Node& node = at(index);
+        node.value = std::move(value);
+        node.next.store(NIL, std::memory_order_relaxed);
+        uint32_t previous = head.exchange(index, std::memory_order_acq_rel);
+        at(previous).next.store(index, std::memory_order_release);
+    }
+
+    /// Only called by the consumer. Returns false if there is nothing to pop
+    bool pop(T& value)
+    {
+        uint32_t next = at(tail).next.load(std::memory_order_acquire);
+        if (next == NIL) {
+            return false;
+        }
+        Node& node = at(next);
+        value = std::move(node.value);
+        // Whatever the value holds is released now, not when the node is reused
+        node.value = T();
+        freeNode(tail);
+        tail = next;
+        return true;
+    }
+
+protected:
+    static const uint32_t NIL = UINT32_MAX;
+    static const uint32_t CHUNK_SIZE = 256;
+    static const uint32_t MAX_CHUNKS = 4096;
+
+    struct Node
+    {
+        std::atomic<uint32_t> next{NIL};
+        std::atomic<uint32_t> nextFree{NIL};
+        T value;
+    };
+
+    static uint32_t indexOf(uint64_t top)
+    {
+        return static_cast<uint32_t>(top);
+    }
+
+    static uint64_t makeTop(uint32_t index, uint64_t previousTop)
+    {
+        // The tag is bumped on every change of the top
+        return (((previousTop >> 32) + 1) << 32) | index;
+    }
+
+    Node& at(uint32_t index)
+    {
+        return chunks[index / CHUNK_SIZE].load(std::memory_order_acquire)[index % CHUNK_SIZE];
+    }
+
+    uint32_t allocateNode()
+    {
+        uint64_t top = freeTop.load(std::memory_order_acquire);
+        while (indexOf(top) != NIL) {
+            uint32_t next = at(indexOf(top)).nextFree.load(std::memory_order_relaxed);
+            if (freeTop.compare_exchange_weak(top,
+                                              makeTop(next, top),
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_acquire)) {
+                return indexOf(top);
+            }
+        }
+        return grow();
+    }
+
+    void freeNode(uint32_t index)
+    {
+        uint64_t top = freeTop.load(std::memory_order_relaxed);
+        do {
+            at(index).nextFree.store(indexOf(top), std::memory_order_relaxed);
+        } while (!freeTop.compare_exchange_weak(
+                top, makeTop(index, top), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // Adds a chunk of nodes, returns one of them and puts the rest into the free list
+    uint32_t grow()
+    {
+        std::lock_guard<std::mutex> lock(growMutex);
+        if (chunkCount == MAX_CHUNKS) {
+            throw std::length_error("MpscQueue: too many nodes");
+        }
+        uint32_t first = chunkCount * CHUNK_SIZE;
+        chunks[chunkCount].store(new Node[CHUNK_SIZE], std::memory_order_release);
+        ++chunkCount;
+        for (uint32_t index = first + 1; index < first + CHUNK_SIZE; ++index) {
+            freeNode(index);
+        }
+        return first;
+    }
+
+    std::atomic<uint32_t> head;
+    uint32_t tail;
+    std::atomic<uint64_t> freeTop{NIL};
+
+    std::mutex growMutex;
+    uint32_t chunkCount = 0;
+    std::atomic<Node*> chunks[MAX_CHUNKS];
+};
+
+#endif /* end of include guard: UTIL_MPSC_QUEUE_HPP */
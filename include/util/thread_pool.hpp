@@ -0,0 +1,74 @@
+#ifndef UTIL_THREAD_POOL_HPP
+#define UTIL_THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Set of threads executing submitted tasks in FIFO order
+ *
+ * Exceptions thrown by tasks are logged and otherwise ignored
+ *
+ * A task that is about to wait for something other tasks may have to do first (e. g. a reply
+ * from a module, which may call back into the engine) should say so with a BlockingSection.
+ * While it is blocked, the pool runs an extra thread in its place, so there are always
+ * threadCount threads left to run the queued tasks. Extra threads exit after they have been
+ * idle for a while
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t threadCount);
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool(ThreadPool&& other) = delete;
+
+    /// Waits for the queued tasks to finish
+    ~ThreadPool();
+
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+    ThreadPool& operator=(ThreadPool&& other) = delete;
+
+    void submit(std::function<void()> task);
+    size_t getThreadCount() const;
+
+    /// Marks the current thread as blocked while it exists. Does nothing outside of pool threads
+    class BlockingSection
+    {
+    public:
+        BlockingSection();
+        BlockingSection(const BlockingSection& other) = delete;
+        ~BlockingSection();
+
+        BlockingSection& operator=(const BlockingSection& other) = delete;
+
+    private:
+        ThreadPool* pool;
+    };
+
+protected:
+    void threadFunc();
+    void beginBlocking();
+    void endBlocking();
+    void spawnThread();
+
+    static constexpr int SURPLUS_IDLE_MS = 1000;
+
+    const size_t threadCount;
+    // Threads that have not exited yet, and blocked ones among them
+    size_t liveCount = 0;
+    size_t blockedCount = 0;
+
+    std::vector<std::thread> threads;
+    // Exited extra threads, joined the next time a thread is spawned
+    std::vector<std::thread::id> exitedThreads;
+    std::deque<std::function<void()>> tasks;
+    mutable std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+};
+
+#endif /* end of include guard: UTIL_THREAD_POOL_HPP */
@@ -0,0 +1,79 @@
+#ifndef UTIL_TIMER_WHEEL_HPP
+#define UTIL_TIMER_WHEEL_HPP
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <modbox/util/handle_storage.hpp>
+
+/**
+ * Hierarchical timing wheel
+ *
+ * Time is counted in ticks of whatever length the user wants. There are LEVELS wheels of
+ * SLOTS slots, a slot of each level being as long as a whole wheel of the level below.
+ * A timer is put into the lowest level its expiry fits in, and moves down a level
+ * ("cascades") when the wheel below comes round to it. Scheduling and cancelling are
+ * O(1), advancing by one tick is O(1) plus the timers that expire or cascade on it, and
+ * stretches of ticks on which no occupied slot is processed are skipped at once.
+ *
+ * Timers further away than the top level can reach are parked in it and rescheduled
+ * when it comes round. Cancelled timers are forgotten lazily: their handles stay in the
+ * slots until the slot is processed, and are recognized as stale then.
+ *
+ * Not thread safe
+ */
+class TimerWheel
+{
+public:
+    struct Expiration
+    {
+        uint64_t timer;
+        uint64_t payload;
+        uint64_t expiry;
+    };
+
+    explicit TimerWheel(uint64_t _currentTick = 0);
+
+    /// Schedule a timer to expire on tick `expiry`, at least on the next one
+    uint64_t schedule(uint64_t expiry, uint64_t payload);
+
+    /// Returns false if the timer has already expired or been cancelled
+    bool cancel(uint64_t timer);
+
+    /// Move the time forward to `tick`, appending the timers that expire to `expired`
+    void advance(uint64_t tick, std::vector<Expiration>& expired);
+
+    /**
+     * Lower bound of the tick on which the next timer expires: nothing happens before it, so
+     * there is no need to advance() earlier. UINT64_MAX if there are no timers
+     *
+     * It is the first tick on which an occupied slot is processed, so cancelled timers and
+     * timers which only cascade to a lower level make it earlier than the real expiry
+     */
+    uint64_t getNextExpiryBound() const;
+
+    uint64_t getCurrentTick() const;
+    size_t size() const;
+
+protected:
+    static const size_t SLOT_BITS = 8;
+    static const size_t SLOTS = size_t(1) << SLOT_BITS;
+    static const size_t LEVELS = 4;
+
+    struct Timer
+    {
+        uint64_t expiry;
+        uint64_t payload;
+    };
+
+    void place(uint64_t timer, uint64_t expiry);
+    void cascade(size_t level);
+    void step(std::vector<Expiration>& expired);
+
+    uint64_t currentTick;
+    HandleStorage<uint64_t, Timer> timers;
+    std::array<std::array<std::vector<uint64_t>, SLOTS>, LEVELS> wheels;
+};
+
+#endif /* end of include guard: UTIL_TIMER_WHEEL_HPP */
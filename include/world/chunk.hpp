@@ -2,11 +2,9 @@
 #define WORLD_CHUNK_HPP
 
 #include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
-#include <modbox/game/enemy.hpp>
 #include <modbox/game/game_object.hpp>
 #include <modbox/geometry/game_position.hpp>
 
@@ -33,11 +31,6 @@ public:
 
     irr::scene::ITerrainSceneNode* sceneNode() const;
 
-    void trackMob(EnemyId mobId);
-    void forgetMob(EnemyId mobId);
-
-    void mobsAi();
-
     GameObjectId addObject(GameObject&& object);
     void removeObject(GameObjectId objectId);
     void moveObject(GameObjectId objectId, GameObject& target);
@@ -46,7 +39,6 @@ public:
 private:
     irr::scene::ITerrainSceneNode* terrain;
     std::unordered_map<GameObjectId, GameObject> objects;
-    std::unordered_set<EnemyId> mobs;
 };
 
 #endif /* end of include guard: WORLD_CHUNK_HPP */
@@ -0,0 +1,87 @@
+#ifndef WORLD_SPATIAL_INDEX_HPP
+#define WORLD_SPATIAL_INDEX_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <modbox/geometry/game_position.hpp>
+
+/**
+ * Positions of entities (enemies, game objects) in a uniform grid of cubic cells
+ *
+ * Each cell keeps its entities in an array, so a query only looks at the cells it overlaps
+ * and scans them contiguously. Moving an entity within its cell only rewrites its position;
+ * moving it to another cell swaps it out of the old array and appends it to the new one.
+ * Empty cells are dropped, so the memory used follows the number of entities, not the size
+ * of the world.
+ *
+ * Entities are moved by the render thread and looked up by the module handling threads, so
+ * all the methods lock
+ */
+class SpatialIndex
+{
+public:
+    struct Entry
+    {
+        uint64_t id;
+        GamePosition position;
+    };
+
+    explicit SpatialIndex(double _cellSize);
+    SpatialIndex(const SpatialIndex& other) = delete;
+    SpatialIndex(SpatialIndex&& other) = delete;
+
+    SpatialIndex& operator=(const SpatialIndex& other) = delete;
+    SpatialIndex& operator=(SpatialIndex&& other) = delete;
+
+    /// Adds the entity if it is not in the index yet
+    void update(uint64_t id, const GamePosition& position);
+    void remove(uint64_t id);
+
+    /// Appends the entities within the box (bounds included) to `found`, in no particular order
+    void findInBox(const GamePosition& low,
+                   const GamePosition& high,
+                   std::vector<Entry>& found) const;
+    /// Appends the entities at most `radius` away from `center` to `found`, in no particular order
+    void findInRadius(const GamePosition& center, double radius, std::vector<Entry>& found) const;
+
+    size_t size() const;
+
+protected:
+    struct Cell
+    {
+        int64_t x, y, z;
+
+        bool operator==(const Cell& other) const;
+    };
+
+    struct CellHash
+    {
+        size_t operator()(const Cell& cell) const;
+    };
+
+    struct Location
+    {
+        Cell cell;
+        // Index in the array of the cell
+        size_t slot;
+    };
+
+    Cell getCell(const GamePosition& position) const;
+    void removeFromCell(std::unordered_map<uint64_t, Location>::iterator location);
+    // Calls `visit` for each entry of the cells overlapping the box
+    template <typename Visit>
+    void forEachInCells(const GamePosition& low, const GamePosition& high, Visit visit) const;
+
+    double cellSize;
+    mutable std::mutex mutex;
+    std::unordered_map<Cell, std::vector<Entry>, CellHash> cells;
+    std::unordered_map<uint64_t, Location> locations;
+};
+
+/// Entries as sent to modules: a blob of NUL-terminated fields, the id, x, y and z of each entry
+std::vector<uint8_t> packSpatialEntries(const std::vector<SpatialIndex::Entry>& entries);
+
+#endif /* end of include guard: WORLD_SPATIAL_INDEX_HPP */
@@ -7,12 +7,17 @@
 
 #include <modbox/game/enemy.hpp>
 #include <modbox/world/chunk.hpp>
+#include <modbox/world/spatial_index.hpp>
 
 #include <irrlicht_wrapper.hpp>
 
 // const double CHUNK_SIZE_IRRLICHT = 2400;
 const double CHUNK_SIZE_IRRLICHT = 2400.0;
 const int64_t CHUNK_SIZE = 256.0;
+// Chunks up to this far from the player's one (on each axis) are kept loaded
+const int64_t AUTOLOAD_RADIUS = 1;
+// Edge of the cells enemies and game objects are indexed by (see SpatialIndex)
+const double SPATIAL_CELL_SIZE = CHUNK_SIZE_IRRLICHT / 8;
 
 class TerrainManager
 {
@@ -36,17 +41,22 @@ public:
     Chunk& getOrCreateChunk(offset_t x, offset_t y);
 
     void autoLoad(double px, double py);
+    /// Whether `position` is in a chunk autoLoad() keeps loaded around `center`
+    static bool isInLoadedArea(const GamePosition& position, const GamePosition& center);
 
+    // Keep the positions of enemies and game objects up to date in the spatial indices. Their
+    // managers call these on creation, after a move and on deletion respectively
     void trackMob(EnemyId mobId);
     void updateMob(EnemyId mobId);
     void forgetMob(EnemyId mobId);
 
-    void mobsAi();
-
     void trackObject(GameObjectId objectId);
     void updateObject(GameObjectId objectId);
     void forgetObject(GameObjectId objectId);
 
+    const SpatialIndex& getMobIndex() const;
+    const SpatialIndex& getObjectIndex() const;
+
     void generateTerrain(offset_t x, offset_t y);
     bool hasGeneratedTerrain(offset_t off_x, offset_t off_y);
 
@@ -65,8 +75,8 @@ private:
     // std::pair, which may not be a trivial task
     std::map<std::pair<offset_t, offset_t>, Chunk> chunks;
 
-    std::map<EnemyId, std::pair<offset_t, offset_t>> enemies;
-    std::map<GameObjectId, std::pair<offset_t, offset_t>> objects;
+    SpatialIndex mobIndex{SPATIAL_CELL_SIZE};
+    SpatialIndex objectIndex{SPATIAL_CELL_SIZE};
 
     std::function<irr::video::IImage*(offset_t, offset_t)> generator;
 };
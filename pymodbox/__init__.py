@@ -8,6 +8,12 @@ import time
 import re
 import traceback
 import os
+import struct
+import mmap
+import ctypes
+import platform
+from collections import deque
+from concurrent.futures import Future, ThreadPoolExecutor
 from threading import Lock, Thread
 
 # Netcat module taken from here: https://gist.github.com/leonjza/f35a7252babdf77c8421
@@ -15,14 +21,23 @@ from threading import Lock, Thread
 class Netcat:
     """ Python 'netcat like' module """
 
-    def __init__(self, ip, port):
+    def __init__(self, ip, port, fd=None, stream=None):
         self.buff = b''
-        self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        self.socket.connect((ip, port))
+        if stream is not None:
+            # Anything with socket-like recv(), sendall() and close(), e.g. ShmStream
+            self.socket = stream
+        elif fd is not None:
+            # Already connected socket inherited from the engine
+            self.socket = socket.socket(fileno=fd)
+        else:
+            self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self.socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            self.socket.connect((ip, port))
 
     def read(self, length=1024):
-        """ Read 1024 bytes off the socket """
-        tmp = self.socket.recv(length)
+        """ Read exactly `length` bytes off the socket """
+        tmp = self.buff[:length]
+        self.buff = self.buff[length:]
         while len(tmp) < length:
             received = self.socket.recv(length - len(tmp))
             if len(received) == 0:
@@ -45,11 +60,288 @@ class Netcat:
         return rval
 
     def write(self, data):
-        self.socket.send(data)
+        self.socket.sendall(data)
 
     def close(self):
         self.socket.close()
 
+# Shared memory transport. The layout must match include/net/shm_connection.hpp
+SHM_MAGIC = b'ModBshm1'
+SHM_HEADER_SIZE = 256
+SHM_RING_HEADER_SIZE = 256
+SHM_RING_MAIN_IN = 0
+SHM_RING_MAIN_OUT = 1
+SHM_RING_REVERSE_OUT = 2
+SHM_RING_REVERSE_IN = 3
+SHM_RING_COUNT = 4
+
+# Offsets inside a ring header
+SHM_HEAD = 0
+SHM_TAIL = 64
+SHM_DATA_WAITING = 128
+SHM_SPACE_WAITING = 192
+
+# Sleeping side wakes up that often to check if the engine is still there
+SHM_WAIT_TIMEOUT = 0.1
+SHM_SPIN_ITERATIONS = 200 if (os.cpu_count() or 1) > 1 else 0
+
+FUTEX_WAIT = 0
+FUTEX_WAKE = 1
+_SYS_FUTEX = {'x86_64': 202, 'aarch64': 98}.get(platform.machine())
+_libc = ctypes.CDLL(None, use_errno=True)
+
+class _Timespec(ctypes.Structure):
+    _fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+def futex_wait(address, expected, timeout):
+    if _SYS_FUTEX is None:
+        # Unknown syscall number, fall back to polling
+        time.sleep(0.0005)
+        return
+    ts = _Timespec(int(timeout), int((timeout % 1) * 1e9))
+    _libc.syscall(_SYS_FUTEX, ctypes.c_void_p(address), FUTEX_WAIT, ctypes.c_uint(expected),
+                  ctypes.byref(ts), None, 0)
+
+def futex_wake(address):
+    if _SYS_FUTEX is not None:
+        _libc.syscall(_SYS_FUTEX, ctypes.c_void_p(address), FUTEX_WAKE, 0x7fffffff,
+                      None, None, 0)
+
+class ShmSegment:
+    """ Shared memory segment created by the engine and passed as --shm-fd=N """
+
+    def __init__(self, fd):
+        size = os.fstat(fd).st_size
+        self.mm = mmap.mmap(fd, size)
+        if self.mm[:8] != SHM_MAGIC:
+            raise ValueError('Invalid shared memory segment')
+        self.capacity, = struct.unpack_from('<I', self.mm, 8)
+        self.address = ctypes.addressof(ctypes.c_char.from_buffer(self.mm))
+        self.parent = os.getppid()
+
+    def ring_offset(self, index):
+        return SHM_HEADER_SIZE + index * (SHM_RING_HEADER_SIZE + self.capacity)
+
+    def is_shut_down(self):
+        return struct.unpack_from('<I', self.mm, 12)[0] != 0
+
+    def shutdown(self):
+        struct.pack_into('<I', self.mm, 12, 1)
+        for i in range(SHM_RING_COUNT):
+            for field in (SHM_DATA_WAITING, SHM_SPACE_WAITING):
+                struct.pack_into('<I', self.mm, self.ring_offset(i) + field, 0)
+                futex_wake(self.address + self.ring_offset(i) + field)
+
+    def check_alive(self):
+        if self.is_shut_down() or os.getppid() != self.parent:
+            raise IOError('Connection closed')
+
+    def stream(self, in_ring, out_ring):
+        return ShmStream(self, in_ring, out_ring)
+
+class ShmStream:
+    """ Socket-like byte stream over a pair of single-producer single-consumer rings
+
+    Relies on aligned 8-byte loads and stores being atomic, which holds on x86-64 and AArch64
+    """
+
+    def __init__(self, segment, in_ring, out_ring):
+        self.segment = segment
+        self.mm = segment.mm
+        self.mask = segment.capacity - 1
+        self.inp = segment.ring_offset(in_ring)
+        self.out = segment.ring_offset(out_ring)
+
+    def load(self, offset):
+        return struct.unpack_from('<Q', self.mm, offset)[0]
+
+    def wait(self, ready, flag):
+        for _ in range(SHM_SPIN_ITERATIONS):
+            if ready():
+                return
+        while not ready():
+            self.segment.check_alive()
+            struct.pack_into('<I', self.mm, flag, 1)
+            if ready():
+                return
+            futex_wait(self.segment.address + flag, 1, SHM_WAIT_TIMEOUT)
+
+    def wake(self, flag):
+        if struct.unpack_from('<I', self.mm, flag)[0] != 0:
+            struct.pack_into('<I', self.mm, flag, 0)
+            futex_wake(self.segment.address + flag)
+
+    def recv(self, length):
+        tail = self.load(self.inp + SHM_TAIL)
+        self.wait(lambda: self.load(self.inp + SHM_HEAD) != tail, self.inp + SHM_DATA_WAITING)
+        head = self.load(self.inp + SHM_HEAD)
+        offset = tail & self.mask
+        chunk = min(length, head - tail, self.mask + 1 - offset)
+        data_start = self.inp + SHM_RING_HEADER_SIZE + offset
+        data = self.mm[data_start:data_start + chunk]
+        struct.pack_into('<Q', self.mm, self.inp + SHM_TAIL, tail + chunk)
+        self.wake(self.inp + SHM_SPACE_WAITING)
+        return data
+
+    def sendall(self, data):
+        sent = 0
+        while sent < len(data):
+            head = self.load(self.out + SHM_HEAD)
+            self.wait(lambda: head - self.load(self.out + SHM_TAIL) <= self.mask,
+                      self.out + SHM_SPACE_WAITING)
+            tail = self.load(self.out + SHM_TAIL)
+            offset = head & self.mask
+            chunk = min(len(data) - sent, self.mask + 1 - (head - tail), self.mask + 1 - offset)
+            data_start = self.out + SHM_RING_HEADER_SIZE + offset
+            self.mm[data_start:data_start + chunk] = data[sent:sent + chunk]
+            struct.pack_into('<Q', self.mm, self.out + SHM_HEAD, head + chunk)
+            self.wake(self.out + SHM_DATA_WAITING)
+            sent += chunk
+
+    def close(self):
+        self.segment.shutdown()
+
+def encode_byte(value):
+    return struct.pack('<B', value)
+
+def encode_uint32(value):
+    return struct.pack('<I', value)
+
+def encode_value(value, tp):
+    """ Encode a value for the binary protocol """
+    if value is None:
+        raise Exception('Attempted to send a None value')
+    if tp == 'i':
+        return struct.pack('<q', int(value))
+    elif tp == 'u':
+        return struct.pack('<Q', int(value))
+    elif tp == 'f':
+        return struct.pack('<d', float(value))
+    elif tp in 'sb':
+        data = value.encode() if type(value) is str else bytes(value)
+        return struct.pack('<I', len(data)) + data
+    else:
+        raise Exception('Unknown type: "{}"'.format(tp))
+
+# Opcodes of enemy AI actions, see pack_enemy_action()
+ENEMY_JUMP = 1           # speed
+ENEMY_LOOK_AT = 2        # x, y, z
+ENEMY_SET_SPEED = 3      # speed
+ENEMY_ATTACK_PLAYER = 4  # max distance, damage
+ENEMY_ACTION_ARG_COUNTS = {ENEMY_JUMP: 1, ENEMY_LOOK_AT: 3, ENEMY_SET_SPEED: 1,
+                           ENEMY_ATTACK_PLAYER: 2}
+# Opcodes of the text actions, 'pass' has none
+ENEMY_ACTION_OPCODES = {'jump': ENEMY_JUMP, 'lookAt': ENEMY_LOOK_AT, 'setSpeed': ENEMY_SET_SPEED,
+                        'attackPlayer': ENEMY_ATTACK_PLAYER}
+
+def pack_enemy_action(opcode, *args):
+    """ Binary enemy AI action, e.g. pack_enemy_action(ENEMY_LOOK_AT, x, y, z)
+
+    An enemy AI registered with RetSpec 'b' returns a concatenation of these instead of a
+    text action like 'lookAt x y z'
+    """
+    if len(args) != ENEMY_ACTION_ARG_COUNTS[opcode]:
+        raise Exception('Enemy action {} takes {} arguments'.format(
+            opcode, ENEMY_ACTION_ARG_COUNTS[opcode]))
+    return struct.pack('<B{}d'.format(len(args)), opcode, *args)
+
+def encode_enemy_action(action):
+    """ Binary form of an enemy AI action given either as text ('jump 10') or as an
+    (opcode, *args) tuple. 'pass' encodes to nothing
+    """
+    if not isinstance(action, str):
+        return pack_enemy_action(*action)
+    name, *args = action.split(' ')
+    if name == 'pass':
+        return b''
+    if name not in ENEMY_ACTION_OPCODES:
+        raise Exception('Unknown enemy action: {!r}'.format(action))
+    return pack_enemy_action(ENEMY_ACTION_OPCODES[name], *map(float, args))
+
+def unpack_positions(blob):
+    """ List of (id, x, y, z) tuples out of a blob returned by a findInRadius/findInBox command """
+    if isinstance(blob, bytes):
+        blob = blob.decode()
+    fields = blob.split('\x00')[:-1]
+    return [(int(fields[i]), float(fields[i + 1]), float(fields[i + 2]), float(fields[i + 3]))
+            for i in range(0, len(fields), 4)]
+
+def command_text(func):
+    """ Command as sent by the text protocol: either its name or '#' followed by its ID """
+    if isinstance(func, int):
+        return '#{}'.format(func)
+    return func
+
+def encode_command(func):
+    """ Command as sent by the binary protocol: an ID follows an empty name """
+    if isinstance(func, int):
+        return encode_value('', 's') + encode_uint32(func)
+    return encode_value(func, 's')
+
+class Frame:
+    """ A received binary protocol frame """
+
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, length):
+        if self.pos + length > len(self.data):
+            raise IOError('Unexpected end of frame')
+        chunk = self.data[self.pos:self.pos + length]
+        self.pos += length
+        return chunk
+
+    def read_byte(self):
+        return self.take(1)[0]
+
+    def read_uint32(self):
+        return struct.unpack('<I', self.take(4))[0]
+
+    def read_value(self, tp):
+        if tp == 'i':
+            return struct.unpack('<q', self.take(8))[0]
+        elif tp == 'u':
+            return struct.unpack('<Q', self.take(8))[0]
+        elif tp == 'f':
+            return struct.unpack('<d', self.take(8))[0]
+        elif tp in 'sb':
+            length, = struct.unpack('<I', self.take(4))
+            # Blobs are returned as strings, just like with the text protocol
+            return self.take(length).decode()
+        else:
+            raise Exception('Unknown type: "{}"'.format(tp))
+
+def encode_text_value(value, tp):
+    """ Encode a value the way the text protocol (and the engine itself) represents it """
+    if value is None:
+        raise Exception('Attempted to send a None value')
+    if tp in 'iufs':
+        return str(value)
+    elif tp == 'b':
+        return base64.b64encode(value.encode() if type(value) is str else value).decode()
+    else:
+        raise Exception('Unknown type: "{}"'.format(tp))
+
+def decode_text_value(text, tp):
+    if tp in 'iu':
+        return int(text)
+    elif tp == 'f':
+        return float(text)
+    elif tp == 's':
+        return text
+    elif tp == 'b':
+        return base64.b64decode(text).decode()
+    else:
+        raise Exception('Unknown type: "{}"'.format(tp))
+
+class BatchResult:
+    """ Reference to a result of an earlier call of the same batch, see Modcat.invoke_batch() """
+
+    def __init__(self, call, index=0):
+        self.call = call
+        self.index = index
+
 class Class:
     def __init__(self, nc, name):
         self.name = name
@@ -74,12 +366,32 @@ class Object:
         command, arg_types, ret_types = self.get_method(method)
         return self.nc.invoke(command, [self.handle] + ls, arg_types, ret_types)
 
+# Protocol versions. PROTOCOL_TEXT sends every value as a NUL-terminated string,
+# PROTOCOL_BINARY sends length-prefixed frames with native values
+PROTOCOL_TEXT = 1
+PROTOCOL_BINARY = 2
+
 class Modcat(Netcat):
-    def __init__(self, ip, port, logger):
-        Netcat.__init__(self, ip, port)
+    def __init__(self, ip, port, logger, protocol=PROTOCOL_TEXT, fd=None, stream=None):
+        Netcat.__init__(self, ip, port, fd, stream)
         self.logger = logger
+        self.protocol = protocol
         self.func_provider_names = {}
         self.func_providers = {}
+        self.command_ids = {}
+
+        # Pipelined calls (binary protocol only). Replies to requests with ID 0 come in the order
+        # of the requests, others are matched by their IDs
+        self.pending_lock = Lock()
+        self.pending = {}
+        self.ordered = deque()
+        self.next_request_id = 1
+        self.reply_thread = None
+
+        # Engine->module calls (binary protocol only) are served by a pool of threads, replies
+        # may be sent in any order
+        self.write_lock = Lock()
+        self.serving_executor = None
 
     def recv_header(self):
         self.logger.vlog('Reading host header')
@@ -89,7 +401,7 @@ class Modcat(Netcat):
 
     def send_header(self):
         self.logger.vlog('Sending module header')
-        self.write(b'ModBox/m')
+        self.write(b'ModBv2/m' if self.protocol == PROTOCOL_BINARY else b'ModBox/m')
 
     def recv_reverse_header(self):
         self.logger.vlog('Reading reverse host header')
@@ -99,7 +411,7 @@ class Modcat(Netcat):
 
     def send_reverse_header(self):
         self.logger.vlog('Sending reverse module header')
-        self.write(b'ModBox/r')
+        self.write(b'ModBv2/r' if self.protocol == PROTOCOL_BINARY else b'ModBox/r')
 
     def read_str(self):
         self.logger.vvlog('{}: Reading string...'.format(id(self)))
@@ -115,53 +427,49 @@ class Modcat(Netcat):
         s += '\x00'
         self.write(bytes(s, 'ascii'))
 
-    def unblobify(self, blob):
-        self.logger.vvlog('unblobify: {}'.format(repr(blob)))
-        split_blob = blob.split(b'\x00')
+    def read_frame(self):
+        length, = struct.unpack('<I', self.read(4))
+        frame = self.read(length) if length > 0 else b''
+        self.logger.vvlog('{}: Reading frame: {}'.format(id(self), repr(frame)))
+        return Frame(frame)
 
-        # Костыль № 9124721
-        split_blob = split_blob[:-1]
+    def write_frame(self, payload):
+        self.logger.vvlog('{}: Writing frame: {}'.format(id(self), repr(payload)))
+        self.write(struct.pack('<I', len(payload)) + payload)
 
-        raw_members = dict([split_blob[i:i+2] for i in range(0, len(split_blob), 2)])
-        members = {
-            key.decode()[:-1]: (
-                key.decode()[-1], self.type_decode(value, key.decode()[-1])
-            ) for key, value in raw_members.items()
-        }
+    def unblobify(self, blob):
+        """ Parse a member blob into a {name: (type, value)} dict """
+        self.logger.vvlog('unblobify: {}'.format(repr(blob)))
+        if isinstance(blob, bytes):
+            blob = blob.decode()
+        fields = blob.split('\x00')[:-1]
+        members = {}
+        for key, value in zip(fields[::2], fields[1::2]):
+            members[key[:-1]] = key[-1], decode_text_value(value, key[-1])
         return members
 
     def send_arg(self, arg, tp):
         self.logger.vvlog('send_arg: self = {}, arg = {}, tp = {}'.format(id(self), arg, tp))
-        if tp in 'iufs':
-            self.write_str(arg)
-        elif tp == 'b':
-            self.write_str(base64.b64encode(arg.encode() if type(arg) is str else arg).decode())
-        else:
-            raise Exception('Unknown type: "{}"'.format(tp))
+        self.write_str(encode_text_value(arg, tp))
 
     def recv_arg(self, tp):
-        if tp in 'iu':
-            return int(self.read_str())
-        elif tp == 'f':
-            return float(self.read_str())
-        elif tp == 's':
-            return self.read_str()
-        elif tp == 'b':
-            return base64.b64decode(self.read_str()).decode()
-        else:
+        if tp not in 'iufsb':
             raise Exception('Unknown type: "{}"'.format(tp))
+        return decode_text_value(self.read_str(), tp)
 
     def blobify(self, values):
-        blob = b''
+        """ Make a member blob out of a {name: (type, value)} dict """
+        blob = ''
         for name, (type, value) in values.items():
-            blob += bytes(name, 'utf-8') + bytes(type, 'utf-8') + b'\x00'
-            blob += self.type_encode(value, type) + b'\x00'
+            blob += name + type + '\x00' + encode_text_value(value, type) + '\x00'
         self.logger.vvlog('blobify: {}'.format(repr(blob)))
         return blob
 
     def invoke(self, func, ls, args, ret):
         self.logger.vlog('Invoking {}({})...'.format(func, ', '.join(map(str, ls))))
-        self.write_str(func)
+        if self.protocol == PROTOCOL_BINARY:
+            return self.invoke_binary(func, ls, args, ret)
+        self.write_str(command_text(func))
         for arg, tp in zip(ls, args):
             self.send_arg(arg, tp)
         exit_code = int(self.read_str())
@@ -174,6 +482,112 @@ class Modcat(Netcat):
             self.logger.vlog('... error: {}'.format(error))
             raise Exception(error)
 
+    def invoke_binary(self, func, ls, args, ret):
+        if self.reply_thread is not None:
+            # Replies are read by the reply thread now
+            return self.send_request(0, func, ls, args, ret).result()
+        self.write_frame(self.encode_request(0, func, ls, args))
+        frame = self.read_frame()
+        frame.read_uint32()
+        return self.parse_reply(frame, ret)
+
+    def invoke_async(self, func, ls, args, ret):
+        """ Send a request without waiting for the reply, returns a Future
+
+        The engine may execute such requests concurrently and out of order
+        """
+        if self.protocol != PROTOCOL_BINARY:
+            raise Exception('Asynchronous calls require the binary protocol')
+        self.logger.vlog('Invoking {}({}) asynchronously...'.format(func, ', '.join(map(str, ls))))
+        if self.reply_thread is None:
+            self.reply_thread = Thread(target=self.read_replies, daemon=True)
+            self.reply_thread.start()
+        request_id = self.next_request_id
+        self.next_request_id = request_id % 0xffffffff + 1
+        return self.send_request(request_id, func, ls, args, ret)
+
+    def encode_request(self, request_id, func, ls, args):
+        payload = encode_uint32(request_id) + encode_command(func)
+        for arg, tp in zip(ls, args):
+            payload += encode_value(arg, tp)
+        return payload
+
+    def send_request(self, request_id, func, ls, args, ret):
+        future = Future()
+        payload = self.encode_request(request_id, func, ls, args)
+        # Register the request first, the reply may come before write_frame() returns
+        with self.pending_lock:
+            if request_id == 0:
+                self.ordered.append((future, ret))
+            else:
+                self.pending[request_id] = (future, ret)
+        self.write_frame(payload)
+        return future
+
+    def read_replies(self):
+        try:
+            while True:
+                frame = self.read_frame()
+                request_id = frame.read_uint32()
+                with self.pending_lock:
+                    if request_id == 0:
+                        future, ret = self.ordered.popleft()
+                    else:
+                        future, ret = self.pending.pop(request_id)
+                try:
+                    future.set_result(self.parse_reply(frame, ret))
+                except BaseException as e:
+                    future.set_exception(e)
+        except BaseException as e:
+            self.logger.log('Exception occured at read_replies: ' + str(e))
+            with self.pending_lock:
+                waiting = list(self.ordered) + list(self.pending.values())
+                self.ordered.clear()
+                self.pending.clear()
+            for future, ret in waiting:
+                future.set_exception(IOError('Connection lost'))
+
+    def parse_reply(self, frame, ret):
+        exit_code = frame.read_byte()
+        if exit_code == 0:
+            ret_ls = [frame.read_value(tp) for tp in ret]
+            self.logger.vlog('... = {}'.format(ret_ls))
+            return ret_ls
+        else:
+            error = frame.read_value('s')
+            self.logger.vlog('... error: {}'.format(error))
+            raise Exception(error)
+
+    def invoke_batch(self, calls):
+        """ Run several calls in one round trip, returns the list of their results
+
+        `calls` is a list of (func, ls, args, ret) tuples, the same as the arguments of invoke().
+        An argument may be a BatchResult referring to a result of an earlier call
+        """
+        blob = b''
+        for func, ls, args, ret in calls:
+            blob += command_text(func).encode() + b'\x00'
+            for arg, tp in zip(ls, args):
+                if isinstance(arg, BatchResult):
+                    blob += '@{}.{}'.format(arg.call, arg.index).encode() + b'\x00'
+                else:
+                    blob += ('=' + encode_text_value(arg, tp)).encode() + b'\x00'
+        raw, = self.invoke('core.batch', [blob], 'b', 'b')
+        fields = raw.split('\x00')[:-1]
+        results = []
+        for func, ls, args, ret in calls:
+            results.append([decode_text_value(fields.pop(0), tp) for tp in ret])
+        return results
+
+    def resolve(self, func):
+        """ Get the ID of an engine command, it may be passed to invoke() instead of the name
+
+        Calls by ID save the engine a lookup by name on every call
+        """
+        if func not in self.command_ids:
+            self.command_ids[func], = self.invoke('core.funcProvider.resolve', [func], 's', 'u')
+        return self.command_ids[func]
+
     def register_func_provider(self, storage, func, name, args, ret):
         self.logger.vlog('Registering FuncProvider: "{}" ({}) -> {}'.format(name, args, ret))
         self.invoke('core.funcProvider.register', [name, args, ret], 'sss', '')
@@ -184,10 +598,19 @@ class Modcat(Netcat):
             self.logger.vlog('Serving')
             while True:
                 # Wait for a request
-                name = self.read_str()
+                if self.protocol == PROTOCOL_BINARY:
+                    frame = self.read_frame()
+                    call_id = frame.read_uint32()
+                    name = frame.read_value('s')
+                else:
+                    name = self.read_str()
                 if name == '_exit':
                     # exit
                     return
+                if self.protocol == PROTOCOL_BINARY:
+                    # Replies carry the call ID, so the calls may be served concurrently
+                    self.serving_executor.submit(self.serve_binary_request, call_id, name, frame)
+                    continue
                 try:
                     # Parse the request
                     func, arg_types, ret_types = self.func_providers[name]
@@ -199,14 +622,9 @@ class Modcat(Netcat):
                     ret = func(*args)
                 except BaseException as e:
                     # Something has gone wrong, exit code is not 0
-                    self.logger.log('Exception at module function:')
-                    traceback.print_exc()
+                    self.log_callback_error()
                     self.write_str(1)
-                    if self.logger.exit_on_callback_errors:
-                        self.logger.log('Bye-bye')
-                        self.logger.nc.close()
-                        self.logger.rnc.close()
-                        os._exit(1)
+                    self.exit_on_callback_error()
                     continue
 
                 # Exit code is 0
@@ -217,7 +635,42 @@ class Modcat(Netcat):
             self.logger.log('Exception occured at serve_func: ' + str(e))
             os._exit(1)
 
+    def serve_binary_request(self, call_id, name, frame):
+        failed = False
+        try:
+            func, arg_types, ret_types = self.func_providers[name]
+            args = [frame.read_value(type) for type in arg_types]
+            ret = func(*args)
+            payload = encode_uint32(call_id) + encode_byte(0)
+            for type, val in zip(ret_types, ret):
+                payload += encode_value(val, type)
+        except BaseException as e:
+            failed = True
+            self.log_callback_error()
+            payload = encode_uint32(call_id) + encode_byte(1) + encode_value(str(e), 's')
+        try:
+            with self.write_lock:
+                self.write_frame(payload)
+        except BaseException as e:
+            self.logger.log('Exception occured at serve_binary_request: ' + str(e))
+            os._exit(1)
+        if failed:
+            self.exit_on_callback_error()
+
+    def log_callback_error(self):
+        self.logger.log('Exception at module function:')
+        traceback.print_exc()
+
+    def exit_on_callback_error(self):
+        if self.logger.exit_on_callback_errors:
+            self.logger.log('Bye-bye')
+            self.logger.nc.close()
+            self.logger.rnc.close()
+            os._exit(1)
+
     def spawn_serving_thread(self):
+        if self.protocol == PROTOCOL_BINARY:
+            self.serving_executor = ThreadPoolExecutor(thread_name_prefix='modbox-serve')
         self.serving_thread = Thread(target=self.serve_func)
         self.serving_thread.start()
 
@@ -240,22 +693,45 @@ class Modcat(Netcat):
 
 
 class Module:
-    def __init__(self, module_name):
+    def __init__(self, module_name, protocol=PROTOCOL_TEXT):
         self.module_name = module_name
+        self.protocol = protocol
         self.VERBOSE = True
         self.VERY_VERBOSE = False
         self.exit_on_callback_errors = False
 
         self.call_lock = Lock()
 
-        self.main_port, self.reverse_port = self.portinfo(sys.argv)
-        self.nc = Modcat('localhost', self.main_port, logger=self)
-        self.rnc = Modcat('localhost', self.reverse_port, logger=self)
+        # Last seen members of module class instances, by instance handle
+        self.instance_lock = Lock()
+        self.instance_states = {}
+
+        main_fd, reverse_fd = self.fdinfo(sys.argv)
+        shm_fd = self.shminfo(sys.argv)
+        if shm_fd is not None:
+            # Spawned by the engine with the shared memory transport
+            segment = ShmSegment(shm_fd)
+            self.nc = Modcat(None, None, logger=self, protocol=protocol,
+                             stream=segment.stream(SHM_RING_MAIN_OUT, SHM_RING_MAIN_IN))
+            self.rnc = Modcat(None, None, logger=self, protocol=protocol,
+                              stream=segment.stream(SHM_RING_REVERSE_OUT, SHM_RING_REVERSE_IN))
+        elif main_fd is not None:
+            # Spawned by the engine: the sockets are already connected and the engine does not
+            # send its headers, so we just introduce ourselves
+            self.nc = Modcat(None, None, logger=self, protocol=protocol, fd=main_fd)
+            self.rnc = Modcat(None, None, logger=self, protocol=protocol, fd=reverse_fd)
+        else:
+            self.main_port, self.reverse_port = self.portinfo(sys.argv)
+            self.nc = Modcat('localhost', self.main_port, logger=self, protocol=protocol)
+            self.rnc = Modcat('localhost', self.reverse_port, logger=self, protocol=protocol)
 
-        self.nc.recv_header()
+        spawned = main_fd is not None or shm_fd is not None
+        if not spawned:
+            self.nc.recv_header()
         self.nc.send_header()
         self.nc.write_str(module_name)
-        self.rnc.recv_reverse_header()
+        if not spawned:
+            self.rnc.recv_reverse_header()
         self.rnc.send_reverse_header()
         self.rnc.write_str(module_name)
         self.rnc.spawn_serving_thread()
@@ -267,6 +743,121 @@ class Module:
         with self.call_lock:
             return self.nc.invoke(*args, **kwargs)
 
+    def invoke_async(self, *args, **kwargs):
+        with self.call_lock:
+            return self.nc.invoke_async(*args, **kwargs)
+
+    def invoke_batch(self, calls):
+        with self.call_lock:
+            return self.nc.invoke_batch(calls)
+
+    def resolve(self, func):
+        with self.call_lock:
+            return self.nc.resolve(func)
+
+    def add_timer(self, callback, param, delay, period=0.0):
+        """ Start a timer: `callback` is called `delay` seconds later and then every `period`
+        seconds, unless it is 0. Returns the timer handle
+
+        `callback` is a command registered with register_timer_callback()
+        """
+        return self.invoke('timer.add', [callback, param, delay, period], 'suff', 'u')[0]
+
+    def cancel_timer(self, timer):
+        """ Returns False if the timer has already expired or been cancelled """
+        return self.invoke('timer.cancel', [timer], 'u', 'u')[0] != 0
+
+    def register_timer_callback(self, func, command):
+        """ Register `func(module, timer, param)` as a timer callback named `command`
+
+        The engine passes all the timers of this module which have expired together in a
+        single call, func is called for each of them
+        """
+        def callback(module, blob):
+            if isinstance(blob, bytes):
+                blob = blob.decode()
+            fields = blob.split('\x00')[:-1]
+            for timer, param in zip(fields[::2], fields[1::2]):
+                func(module, int(timer), int(param))
+            return []
+        self.register_func_provider(callback, command, 'b', '')
+
+    def register_batched_enemy_ai(self, func, command):
+        """ Register `func(module, player_position, enemies)` as a batched enemy AI named `command`
+
+        Pass `command` to the 'enemy.addKindBatched' FuncProvider. The engine calls func once
+        per AI tick for all the enemies of the kind: `player_position` is an (x, y, z) tuple,
+        `enemies` is a list of (id, x, y, z) tuples. func returns a list of (id, action) pairs,
+        actions being either text ones ('jump 10', 'setSpeed 50', ...) or (opcode, *args)
+        tuples, as taken by pack_enemy_action(), which are cheaper for the engine to decode.
+        The two forms may be mixed. An enemy may get several actions, the enemies left out do
+        nothing
+        """
+        def callback(module, blob):
+            if isinstance(blob, bytes):
+                blob = blob.decode()
+            fields = blob.split('\x00')[:-1]
+            player_position = tuple(map(float, fields[:3]))
+            enemies = [(int(fields[i]), float(fields[i + 1]), float(fields[i + 2]),
+                        float(fields[i + 3])) for i in range(3, len(fields), 4)]
+            actions = func(module, player_position, enemies)
+            if any(not isinstance(action, str) for _, action in actions):
+                # A NUL byte marks a binary reply. Text actions in the same list are encoded too
+                return [b'\x00' + b''.join(struct.pack('<Q', enemy) + encode_enemy_action(action)
+                                            for enemy, action in actions
+                                            if action != 'pass')]
+            reply = ''
+            for enemy, action in actions:
+                reply += '{}\x00{}\x00'.format(enemy, action)
+            return [reply]
+        self.register_func_provider(callback, command, 'b', 'b')
+
+    def find_in_radius(self, kind, center, radius):
+        """ Enemies (`kind` = 'enemy') or game objects (`kind` = 'gameObject') at most `radius`
+        away from `center`, an (x, y, z) tuple. Returns a list of (id, x, y, z) tuples
+        """
+        blob, = self.invoke(kind + '.findInRadius', [*center, radius], 'ffff', 'b')
+        return unpack_positions(blob)
+
+    def find_in_box(self, kind, low, high):
+        """ The same as find_in_radius(), within the box between the `low` and `high` corners """
+        blob, = self.invoke(kind + '.findInBox', [*low, *high], 'ffffff', 'b')
+        return unpack_positions(blob)
+
+    def load_members(self, handle, blob):
+        """ Members of a module class instance, from the blob passed to a bound method
+
+        The engine only sends the members changed since this module has last seen the instance,
+        the rest come from the state cached for each instance handle. Returns a {name: value}
+        dict; pass it, modified or not, to store_members() to get the blob to return
+        """
+        if isinstance(blob, bytes):
+            blob = blob.decode()
+        header, _, rest = blob.partition('\x00')
+        base, version = map(int, header.split(':'))
+        delta = self.nc.unblobify(rest)
+        with self.instance_lock:
+            state = self.instance_states.get(handle)
+            if base == 0:
+                state = self.instance_states[handle] = {'version': version, 'members': delta}
+            elif state is None or state['version'] < base:
+                raise Exception('Members of instance {} are not cached'.format(handle))
+            else:
+                state['version'] = max(state['version'], version)
+                state['members'].update(delta)
+            return {name: value for name, (tp, value) in state['members'].items()}
+
+    def store_members(self, handle, values):
+        """ Blob to return from a bound method: the members it has changed """
+        with self.instance_lock:
+            members = self.instance_states[handle]['members']
+            changed = {}
+            for name, value in values.items():
+                tp, old_value = members[name]
+                if value != old_value:
+                    changed[name] = members[name] = tp, value
+        return self.nc.blobify(changed)
+
     def _get_log_time(self):
         return time.strftime('%02d.%02m.%Y %02H:%02M:%02S')
 
@@ -297,5 +888,23 @@ class Module:
             raise ValueError('Reverse port information not provided')
         return main_port, reverse_port
 
+    def fdinfo(self, argv):
+        main_fd = None
+        reverse_fd = None
+        for arg in argv:
+            if re.match(r'^--main-fd=[0-9]+$', arg) is not None:
+                main_fd = int(arg.split('=')[1])
+            if re.match(r'^--reverse-fd=[0-9]+$', arg) is not None:
+                reverse_fd = int(arg.split('=')[1])
+        if (main_fd is None) != (reverse_fd is None):
+            raise ValueError('Both main and reverse socket descriptors must be provided')
+        return main_fd, reverse_fd
+
+    def shminfo(self, argv):
+        for arg in argv:
+            if re.match(r'^--shm-fd=[0-9]+$', arg) is not None:
+                return int(arg.split('=')[1])
+        return None
+
     def ready(self):
         self.invoke('module.ready', [], '', '')
@@ -1,8 +1,10 @@
 #include <algorithm>
+#include <atomic>
 #include <exception>
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string>
 #include <tuple>
@@ -12,6 +14,7 @@
 
 #include <modbox/core/core.hpp>
 #include <modbox/core/dyntype.hpp>
+#include <modbox/core/typed_func_provider.hpp>
 #include <modbox/log/log.hpp>
 #include <modbox/misc/die.hpp>
 #include <modbox/modules/module_io.hpp>
@@ -24,11 +27,22 @@
 
 // === Static variables ===
 
-// Map: command -> handle
-std::unordered_map<std::string, std::tuple<FuncProvider, ArgsSpec, ArgsSpec>> funcProviderMap;
+// FuncProviders are looked up by ID on every module request, so that lookup takes no locks.
+// IDs index a two-level table: chunks are allocated once and never freed or moved, and an
+// entry is published by storing a new funcProviderCount with release semantics after it has
+// been written. Name lookups and registration go through funcProviderMutex
+static const size_t FUNC_PROVIDER_CHUNK_SIZE = 256;
+static const size_t MAX_FUNC_PROVIDER_CHUNKS = 1024;
 
-// Mutex protecting the access to FuncProvider functions
-static std::recursive_mutex funcProviderMutex;
+static const FuncProviderEntry** funcProviderChunks[MAX_FUNC_PROVIDER_CHUNKS];
+static std::atomic<CommandId> funcProviderCount{0};
+
+// Map: command -> entry. Owns the entries, references to the elements of unordered_map stay
+// valid when other elements are inserted
+static std::unordered_map<std::string, FuncProviderEntry> funcProviderMap;
+
+// Mutex protecting funcProviderMap and registration
+static std::shared_mutex funcProviderMutex;
 
 // === Implementation of FuncProvider methods ===
 
@@ -71,48 +85,86 @@ void initilaizeCore(UNUSED std::vector<std::string>& args)
 
 // === Working with "FuncProvider"s ===
 
-void registerFuncProvider(const FuncProvider& prov, ArgsSpec argsSpec, ArgsSpec retSpec)
+CommandId registerFuncProvider(const FuncProvider& prov,
+                               ArgsSpec argsSpec,
+                               ArgsSpec retSpec,
+                               const BinaryFuncProvider& binaryProv)
 {
-    std::lock_guard<std::recursive_mutex> lock(funcProviderMutex);
+    std::unique_lock<std::shared_mutex> lock(funcProviderMutex);
 
     std::string command = prov.getCommand();
+    if (command.empty() || command[0] == '#') {
+        throw std::runtime_error("Invalid command for FuncProvider: '" + command + "'");
+    }
     if (funcProviderMap.count(command) > 0) {
         throw std::runtime_error("The command for FuncProvider is already in use");
     }
 
+    CommandId id = funcProviderCount.load(std::memory_order_relaxed);
+    size_t chunk = id / FUNC_PROVIDER_CHUNK_SIZE;
+    if (chunk >= MAX_FUNC_PROVIDER_CHUNKS) {
+        throw std::runtime_error("Too many FuncProviders");
+    }
+
     LOG(L"Registering func provider for '" << wstring_cast(command) << L"'");
-    funcProviderMap.insert({command, {prov, argsSpec, retSpec}});
-    LOG(L"Successfully registered FuncProvider for " << wstring_cast(command));
+    FuncProviderEntry newEntry{id, prov, argsSpec, retSpec, binaryProv};
+    auto& entry = funcProviderMap.emplace(command, std::move(newEntry)).first->second;
+    if (funcProviderChunks[chunk] == nullptr) {
+        funcProviderChunks[chunk] = new const FuncProviderEntry*[FUNC_PROVIDER_CHUNK_SIZE];
+    }
+    funcProviderChunks[chunk][id % FUNC_PROVIDER_CHUNK_SIZE] = &entry;
+    funcProviderCount.store(id + 1, std::memory_order_release);
+    LOG(L"Successfully registered FuncProvider for " << wstring_cast(command) << L" as #"
+                                                     << id);
+    return id;
 }
 
-const FuncProvider& getFuncProvider(const std::string& command)
+const FuncProviderEntry& getFuncProviderEntry(CommandId id)
 {
-    std::lock_guard<std::recursive_mutex> lock(funcProviderMutex);
-    try {
-        return std::get<0>(funcProviderMap.at(command));
-    } catch (const std::out_of_range& e) {
-        throw std::runtime_error("No such FuncProvider: " + command);
+    if (id >= funcProviderCount.load(std::memory_order_acquire)) {
+        throw std::runtime_error("No such FuncProvider: #" + std::to_string(id));
     }
+    return *funcProviderChunks[id / FUNC_PROVIDER_CHUNK_SIZE][id % FUNC_PROVIDER_CHUNK_SIZE];
 }
 
-ArgsSpec getArgsSpec(const std::string& command)
+const FuncProviderEntry& getFuncProviderEntry(const std::string& command)
 {
-    std::lock_guard<std::recursive_mutex> lock(funcProviderMutex);
-    try {
-        return std::get<1>(funcProviderMap.at(command));
-    } catch (const std::out_of_range& e) {
+    if (!command.empty() && command[0] == '#') {
+        CommandId id;
+        try {
+            id = boost::lexical_cast<CommandId>(command.substr(1));
+        } catch (const boost::bad_lexical_cast& e) {
+            throw std::runtime_error("No such FuncProvider: " + command);
+        }
+        return getFuncProviderEntry(id);
+    }
+
+    std::shared_lock<std::shared_mutex> lock(funcProviderMutex);
+    auto it = funcProviderMap.find(command);
+    if (it == funcProviderMap.end()) {
         throw std::runtime_error("No such FuncProvider: " + command);
     }
+    return it->second;
+}
+
+CommandId resolveCommand(const std::string& command)
+{
+    return getFuncProviderEntry(command).id;
+}
+
+const FuncProvider& getFuncProvider(const std::string& command)
+{
+    return getFuncProviderEntry(command).provider;
+}
+
+ArgsSpec getArgsSpec(const std::string& command)
+{
+    return getFuncProviderEntry(command).argsSpec;
 }
 
 ArgsSpec getRetSpec(const std::string& command)
 {
-    std::lock_guard<std::recursive_mutex> lock(funcProviderMutex);
-    try {
-        return std::get<2>(funcProviderMap.at(command));
-    } catch (const std::out_of_range& e) {
-        throw std::runtime_error("No such FuncProvider: " + command);
-    }
+    return getFuncProviderEntry(command).retSpec;
 }
 
 void funcProvidersCleanup()
@@ -131,10 +183,17 @@ ModuleClass::ModuleClass(const std::unordered_map<std::string, ModuleClassMember
         members.insert(parentClass.members.begin(), parentClass.members.end());
         methods.insert(parentClass.methods.begin(), parentClass.methods.end());
     }
+    layout = std::make_shared<ModuleClassLayout>(members, methods.size());
+
+    size_t boundMethod = 0;
     for (auto& kv : methods) {
         auto& method = kv.second;
-        std::tie(method.name, method.arguments_type, method.return_type) = moduleClassBindMethod(
-                className, method.name, method.arguments_type, method.return_type);
+        std::tie(method.name, method.arguments_type, method.return_type)
+                = moduleClassBindMethod(className,
+                                        boundMethod++,
+                                        method.name,
+                                        method.arguments_type,
+                                        method.return_type);
     }
 
     for (const auto& [k, v] : members) {
@@ -142,13 +201,260 @@ ModuleClass::ModuleClass(const std::unordered_map<std::string, ModuleClassMember
     }
 }
 
-ModuleClassInstance::ModuleClassInstance(const std::string& _className) : className(_className)
+// Numbers take 8 bytes, the rest is aligned to that too
+static const size_t MODULE_CLASS_WORD_SIZE = 8;
+static_assert(sizeof(std::string) % MODULE_CLASS_WORD_SIZE == 0
+                      && alignof(std::string) <= MODULE_CLASS_WORD_SIZE,
+              "std::string is expected to fit into 8-byte words");
+
+// Number of records in a chunk of a pool
+static const size_t MODULE_CLASS_CHUNK_RECORDS = 64;
+
+static bool isStringMemberType(char type)
 {
-    const auto& memberDecls = getModuleClass(className).members;
-    members.reserve(memberDecls.size());
-    for (const auto& kv : memberDecls) {
-        members.insert({kv.first, ModuleClassMemberData(kv.second.type)});
+    return type == 's' || type == 'b';
+}
+
+ModuleClassLayout::ModuleClassLayout(
+        const std::unordered_map<std::string, ModuleClassMember>& members,
+        size_t _boundMethodCount)
+        : boundMethodCount(_boundMethodCount)
+{
+    // Sorted, so that the layout does not depend on the order of the hash map
+    for (const auto& kv : members) {
+        char type = kv.second.type;
+        if (std::string("iufsb").find(type) == std::string::npos) {
+            throw std::runtime_error(std::string("Unknown type of member '") + kv.first
+                                     + "': '" + type + "'");
+        }
+        slots.push_back({kv.first, type, 0, 0});
     }
+    std::sort(slots.begin(), slots.end(), [](const auto& a, const auto& b) {
+        return a.name < b.name;
+    });
+
+    // Instance version and synced versions go first
+    size_t offset = (1 + boundMethodCount) * MODULE_CLASS_WORD_SIZE;
+    for (size_t i = 0; i < slots.size(); ++i) {
+        auto& slot = slots[i];
+        slot.versionOffset = offset;
+        slot.valueOffset = offset + MODULE_CLASS_WORD_SIZE;
+        offset = slot.valueOffset
+                 + (isStringMemberType(slot.type) ? sizeof(std::string) : MODULE_CLASS_WORD_SIZE);
+        slotIndices.insert({slot.name, i});
+    }
+    recordSize = offset;
+}
+
+ModuleClassLayout::~ModuleClassLayout()
+{
+    // Instances hold a reference to their layout, so there are no live records by now
+}
+
+size_t ModuleClassLayout::getSlotIndex(const std::string& name) const
+{
+    auto it = slotIndices.find(name);
+    if (it == slotIndices.end()) {
+        throw std::runtime_error("No such member: '" + name + "'");
+    }
+    return it->second;
+}
+
+const ModuleClassSlot& ModuleClassLayout::getSlot(size_t slotIndex) const
+{
+    return slots.at(slotIndex);
+}
+
+const std::vector<ModuleClassSlot>& ModuleClassLayout::getSlots() const
+{
+    return slots;
+}
+
+size_t ModuleClassLayout::getBoundMethodCount() const
+{
+    return boundMethodCount;
+}
+
+uint8_t* ModuleClassLayout::allocateRecord()
+{
+    uint8_t* record;
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        if (freeRecords.empty()) {
+            chunks.emplace_back(new uint8_t[recordSize * MODULE_CLASS_CHUNK_RECORDS]);
+            for (size_t i = MODULE_CLASS_CHUNK_RECORDS; i > 0; --i) {
+                freeRecords.push_back(chunks.back().get() + (i - 1) * recordSize);
+            }
+        }
+        record = freeRecords.back();
+        freeRecords.pop_back();
+        ++liveRecords;
+    }
+
+    memset(record, 0, recordSize);
+    for (const auto& slot : slots) {
+        if (isStringMemberType(slot.type)) {
+            new (record + slot.valueOffset) std::string();
+        }
+    }
+    return record;
+}
+
+void ModuleClassLayout::releaseRecord(uint8_t* record)
+{
+    for (const auto& slot : slots) {
+        if (isStringMemberType(slot.type)) {
+            reinterpret_cast<std::string*>(record + slot.valueOffset)->~basic_string();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(poolMutex);
+    freeRecords.push_back(record);
+    --liveRecords;
+}
+
+ModuleClassMemoryStats ModuleClassLayout::getMemoryStats() const
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    return {liveRecords, recordSize, chunks.size() * MODULE_CLASS_CHUNK_RECORDS * recordSize};
+}
+
+ModuleClassInstance::ModuleClassInstance(const std::string& _className)
+        : className(_className), layout(getModuleClass(className).layout)
+{
+    record = layout->allocateRecord();
+}
+
+ModuleClassInstance::ModuleClassInstance(const ModuleClassInstance& other)
+        : className(other.className), layout(other.layout)
+{
+    record = layout->allocateRecord();
+    memcpy(record, other.record, (1 + layout->getBoundMethodCount()) * MODULE_CLASS_WORD_SIZE);
+    for (const auto& slot : layout->getSlots()) {
+        if (isStringMemberType(slot.type)) {
+            memcpy(record + slot.versionOffset,
+                   other.record + slot.versionOffset,
+                   MODULE_CLASS_WORD_SIZE);
+            valueAt<std::string>(slot) = other.valueAt<std::string>(slot);
+        } else {
+            // The version and the value
+            memcpy(record + slot.versionOffset,
+                   other.record + slot.versionOffset,
+                   2 * MODULE_CLASS_WORD_SIZE);
+        }
+    }
+}
+
+ModuleClassInstance::ModuleClassInstance(ModuleClassInstance&& other) noexcept
+        : className(std::move(other.className)), layout(other.layout), record(other.record)
+{
+    other.record = nullptr;
+}
+
+ModuleClassInstance& ModuleClassInstance::operator=(ModuleClassInstance&& other) noexcept
+{
+    // Our record is released by `other`
+    std::swap(className, other.className);
+    std::swap(layout, other.layout);
+    std::swap(record, other.record);
+    return *this;
+}
+
+ModuleClassInstance::~ModuleClassInstance()
+{
+    if (record != nullptr) {
+        layout->releaseRecord(record);
+    }
+}
+
+const std::string& ModuleClassInstance::getClassName() const
+{
+    return className;
+}
+
+const ModuleClassLayout& ModuleClassInstance::getLayout() const
+{
+    return *layout;
+}
+
+const ModuleClassSlot& ModuleClassInstance::getTypedSlot(size_t slotIndex, char type) const
+{
+    const auto& slot = layout->getSlot(slotIndex);
+    if (slot.type != type) {
+        logStackTrace();
+        throw std::runtime_error("Type mismatch of member '" + slot.name + "': expected "
+                                 + type + ", got " + slot.type);
+    }
+    return slot;
+}
+
+void ModuleClassInstance::stamp(const ModuleClassSlot& slot)
+{
+    uint64_t version = getVersion() + 1;
+    memcpy(record, &version, sizeof(version));
+    memcpy(record + slot.versionOffset, &version, sizeof(version));
+}
+
+std::string ModuleClassInstance::genericGet(size_t slotIndex) const
+{
+    const auto& slot = layout->getSlot(slotIndex);
+    switch (slot.type) {
+    case 'i':
+        return DyntypeCaster<std::string>::get(get<int64_t>(slotIndex));
+    case 'u':
+        return DyntypeCaster<std::string>::get(get<uint64_t>(slotIndex));
+    case 'f':
+        return DyntypeCaster<std::string>::get(get<double>(slotIndex));
+    case 's':
+        return get<std::string>(slotIndex);
+    default:
+        return DyntypeCaster<std::string>::get(get<std::vector<uint8_t>>(slotIndex));
+    }
+}
+
+void ModuleClassInstance::genericSet(size_t slotIndex, const std::string& value)
+{
+    const auto& slot = layout->getSlot(slotIndex);
+    LOG("ModuleClassInstance::genericSet(" << value << ") @ '" << slot.type << "'");
+    switch (slot.type) {
+    case 'i':
+        set(slotIndex, DyntypeCaster<int64_t>::get(value));
+        break;
+    case 'u':
+        set(slotIndex, DyntypeCaster<uint64_t>::get(value));
+        break;
+    case 'f':
+        set(slotIndex, DyntypeCaster<double>::get(value));
+        break;
+    case 's':
+        set(slotIndex, value);
+        break;
+    default:
+        set(slotIndex, DyntypeCaster<std::vector<uint8_t>>::get(value));
+        break;
+    }
+}
+
+uint64_t ModuleClassInstance::getVersion() const
+{
+    uint64_t version;
+    memcpy(&version, record, sizeof(version));
+    return version;
+}
+
+uint64_t ModuleClassInstance::getMemberVersion(size_t slotIndex) const
+{
+    uint64_t version;
+    memcpy(&version, record + layout->getSlot(slotIndex).versionOffset, sizeof(version));
+    return version;
+}
+
+uint64_t& ModuleClassInstance::syncedVersion(size_t boundMethod)
+{
+    if (boundMethod >= layout->getBoundMethodCount()) {
+        throw std::out_of_range("No such bound method");
+    }
+    return *reinterpret_cast<uint64_t*>(record + (1 + boundMethod) * MODULE_CLASS_WORD_SIZE);
 }
 
 std::recursive_mutex moduleClassMutex;
@@ -186,65 +492,82 @@ void deleteModuleClassInstance(uint64_t instanceId)
     moduleClassInstances.remove(instanceId);
 }
 
-std::vector<uint8_t> moduleClassBlobifyMembers(uint64_t objectHandle)
+// Splits a blob of NUL-terminated fields
+std::vector<std::string> splitBlobFields(const std::vector<uint8_t>& blob)
 {
-    std::vector<uint8_t> blob;
-    const auto& instance = getModuleClassInstance(objectHandle);
-    for (const auto& kv : instance.members) {
-        blob.reserve(blob.size() + kv.first.length() + 2);
-        for (char c : kv.first) {
-            blob.push_back(static_cast<uint8_t>(c));
+    std::vector<std::string> fields;
+    auto begin = blob.begin();
+    while (begin != blob.end()) {
+        auto terminator = std::find(begin, blob.end(), 0);
+        if (terminator == blob.end()) {
+            throw std::runtime_error("Malformed blob: unterminated field");
         }
-        blob.push_back(static_cast<uint8_t>(kv.second.type));
-        blob.push_back(0);
-        std::string enc = kv.second.genericGet();
+        fields.emplace_back(begin, terminator);
+        begin = terminator + 1;
+    }
+    return fields;
+}
 
-        blob.reserve(blob.size() + enc.length() + 1);
-        for (char c : enc) {
-            blob.push_back(static_cast<uint8_t>(c));
+void appendBlobField(std::vector<uint8_t>& blob, const std::string& field)
+{
+    blob.insert(blob.end(), field.begin(), field.end());
+    blob.push_back(0);
+}
+
+// A member blob holds, for each member, its name followed by its type and then its value,
+// both NUL-terminated. The blob passed to a bound method starts with a "<base>:<version>" field
+// and only has the members changed after the base version, 0 meaning all of them
+
+std::vector<uint8_t> moduleClassBlobifyMembers(uint64_t objectHandle,
+                                               size_t boundMethod,
+                                               uint64_t& version)
+{
+    std::lock_guard<std::recursive_mutex> lock(moduleClassMutex);
+    auto& instance = getModuleClassInstance(objectHandle);
+    uint64_t baseVersion = instance.syncedVersion(boundMethod);
+    version = instance.getVersion();
+
+    std::vector<uint8_t> blob;
+    appendBlobField(blob, std::to_string(baseVersion) + ":" + std::to_string(version));
+    const auto& slots = instance.getLayout().getSlots();
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (baseVersion != 0 && instance.getMemberVersion(i) <= baseVersion) {
+            continue;
         }
-        blob.push_back(0);
+        appendBlobField(blob, slots[i].name + slots[i].type);
+        appendBlobField(blob, instance.genericGet(i));
     }
 
     return blob;
 }
 
-void moduleClassUnblobifyMembers(uint64_t objectHandle, const std::vector<uint8_t>& blob)
+// Applies the members changed by a bound method. The module has seen everything up to
+// `syncedVersion` by now, its own changes get newer versions and will be sent back next time
+void moduleClassUnblobifyMembers(uint64_t objectHandle,
+                                 const std::vector<uint8_t>& blob,
+                                 size_t boundMethod,
+                                 uint64_t syncedVersion)
 {
+    std::lock_guard<std::recursive_mutex> lock(moduleClassMutex);
     ModuleClassInstance& instance = getModuleClassInstance(objectHandle);
-    size_t idx = 0;
-    try {
-        while (true) {
-            if (idx == blob.size()) {
-                break;
-            }
-            std::string namet, enc;
-            for (;; ++idx) {
-                auto val = blob.at(idx);
-                if (val == 0) {
-                    ++idx;
-                    break;
-                }
-                namet.push_back(val);
-            }
-            for (;; ++idx) {
-                auto val = blob.at(idx);
-                if (val == 0) {
-                    ++idx;
-                    break;
-                }
-                enc.push_back(val);
-            }
-            std::string name = namet;
-            name.pop_back();
-            instance.members.at(name).genericSet(enc);
-        }
-    } catch (const std::out_of_range& e) {
+    auto fields = splitBlobFields(blob);
+    if (fields.size() % 2 != 0) {
         throw std::runtime_error("Malformed blobified member diff");
     }
+    for (size_t i = 0; i < fields.size(); i += 2) {
+        std::string name = fields[i];
+        if (name.empty()) {
+            throw std::runtime_error("Malformed blobified member diff");
+        }
+        name.pop_back();
+        instance.genericSet(instance.getLayout().getSlotIndex(name), fields[i + 1]);
+    }
+    auto& synced = instance.syncedVersion(boundMethod);
+    synced = std::max(synced, syncedVersion);
 }
 
 std::tuple<std::string, std::string, std::string> moduleClassBindMethod(const std::string& className,
+                                                                        size_t boundMethod,
                                                                         const std::string& command,
                                                                         std::string argTypes,
                                                                         std::string retTypes)
@@ -270,11 +593,23 @@ std::tuple<std::string, std::string, std::string> moduleClassBindMethod(const st
     registerFuncProvider(
             FuncProvider(
                     funcName,
-                    [className, funcProvider](std::vector<std::string> args) -> FuncResult {
+                    [className, boundMethod, funcProvider](
+                            std::vector<std::string> args) -> FuncResult {
                         try {
                             // Get data
                             uint64_t objectHandle = getArgument<uint64_t>(args, 0);
-                            std::vector<uint8_t> blob = moduleClassBlobifyMembers(objectHandle);
+                            {
+                                std::lock_guard<std::recursive_mutex> lock(moduleClassMutex);
+                                const auto& instance = moduleClassInstances.access(objectHandle);
+                                if (instance.getClassName() != className) {
+                                    throw std::runtime_error("Instance "
+                                                             + std::to_string(objectHandle)
+                                                             + " is not of class " + className);
+                                }
+                            }
+                            uint64_t version;
+                            std::vector<uint8_t> blob
+                                    = moduleClassBlobifyMembers(objectHandle, boundMethod, version);
 
                             // Add blob to arguments
                             args.emplace(args.begin() + 1, DyntypeCaster<std::string>::get(blob));
@@ -289,7 +624,8 @@ std::tuple<std::string, std::string, std::string> moduleClassBindMethod(const st
                             // std::cerr << std::endl;
 
                             // Unpack it
-                            moduleClassUnblobifyMembers(objectHandle, retBlob);
+                            moduleClassUnblobifyMembers(
+                                    objectHandle, retBlob, boundMethod, version);
 
                             // And remove it from return vector
                             res.data.erase(res.data.begin());
@@ -306,17 +642,11 @@ std::tuple<std::string, std::string, std::string> moduleClassBindMethod(const st
     return {funcName, argTypes, retTypes};
 }
 
-FuncResult handlerAddModuleClass(const std::vector<std::string>& args)
+void handlerAddModuleClass(const std::string& parent,
+                           const std::string& name,
+                           const std::string& members,
+                           const std::string& methods)
 {
-    if (args.size() != 4) {
-        throw std::logic_error("Wrong number of arguments for handlerAddModuleClass()");
-    }
-    FuncResult ret;
-    std::string parent = getArgument<std::string>(args, 0);
-    std::string name = getArgument<std::string>(args, 1);
-    std::string members = getArgument<std::string>(args, 2);
-    std::string methods = getArgument<std::string>(args, 3);
-
     std::vector<std::string> memberNames;
     std::unordered_map<std::string, ModuleClassMember> memberMap;
     boost::algorithm::split(memberNames, members, [](char c) { return c == ':'; });
@@ -345,100 +675,56 @@ FuncResult handlerAddModuleClass(const std::vector<std::string>& args)
     }
 
     addModuleClass(name, ModuleClass(memberMap, methodMap, name, parent));
-
-    return ret;
 }
 
 // void handlerRemoveModuleClass(const std::string& name);
-FuncResult handlerInstantiateModuleClass(const std::vector<std::string>& args)
+uint64_t handlerInstantiateModuleClass(const std::string& className)
 {
-    if (args.size() != 1) {
-        throw std::logic_error("Wrong number of arguments for handlerInstantiateModuleClass()");
-    }
-    FuncResult ret;
-    ret.data.resize(1);
-    std::string className = getArgument<std::string>(args, 0);
-    auto handle = instantiateModuleClass(className);
-    setReturn<uint64_t>(ret, 0, handle);
-
-    return ret;
+    return instantiateModuleClass(className);
 }
 
-FuncResult handlerGetModuleClassMethod(const std::vector<std::string>& args)
+std::tuple<std::string, std::string, std::string> handlerGetModuleClassMethod(
+        const std::string& className, const std::string& methodName)
 {
-    if (args.size() != 2) {
-        throw std::logic_error("Wrong number of arguments for handlerGetModuleClassMethod()");
-    }
-    FuncResult ret;
-    ret.data.resize(3);
-
-    std::string className = getArgument<std::string>(args, 0);
-    std::string methodName = getArgument<std::string>(args, 1);
-
     const auto& method = getModuleClass(className).methods.at(methodName);
-    std::string funcProviderName = method.name;
-    std::string argTypes = method.arguments_type;
-    std::string retTypes = method.return_type;
-    setReturn(ret, 0, funcProviderName);
-    setReturn(ret, 1, argTypes);
-    setReturn(ret, 2, retTypes);
-    return ret;
+    return {method.name, method.arguments_type, method.return_type};
 }
 
-FuncResult handlerModuleClassSet(const std::vector<std::string>& args)
+void handlerModuleClassSet(uint64_t instanceHandle,
+                           const std::string& memberName,
+                           const std::string& value)
 {
-    if (args.size() != 3) {
-        throw std::logic_error("Wrong number of arguments for handlerModuleClassSet()");
-    }
-    FuncResult ret;
-    auto instanceHandle = getArgument<uint64_t>(args, 0);
-    auto memberName = getArgument<std::string>(args, 1);
-    auto value = getArgument<std::string>(args, 2);
-
-    auto& tmp = moduleClassInstances.mutableAccess(instanceHandle);
-    auto& tmp2 = tmp.members.at(memberName);
-    tmp2.genericSet(value);
-    return ret;
+    std::lock_guard<std::recursive_mutex> lock(moduleClassMutex);
+    auto& instance = moduleClassInstances.mutableAccess(instanceHandle);
+    instance.genericSet(instance.getLayout().getSlotIndex(memberName), value);
 }
 
-FuncResult handlerModuleClassGet(const std::vector<std::string>& args)
+std::string handlerModuleClassGet(uint64_t instanceHandle, const std::string& memberName)
 {
-    if (args.size() != 2) {
-        throw std::logic_error("Wrong number of arguments for handlerModuleClassGet()");
-    }
-    FuncResult ret;
-    ret.data.resize(1);
-    auto instanceHandle = getArgument<uint64_t>(args, 0);
-    auto memberName = getArgument<std::string>(args, 1);
-
-    std::string value
-            = moduleClassInstances.access(instanceHandle).members.at(memberName).get<std::string>();
+    std::lock_guard<std::recursive_mutex> lock(moduleClassMutex);
+    const auto& instance = moduleClassInstances.access(instanceHandle);
+    return instance.genericGet(instance.getLayout().getSlotIndex(memberName));
+}
 
-    setReturn(ret, 0, value);
-    return ret;
+std::tuple<uint64_t, uint64_t, uint64_t> handlerModuleClassMemoryStats(
+        const std::string& className)
+{
+    auto stats = getModuleClass(className).layout->getMemoryStats();
+    return {stats.instances, stats.recordSize, stats.pooledBytes};
 }
 
 ModuleWorker& getCurrentModuleWorker()
 {
-    return moduleManager.getModuleWorkerByThreadId(std::this_thread::get_id());
+    return moduleManager.getCurrentModuleWorker();
 }
 
-FuncResult handlerRegisterModuleFuncProvider(const std::vector<std::string>& args)
+void handlerRegisterModuleFuncProvider(const std::string& fpname,
+                                       const std::string& fpargs,
+                                       const std::string& fpret)
 {
-    if (args.size() != 3) {
-        throw std::logic_error(
-                "Invalid number of arguments for handlerRegisterModuleFuncProvider()");
-    }
-    FuncResult result;
-
-    const std::string& fpname = getArgument<std::string>(args, 0);
-    std::string fpargs = getArgument<std::string>(args, 1);
-    std::string fpret = getArgument<std::string>(args, 2);
-
     ModuleWorker& worker = getCurrentModuleWorker();
     auto func = worker.registerModuleFuncProvider(fpname, fpargs, fpret);
     registerFuncProvider(FuncProvider(fpname, func), fpargs, fpret);
-    return result;
 }
 
 ModuleClassInstance& getModuleClassInstance(uint64_t handle)
@@ -446,48 +732,117 @@ ModuleClassInstance& getModuleClassInstance(uint64_t handle)
     return moduleClassInstances.mutableAccess(handle);
 }
 
-FuncResult handlerClassNop(UNUSED const std::vector<std::string>& args)
+uint64_t handlerResolveFuncProvider(const std::string& command)
 {
-    FuncResult res;
-    res.data.resize(1);
-    setReturn(res, 0, std::vector<uint8_t>());
-    return res;
+    return resolveCommand(command);
 }
 
-FuncResult handlerModuleReady(UNUSED const std::vector<std::string>& args)
+std::vector<uint8_t> handlerClassNop(UNUSED uint64_t instanceHandle,
+                                     UNUSED const std::vector<uint8_t>& args)
 {
-    FuncResult res;
-    moduleManager.addReadyModule(moduleManager.getModuleWorkerByThreadId(std::this_thread::get_id())
-                                         .getModule()
-                                         .getName());
-    return res;
+    return std::vector<uint8_t>();
 }
 
-static void initializeCoreFuncProviders()
+void handlerModuleReady()
 {
-    registerFuncProvider(FuncProvider("core.class.add", handlerAddModuleClass), "ssss", "");
-    registerFuncProvider(
-            FuncProvider("core.class.instantiate", handlerInstantiateModuleClass), "s", "u");
-    registerFuncProvider(
-            FuncProvider("core.funcProvider.register", handlerRegisterModuleFuncProvider),
-            "sss",
-            "");
-    registerFuncProvider(
-            FuncProvider("core.class.getMethod", handlerGetModuleClassMethod), "ss", "sss");
-    registerFuncProvider(FuncProvider("core.class.nop", handlerClassNop), "ub", "b");
+    moduleManager.addReadyModule(getCurrentModuleWorker().getModule().getName());
+}
+
+// Argument kinds of core.batch calls
+static const char BATCH_ARG_LITERAL = '=';
+static const char BATCH_ARG_RESULT = '@';
 
-    registerFuncProvider(FuncProvider("core.class.instance.set", handlerModuleClassSet), "uss", "");
-    registerFuncProvider(FuncProvider("core.class.instance.get", handlerModuleClassGet), "us", "s");
-    registerFuncProvider(FuncProvider("module.ready", handlerModuleReady), "", "");
+// Resolves a reference to an earlier result: "<call index>.<result index>", both zero-based
+static const std::string& getBatchResult(const std::vector<std::vector<std::string>>& results,
+                                         const std::string& reference)
+{
+    size_t dot = reference.find('.');
+    if (dot == std::string::npos) {
+        throw std::runtime_error("Malformed batch result reference: '" + reference + "'");
+    }
+    auto callIndex = DyntypeCaster<size_t>::get(reference.substr(0, dot));
+    auto resultIndex = DyntypeCaster<size_t>::get(reference.substr(dot + 1));
+    if (callIndex >= results.size() || resultIndex >= results[callIndex].size()) {
+        throw std::runtime_error("Batch result reference out of range: '" + reference + "'");
+    }
+    return results[callIndex][resultIndex];
 }
 
-void ModuleClassMemberData::genericSet(const std::string& x)
+/**
+ * Runs a sequence of commands in one round trip
+ *
+ * The blob holds NUL-terminated fields: for each call, its command followed by
+ * one field per argument. The first character of an argument field is its kind:
+ * '=' followed by the value itself or '@' followed by a reference to a result of
+ * an earlier call in the batch (see getBatchResult()). The calls are run in order;
+ * the first failing one aborts the batch. The returned blob holds every result
+ * of every call, each terminated by NUL
+ */
+FuncResult handlerBatch(const std::vector<std::string>& args)
 {
-    LOG("ModuleClassMemberData::genericSet(" << x << ") @ '" << type << "'");
-    value = x;
+    if (args.size() != 1) {
+        throw std::logic_error("Wrong number of arguments for handlerBatch()");
+    }
+    FuncResult ret;
+    ret.data.resize(1);
+    auto fields = splitBlobFields(getArgument<std::vector<uint8_t>>(args, 0));
+
+    std::vector<std::vector<std::string>> results;
+    size_t idx = 0;
+    while (idx < fields.size()) {
+        const std::string& command = fields[idx++];
+        try {
+            const auto& entry = getFuncProviderEntry(command);
+            const ArgsSpec& argsSpec = entry.argsSpec;
+            if (fields.size() - idx < argsSpec.length()) {
+                throw std::runtime_error("Malformed batch: not enough arguments");
+            }
+            std::vector<std::string> callArgs;
+            callArgs.reserve(argsSpec.length());
+            for (size_t i = 0; i < argsSpec.length(); ++i) {
+                const std::string& field = fields[idx++];
+                if (field.empty()) {
+                    throw std::runtime_error("Malformed batch: empty argument");
+                } else if (field[0] == BATCH_ARG_LITERAL) {
+                    callArgs.push_back(field.substr(1));
+                } else if (field[0] == BATCH_ARG_RESULT) {
+                    callArgs.push_back(getBatchResult(results, field.substr(1)));
+                } else {
+                    throw std::runtime_error(std::string("Malformed batch: unknown argument kind '")
+                                             + field[0] + "'");
+                }
+            }
+            results.push_back(entry.provider(callArgs).data);
+        } catch (const std::exception& e) {
+            throw std::runtime_error("core.batch: call #" + std::to_string(results.size()) + " ('"
+                                     + command + "') failed: " + e.what());
+        }
+    }
+
+    std::vector<uint8_t> blob;
+    for (const auto& callResults : results) {
+        for (const auto& value : callResults) {
+            blob.insert(blob.end(), value.begin(), value.end());
+            blob.push_back(0);
+        }
+    }
+    setReturn(ret, 0, blob);
+    return ret;
 }
 
-std::string ModuleClassMemberData::genericGet() const
+static void initializeCoreFuncProviders()
 {
-    return DyntypeCaster<std::string>::get(value);
+    registerFuncProvider("core.class.add", handlerAddModuleClass);
+    registerFuncProvider("core.class.instantiate", handlerInstantiateModuleClass);
+    registerFuncProvider("core.funcProvider.register", handlerRegisterModuleFuncProvider);
+    registerFuncProvider("core.funcProvider.resolve", handlerResolveFuncProvider);
+    registerFuncProvider("core.class.getMethod", handlerGetModuleClassMethod);
+    registerFuncProvider("core.class.nop", handlerClassNop);
+
+    registerFuncProvider("core.class.instance.set", handlerModuleClassSet);
+    registerFuncProvider("core.class.instance.get", handlerModuleClassGet);
+    registerFuncProvider("core.class.memoryStats", handlerModuleClassMemoryStats);
+    registerFuncProvider("module.ready", handlerModuleReady);
+    registerFuncProvider(FuncProvider("core.batch", handlerBatch), "b", "b");
 }
+
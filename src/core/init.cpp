@@ -3,7 +3,10 @@
 #include <modbox/core/core.hpp>
 #include <modbox/core/destroy.hpp>
 #include <modbox/core/memory_manager.hpp>
+#include <modbox/core/options.hpp>
 #include <modbox/game/enemy.hpp>
+#include <modbox/game/tick_scheduler.hpp>
+#include <modbox/game/timer_service.hpp>
 #include <modbox/graphics/graphics.hpp>
 #include <modbox/log/log.hpp>
 #include <modbox/net/net.hpp>
@@ -20,10 +23,13 @@ void init(std::vector<std::string>& args)
 
     std::setlocale(LC_NUMERIC, "C"); // Force std::to_string to use '.' as decimal point
 
+    initializeOptions(args);
     initilaizeCore(args);
     initializeGraphics(args);
     initializeEnemies();
     initializeGameObjects();
+    initializeTickScheduler();
+    initializeTimerService();
 
     signal(SIGINT, sigIntHandler);
     signal(SIGABRT, sigAbrtHandler);
@@ -0,0 +1,42 @@
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <modbox/core/options.hpp>
+#include <modbox/log/log.hpp>
+
+static std::unordered_map<std::string, std::string> options;
+static std::mutex optionsMutex;
+
+void initializeOptions(const std::vector<std::string>& args)
+{
+    std::lock_guard<std::mutex> lock(optionsMutex);
+    for (const std::string& arg : args) {
+        if (arg.compare(0, 2, "--") != 0) {
+            continue;
+        }
+        auto eq = arg.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        std::string name = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+        LOG("Option: " << name << " = '" << value << "'");
+        options[name] = value;
+    }
+}
+
+std::optional<std::string> getOption(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(optionsMutex);
+    auto it = options.find(name);
+    if (it == options.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+std::string getOption(const std::string& name, const std::string& defaultValue)
+{
+    return getOption(name).value_or(defaultValue);
+}
@@ -1,4 +1,19 @@
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <modbox/core/core.hpp>
+#include <modbox/core/options.hpp>
 #include <modbox/game/ai.hpp>
+#include <modbox/game/enemy.hpp>
+#include <modbox/log/log.hpp>
+#include <modbox/util/util.hpp>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
 
 static GamePosition defaultAiFunc()
 {
@@ -9,3 +24,292 @@ std::function<GamePosition(void)> getDefaultAiFunc()
 {
     return defaultAiFunc;
 }
+
+std::optional<EnemyAction> parseEnemyAction(EnemyId enemy, const std::string& action)
+{
+    std::vector<std::string> parts;
+    boost::algorithm::split(parts, action, [](char c) { return c == ' '; });
+
+    auto expectArgs = [&parts](size_t count) {
+        if (parts.size() != count + 1) {
+            throw std::runtime_error("Invalid number of arguments for '" + parts.at(0)
+                                     + "' action");
+        }
+    };
+
+    EnemyAction result{enemy, EnemyAction::Type::JUMP, {0.0, 0.0, 0.0}};
+    if (parts.at(0) == "jump") {
+        expectArgs(1);
+        result.type = EnemyAction::Type::JUMP;
+    } else if (parts.at(0) == "lookAt") {
+        expectArgs(3);
+        result.type = EnemyAction::Type::LOOK_AT;
+    } else if (parts.at(0) == "setSpeed") {
+        expectArgs(1);
+        result.type = EnemyAction::Type::SET_SPEED;
+    } else if (parts.at(0) == "attackPlayer") {
+        expectArgs(2);
+        result.type = EnemyAction::Type::ATTACK_PLAYER;
+    } else if (parts.at(0) == "pass") {
+        return {};
+    } else {
+        throw std::runtime_error(std::string("Unknown action: '") + parts.at(0) + "'");
+    }
+    for (size_t i = 1; i < parts.size(); ++i) {
+        result.args[i - 1] = boost::lexical_cast<double>(parts.at(i));
+    }
+    return result;
+}
+
+static size_t getArgCount(EnemyAction::Type type)
+{
+    switch (type) {
+    case EnemyAction::Type::JUMP:
+    case EnemyAction::Type::SET_SPEED:
+        return 1;
+    case EnemyAction::Type::ATTACK_PLAYER:
+        return 2;
+    case EnemyAction::Type::LOOK_AT:
+        return 3;
+    }
+    throw std::runtime_error("Unknown enemy action opcode: "
+                             + std::to_string(static_cast<int>(type)));
+}
+
+static void appendUint(std::vector<uint8_t>& buffer, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        buffer.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+static uint64_t readUint(const uint8_t* bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+// Appends the opcode and the operands
+static void appendActionBody(std::vector<uint8_t>& buffer, const EnemyAction& action)
+{
+    buffer.push_back(static_cast<uint8_t>(action.type));
+    for (size_t i = 0; i < getArgCount(action.type); ++i) {
+        uint64_t bits;
+        memcpy(&bits, &action.args[i], sizeof(bits));
+        appendUint(buffer, bits);
+    }
+}
+
+// Reads the opcode and the operands
+static void readActionBody(const uint8_t* data, size_t size, size_t& position, EnemyAction& action)
+{
+    if (position == size) {
+        throw std::runtime_error("Truncated enemy action");
+    }
+    action.type = static_cast<EnemyAction::Type>(data[position]);
+    size_t argCount = getArgCount(action.type);
+    if (size - position - 1 < argCount * 8) {
+        throw std::runtime_error("Truncated enemy action");
+    }
+    ++position;
+    for (size_t i = 0; i < argCount; ++i) {
+        uint64_t bits = readUint(data + position);
+        memcpy(&action.args[i], &bits, sizeof(bits));
+        position += 8;
+    }
+}
+
+void appendEnemyAction(std::vector<uint8_t>& buffer, const EnemyAction& action)
+{
+    appendUint(buffer, action.enemy);
+    appendActionBody(buffer, action);
+}
+
+bool readEnemyAction(const std::vector<uint8_t>& buffer, size_t& position, EnemyAction& action)
+{
+    if (position == buffer.size()) {
+        return false;
+    }
+    if (buffer.size() - position < 8) {
+        throw std::runtime_error("Truncated enemy action");
+    }
+    action.enemy = readUint(buffer.data() + position);
+    position += 8;
+    readActionBody(buffer.data(), buffer.size(), position, action);
+    return true;
+}
+
+EnemyAi::EnemyAi(double rate, double _lodDistance) : schedule(rate, 1), lodDistance(_lodDistance)
+{
+    // Never joined, like the timer service thread: it dies with the process
+    thread = std::thread(&EnemyAi::loop, this);
+    thread.detach();
+}
+
+bool EnemyAi::isSnapshotDue(double dt)
+{
+    if (schedule.advance(dt) == 0) {
+        return false;
+    }
+    ++snapshotCount;
+    return true;
+}
+
+bool EnemyAi::isEnemyDue(EnemyId id, double distance) const
+{
+    uint64_t period = 1;
+    for (double limit = lodDistance; distance >= limit && period < MAX_LOD_PERIOD; limit *= 2) {
+        period *= 2;
+    }
+    return (snapshotCount + id) % period == 0;
+}
+
+EnemyAiSnapshot& EnemyAi::getSnapshot()
+{
+    return snapshots.back();
+}
+
+void EnemyAi::publishSnapshot()
+{
+    snapshots.publish();
+}
+
+bool EnemyAi::takeResults(EnemyAiResults& taken)
+{
+    return results.tryConsume(taken);
+}
+
+void EnemyAi::loop() noexcept
+{
+    EnemyAiSnapshot snapshot;
+    while (true) {
+        snapshots.consume(snapshot);
+        auto& decided = results.back();
+        decided.actions.clear();
+        decided.failed.clear();
+        think(snapshot, decided);
+        results.publish();
+    }
+}
+
+const EnemyKindAi& EnemyAi::getKindAi(const std::string& kind)
+{
+    auto it = aiByKind.find(kind);
+    if (it == aiByKind.end()) {
+        it = aiByKind.emplace(kind, enemyManager.getKindAi(kind)).first;
+    }
+    return it->second;
+}
+
+void EnemyAi::think(const EnemyAiSnapshot& snapshot, EnemyAiResults& decided)
+{
+    for (auto& [kind, batch] : batches) {
+        batch.clear();
+    }
+
+    for (const auto& enemy : snapshot.enemies) {
+        // Actions of an enemy whose AI fails half-way are dropped
+        size_t mark = decided.actions.size();
+        try {
+            const auto& ai = getKindAi(enemy.kind);
+            if (ai.batched) {
+                batches[enemy.kind].push_back({enemy.id, enemy.position});
+                continue;
+            }
+            auto reply = ai.perEnemy(enemy.id, enemy.position, snapshot.playerPosition);
+            if (ai.binary) {
+                auto data = reinterpret_cast<const uint8_t*>(reply.data());
+                size_t position = 0;
+                EnemyAction action{enemy.id, EnemyAction::Type::JUMP, {}};
+                while (position < reply.size()) {
+                    readActionBody(data, reply.size(), position, action);
+                    appendEnemyAction(decided.actions, action);
+                }
+            } else if (auto action = parseEnemyAction(enemy.id, reply); action.has_value()) {
+                appendEnemyAction(decided.actions, action.value());
+            }
+        } catch (const std::exception& e) {
+            LOG("Exception at enemy AI (kind = '" << enemy.kind
+                                                   << "'): " << wstring_cast(e.what()));
+            decided.actions.resize(mark);
+            decided.failed.emplace_back(enemy.id);
+        }
+    }
+
+    for (auto& [kind, batch] : batches) {
+        if (!batch.empty()) {
+            thinkBatch(kind, batch, snapshot.playerPosition, decided);
+        }
+    }
+}
+
+void EnemyAi::thinkBatch(const std::string& kind,
+                         std::vector<EnemyAiInput>& batch,
+                         const GamePosition& playerPosition,
+                         EnemyAiResults& decided)
+{
+    auto byId = [](const EnemyAiInput& lhs, const EnemyAiInput& rhs) { return lhs.id < rhs.id; };
+    std::sort(batch.begin(), batch.end(), byId);
+    // A module may only command the enemies it has been asked about
+    auto isInBatch = [&](EnemyId id) {
+        if (std::binary_search(batch.begin(), batch.end(), EnemyAiInput{id, {}}, byId)) {
+            return true;
+        }
+        LOG("Batched enemy AI (kind = '" << kind << "') returned an action for enemy #" << id
+                                         << ", which is not in the batch");
+        return false;
+    };
+
+    size_t mark = decided.actions.size();
+    try {
+        auto reply = getKindAi(kind).batched(batch, playerPosition);
+        if (!reply.empty() && reply.front() == 0) {
+            size_t position = 1;
+            EnemyAction action;
+            while (readEnemyAction(reply, position, action)) {
+                if (isInBatch(action.enemy)) {
+                    appendEnemyAction(decided.actions, action);
+                }
+            }
+            return;
+        }
+
+        auto fields = splitBlobFields(reply);
+        if (fields.size() % 2 != 0) {
+            throw std::runtime_error("Malformed batched enemy AI reply");
+        }
+        for (size_t i = 0; i < fields.size(); i += 2) {
+            EnemyId id = std::stoull(fields[i]);
+            if (!isInBatch(id)) {
+                continue;
+            }
+            try {
+                if (auto action = parseEnemyAction(id, fields[i + 1]); action.has_value()) {
+                    appendEnemyAction(decided.actions, action.value());
+                }
+            } catch (const std::exception& e) {
+                LOG("Exception at batched enemy AI (kind = '"
+                    << kind << "', enemy #" << id << "): " << wstring_cast(e.what()));
+                decided.failed.emplace_back(id);
+            }
+        }
+    } catch (const std::exception& e) {
+        LOG("Exception at batched enemy AI (kind = '" << kind
+                                                       << "'): " << wstring_cast(e.what()));
+        decided.actions.resize(mark);
+        for (const auto& enemy : batch) {
+            decided.failed.emplace_back(enemy.id);
+        }
+    }
+}
+
+EnemyAi& getEnemyAi()
+{
+    // Never destroyed: its thread lives as long as the process
+    static EnemyAi* ai = new EnemyAi(std::stod(getOption("ai-rate", "10")),
+                                     std::stod(getOption("ai-lod-distance", "1000")));
+    return *ai;
+}
@@ -1,15 +1,17 @@
 #include <cmath>
 
 #include <modbox/core/core.hpp>
+#include <modbox/core/dyntype.hpp>
+#include <modbox/core/typed_func_provider.hpp>
 #include <modbox/game/enemy.hpp>
+#include <modbox/game/entity_index.hpp>
 #include <modbox/game/game_loop.hpp>
 #include <modbox/geometry/game_position.hpp>
 #include <modbox/geometry/geometry.hpp>
 #include <modbox/graphics/graphics.hpp>
 #include <modbox/modules/module_io.hpp>
 #include <modbox/util/util.hpp>
-
-#include <boost/lexical_cast.hpp>
+#include <modbox/world/terrain.hpp>
 
 Enemy::Enemy(irr::scene::ISceneNode* _node, const std::string& _kind, EnemyId _id)
         : node(_node), kind(_kind), id(_id)
@@ -81,6 +83,11 @@ void Enemy::setHealthMax(double health)
     healthMax = health;
 }
 
+std::string Enemy::getKind() const
+{
+    return kind;
+}
+
 GamePosition Enemy::getPosition() const
 {
     auto position = GamePosition(node->getPosition());
@@ -101,69 +108,35 @@ irr::scene::ISceneNode* Enemy::sceneNode() const
     return node;
 }
 
-void Enemy::ai()
-{
-    static int counter = 0;
-    double fps = /* getFps(); */ 60.0;
-    double tickSpeed = /* getTickSpeed(); */ 10.0;
-    int updateEach = static_cast<int>(round(fps / tickSpeed));
-    try {
-        if (counter >= updateEach) {
-            counter = 0;
-            std::string action = enemyManager.getAiFunction(kind)(id);
-            std::vector<std::string> parts;
-            boost::algorithm::split(parts, action, [](char c) { return c == ' '; });
-            if (parts.size() == 0) {
-                goto yes_i_use_goto;
-            }
-            if (parts.at(0) == "jump") {
-                if (parts.size() != 2) {
-                    throw std::runtime_error("Invalid number of arguments for 'jump' action");
-                }
-                float jumpSpeed = boost::lexical_cast<float>(parts.at(1));
-                graphicsJump(node, jumpSpeed);
-            } else if (parts.at(0) == "lookAt") {
-                if (parts.size() != 4) {
-                    throw std::runtime_error("Invalid number of arguments for 'lookAt' action");
-                }
-                float x = boost::lexical_cast<float>(parts.at(1));
-                float y = boost::lexical_cast<float>(parts.at(2));
-                float z = boost::lexical_cast<float>(parts.at(3));
-                graphicsLookAt(node, x, y, z);
-            } else if (parts.at(0) == "setSpeed") {
-                if (parts.size() != 2) {
-                    throw std::runtime_error("Invalid number of arguments for 'setSpeed' action");
-                }
-                movementSpeed = boost::lexical_cast<double>(parts.at(1));
-            } else if (parts.at(0) == "pass") {
-                // Do nothing
-            } else if (parts.at(0) == "attackPlayer") {
-                if (parts.size() != 3) {
-                    throw std::runtime_error(
-                            "Invalid number of arguments for 'attackPlayer' action");
-                }
-                auto maxDistance = boost::lexical_cast<double>(parts.at(1));
-                auto damage = boost::lexical_cast<double>(parts.at(2));
-                if ((getPosition().toIrrVector3df() - getPlayer().getPosition().toIrrVector3df())
-                            .getLengthSQ()
-                    <= maxDistance * maxDistance) {
-                    getPlayer().hit(damage);
-                }
-            } else {
-                throw std::runtime_error(std::string("Unknown action: '") + parts.at(0) + "'");
-            }
-        } else {
-            ++counter;
+void Enemy::apply(const EnemyAction& action)
+{
+    switch (action.type) {
+    case EnemyAction::Type::JUMP:
+        graphicsJump(node, action.args[0]);
+        break;
+    case EnemyAction::Type::LOOK_AT:
+        graphicsLookAt(node, action.args[0], action.args[1], action.args[2]);
+        break;
+    case EnemyAction::Type::SET_SPEED:
+        movementSpeed = action.args[0];
+        break;
+    case EnemyAction::Type::ATTACK_PLAYER: {
+        double maxDistance = action.args[0];
+        if ((getPosition().toIrrVector3df() - getPlayer().getPosition().toIrrVector3df())
+                    .getLengthSQ()
+            <= maxDistance * maxDistance) {
+            getPlayer().hit(action.args[1]);
         }
-    yes_i_use_goto:
-        graphicsStep(node, movementSpeed / fps);
-    } catch (const std::exception& e) {
-        LOG("Exception at Enemy::ai (kind = '" << kind << "')");
-        enemyManager.deferredDeleteEnemy(id);
-        std::rethrow_exception(std::current_exception());
+        break;
+    }
     }
 }
 
+void Enemy::step(double dt)
+{
+    graphicsStep(node, movementSpeed * dt);
+}
+
 EnemyId EnemyManager::createEnemy(const std::string& kind, irr::scene::ISceneNode* model)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex);
@@ -171,6 +144,13 @@ EnemyId EnemyManager::createEnemy(const std::string& kind, irr::scene::ISceneNod
     enemies.emplace(idCounter, Enemy(model, kind, idCounter));
     enemies.at(idCounter).setHealthMax(healthMaximumsByKind.at(kind));
     enemies.at(idCounter).setHealthLeft(healthMaximumsByKind.at(kind));
+    getEntityIndex().addEnemy(model, idCounter);
+    terrainManager.trackMob(idCounter);
+    if (activeAreaCenter.has_value()
+        && TerrainManager::isInLoadedArea(enemies.at(idCounter).getPosition(),
+                                          *activeAreaCenter)) {
+        activeEnemies.insert(idCounter);
+    }
     creationFunctionsByKind.at(kind)(idCounter);
     return idCounter;
 }
@@ -178,7 +158,12 @@ EnemyId EnemyManager::createEnemy(const std::string& kind, irr::scene::ISceneNod
 void EnemyManager::deleteEnemy(EnemyId id)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex);
-    enemies.erase(id);
+    if (auto it = enemies.find(id); it != enemies.end()) {
+        getEntityIndex().forgetEnemy(it->second.sceneNode(), id);
+        terrainManager.forgetMob(id);
+        activeEnemies.erase(id);
+        enemies.erase(it);
+    }
 }
 
 void EnemyManager::deferredDeleteEnemy(EnemyId id)
@@ -200,112 +185,226 @@ Enemy& EnemyManager::mutableAccessEnemy(EnemyId id)
 
 EnemyManager enemyManager;
 
-FuncResult handlerAddEnemyKind(const std::vector<std::string>& args)
+// The AI function returns either a text action (RetSpec "s") or a command buffer of actions
+// without enemy ids (RetSpec "b"), see EnemyAction
+void handlerAddEnemyKind(const std::string& kind,
+                         const std::string& creationFunc,
+                         const std::string& aiFunc,
+                         double healthMax)
 {
-    FuncResult ret;
-    if (args.size() != 4) {
-        throw std::logic_error("Wrong number of arguments for handlerAddEnemyKind()");
-    }
-
-    auto kind = getArgument<std::string>(args, 0);
-    auto creationFunc = getArgument<std::string>(args, 1);
-    auto aiFunc = getArgument<std::string>(args, 2);
-    auto healthMax = getArgument<double>(args, 3);
-
     auto creationFp = getFuncProvider(creationFunc);
-    auto aiFp = getFuncProvider(aiFunc);
-
-    enemyManager.addKind(kind,
-                         [=](EnemyId id) { creationFp({std::to_string(id)}); },
-                         [=](EnemyId id) {
-                             auto playerPosition = getPlayer().getPosition();
-                             auto enemyPosition = enemyManager.accessEnemy(id).getPosition();
-                             return aiFp({std::to_string(id),
-
-                                          std::to_string(enemyPosition.x),
-                                          std::to_string(enemyPosition.y),
-                                          std::to_string(enemyPosition.z),
-
-                                          std::to_string(playerPosition.x),
-                                          std::to_string(playerPosition.y),
-                                          std::to_string(playerPosition.z)})
+    const auto& aiEntry = getFuncProviderEntry(aiFunc);
+    if (aiEntry.retSpec != "s" && aiEntry.retSpec != "b") {
+        throw std::runtime_error("Enemy AI function '" + aiFunc
+                                 + "' must return a single string or blob");
+    }
+    auto aiFp = aiEntry.provider;
+    bool binary = aiEntry.retSpec == "b";
+
+    enemyManager.addKind(
+            kind,
+            [=](EnemyId id) { creationFp({std::to_string(id)}); },
+            [=](EnemyId id, const GamePosition& enemyPosition, const GamePosition& playerPosition) {
+                auto reply = aiFp({std::to_string(id),
+
+                                   std::to_string(enemyPosition.x),
+                                   std::to_string(enemyPosition.y),
+                                   std::to_string(enemyPosition.z),
+
+                                   std::to_string(playerPosition.x),
+                                   std::to_string(playerPosition.y),
+                                   std::to_string(playerPosition.z)})
                                      .data.at(0);
-                         },
-                         healthMax);
-
-    return ret;
+                if (binary) {
+                    auto bytes = DyntypeCaster<std::vector<uint8_t>>::get(reply);
+                    return std::string(bytes.begin(), bytes.end());
+                }
+                return reply;
+            },
+            healthMax,
+            binary);
 }
-FuncResult handlerAddEnemy(const std::vector<std::string>& args)
+// The AI function gets a blob of NUL-terminated fields: the player position (x, y, z), then
+// the id and the position of each enemy. It returns either a blob of (id, text action) field
+// pairs, or a NUL byte followed by a command buffer (see EnemyAction)
+void handlerAddEnemyKindBatched(const std::string& kind,
+                                const std::string& creationFunc,
+                                const std::string& aiFunc,
+                                double healthMax)
 {
-    FuncResult ret;
-    ret.data.resize(1);
-    if (args.size() != 2) {
-        throw std::logic_error("Wrong number of arguments for handlerAddEnemy()");
+    auto creationFp = getFuncProvider(creationFunc);
+    const auto& aiEntry = getFuncProviderEntry(aiFunc);
+    if (aiEntry.argsSpec != "b" || aiEntry.retSpec != "b") {
+        throw std::runtime_error("Batched enemy AI function '" + aiFunc
+                                 + "' must take and return a single blob");
     }
+    auto aiFp = aiEntry.provider;
+
+    enemyManager.addBatchedKind(
+            kind,
+            [=](EnemyId id) { creationFp({std::to_string(id)}); },
+            [=](const std::vector<EnemyAiInput>& enemies, const GamePosition& playerPosition) {
+                std::vector<uint8_t> request;
+                appendBlobField(request, std::to_string(playerPosition.x));
+                appendBlobField(request, std::to_string(playerPosition.y));
+                appendBlobField(request, std::to_string(playerPosition.z));
+                for (const auto& enemy : enemies) {
+                    appendBlobField(request, std::to_string(enemy.id));
+                    appendBlobField(request, std::to_string(enemy.position.x));
+                    appendBlobField(request, std::to_string(enemy.position.y));
+                    appendBlobField(request, std::to_string(enemy.position.z));
+                }
 
-    auto kind = getArgument<std::string>(args, 0);
-    auto drawableHandle = getArgument<uint64_t>(args, 1);
-
-    auto enemyId = enemyManager.createEnemy(kind, drawablesManager.access(drawableHandle));
-
-    setReturn(ret, 0, enemyId);
-    return ret;
+                auto reply = aiFp({DyntypeCaster<std::string>::get(request)}).data.at(0);
+                return DyntypeCaster<std::vector<uint8_t>>::get(reply);
+            },
+            healthMax);
 }
-FuncResult handlerRemoveEnemy(const std::vector<std::string>& args)
+uint64_t handlerAddEnemy(const std::string& kind, uint64_t drawableHandle)
+{
+    return enemyManager.createEnemy(kind, drawablesManager.access(drawableHandle));
+}
+void handlerRemoveEnemy(uint64_t enemyId)
 {
-    FuncResult ret;
-    if (args.size() != 1) {
-        throw std::logic_error("Wrong number of arguments for handlerRemoveEnemy()");
-    }
-
-    auto enemyId = getArgument<uint64_t>(args, 0);
-
     enemyManager.deleteEnemy(enemyId);
-
-    return ret;
+}
+// Both return a blob of NUL-terminated fields: the id, x, y and z of each enemy found
+std::vector<uint8_t> handlerFindEnemiesInRadius(double x, double y, double z, double radius)
+{
+    std::vector<SpatialIndex::Entry> found;
+    terrainManager.getMobIndex().findInRadius({x, y, z}, radius, found);
+    return packSpatialEntries(found);
+}
+std::vector<uint8_t> handlerFindEnemiesInBox(
+        double lowX, double lowY, double lowZ, double highX, double highY, double highZ)
+{
+    std::vector<SpatialIndex::Entry> found;
+    terrainManager.getMobIndex().findInBox({lowX, lowY, lowZ}, {highX, highY, highZ}, found);
+    return packSpatialEntries(found);
 }
 
 void initializeEnemies()
 {
-    registerFuncProvider(FuncProvider("enemy.addKind", handlerAddEnemyKind), "sssf", "");
-    registerFuncProvider(FuncProvider("enemy.add", handlerAddEnemy), "su", "u");
-    registerFuncProvider(FuncProvider("enemy.remove", handlerRemoveEnemy), "su", "");
+    registerFuncProvider("enemy.addKind", handlerAddEnemyKind);
+    registerFuncProvider("enemy.addKindBatched", handlerAddEnemyKindBatched);
+    registerFuncProvider("enemy.add", handlerAddEnemy);
+    registerFuncProvider("enemy.remove", handlerRemoveEnemy);
+    registerFuncProvider("enemy.findInRadius", handlerFindEnemiesInRadius);
+    registerFuncProvider("enemy.findInBox", handlerFindEnemiesInBox);
 }
 
-std::function<std::string(EnemyId)> EnemyManager::getAiFunction(const std::string& kind)
+EnemyKindAi EnemyManager::getKindAi(const std::string& kind)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex);
-    return aiFunctionsByKind.at(kind);
+    return aiByKind.at(kind);
 }
 void EnemyManager::addKind(const std::string& kind,
                            const std::function<void(EnemyId)>& creationFunction,
-                           const std::function<std::string(EnemyId)>& aiFunction,
-                           double healthMax)
+                           const EnemyAiFunction& aiFunction,
+                           double healthMax,
+                           bool binary)
+{
+    registerKind(kind, creationFunction, EnemyKindAi{aiFunction, nullptr, binary}, healthMax);
+}
+void EnemyManager::addBatchedKind(const std::string& kind,
+                                  const std::function<void(EnemyId)>& creationFunction,
+                                  const EnemyBatchAiFunction& aiFunction,
+                                  double healthMax)
+{
+    registerKind(kind, creationFunction, EnemyKindAi{nullptr, aiFunction}, healthMax);
+}
+void EnemyManager::registerKind(const std::string& kind,
+                                const std::function<void(EnemyId)>& creationFunction,
+                                const EnemyKindAi& ai,
+                                double healthMax)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex);
-    if (aiFunctionsByKind.count(kind) > 0) {
+    if (aiByKind.count(kind) > 0) {
         throw std::runtime_error("Enemy kind '" + kind + "' already registered");
     }
-    aiFunctionsByKind.emplace(kind, aiFunction);
+    aiByKind.emplace(kind, ai);
     creationFunctionsByKind.emplace(kind, creationFunction);
     healthMaximumsByKind.emplace(kind, healthMax);
 }
 
-void EnemyManager::processAi()
+void EnemyManager::processAi(double dt)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex);
-    for (auto& [id, enemy] : enemies) {
+    auto& ai = getEnemyAi();
+    if (ai.takeResults(aiResults)) {
+        size_t position = 0;
+        EnemyAction action;
+        while (readEnemyAction(aiResults.actions, position, action)) {
+            // The enemy may have been removed since the snapshot
+            if (auto it = enemies.find(action.enemy); it != enemies.end()) {
+                it->second.apply(action);
+            }
+        }
+        for (EnemyId id : aiResults.failed) {
+            deferredDeleteQueue.emplace_back(id);
+        }
+    }
+
+    auto playerPosition = getPlayer().getPosition();
+    bool snapshotDue = ai.isSnapshotDue(dt);
+    auto& snapshot = ai.getSnapshot();
+    if (snapshotDue) {
+        snapshot.enemies.clear();
+        snapshot.playerPosition = playerPosition;
+    }
+
+    // Enemies out of the loaded chunks are frozen: they neither move nor think
+    updateActiveEnemies(playerPosition);
+    std::vector<EnemyId> leaving;
+    for (EnemyId id : activeEnemies) {
+        auto& enemy = enemies.at(id);
         if (enemy.isDead()) {
             LOG("Enemy is dead");
             deferredDeleteQueue.emplace_back(id);
-        } else {
-            enemy.ai();
+            continue;
+        }
+        auto position = enemy.getPosition();
+        if (!TerrainManager::isInLoadedArea(position, playerPosition)) {
+            // Has walked out of the loaded chunks
+            leaving.push_back(id);
+            continue;
+        }
+        enemy.step(dt);
+        terrainManager.updateMob(id);
+        if (snapshotDue) {
+            double distance = std::sqrt(std::pow(position.x - playerPosition.x, 2)
+                                        + std::pow(position.y - playerPosition.y, 2)
+                                        + std::pow(position.z - playerPosition.z, 2));
+            if (ai.isEnemyDue(id, distance)) {
+                snapshot.enemies.push_back({id, enemy.getKind(), position});
+            }
         }
     }
+    for (EnemyId id : leaving) {
+        activeEnemies.erase(id);
+    }
     for (EnemyId enemy : deferredDeleteQueue) {
         deleteEnemy(enemy);
     }
     deferredDeleteQueue.clear();
+
+    if (snapshotDue) {
+        ai.publishSnapshot();
+    }
+}
+
+void EnemyManager::updateActiveEnemies(const GamePosition& playerPosition)
+{
+    if (activeAreaCenter.has_value() && activeAreaCenter->getChunk() == playerPosition.getChunk()) {
+        return;
+    }
+    activeAreaCenter = playerPosition;
+    activeEnemies.clear();
+    for (const auto& [id, enemy] : enemies) {
+        if (TerrainManager::isInLoadedArea(enemy.getPosition(), playerPosition)) {
+            activeEnemies.insert(id);
+        }
+    }
 }
 
 Enemy::~Enemy()
@@ -322,11 +421,5 @@ Enemy::~Enemy()
 
 std::optional<EnemyId> EnemyManager::reverseLookup(irr::scene::ISceneNode* drawable)
 {
-    std::lock_guard<std::recursive_mutex> lock(mutex);
-    for (auto [id, enemy] : enemies) {
-        if (enemy.sceneNode() == drawable) {
-            return id;
-        }
-    }
-    return {};
+    return getEntityIndex().findEnemy(drawable);
 }
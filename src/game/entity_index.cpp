@@ -0,0 +1,82 @@
+#include <modbox/game/entity_index.hpp>
+
+void EntityIndex::addDrawable(irr::scene::ISceneNode* node, uint64_t handle)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[node].drawable = handle;
+}
+
+void EntityIndex::addEnemy(irr::scene::ISceneNode* node, EnemyId id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[node].enemy = id;
+}
+
+void EntityIndex::addGameObject(irr::scene::ISceneNode* node, GameObjectId id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[node].gameObject = id;
+}
+
+void EntityIndex::forgetDrawable(irr::scene::ISceneNode* node, uint64_t handle)
+{
+    forget(node, &Entry::drawable, handle);
+}
+
+void EntityIndex::forgetEnemy(irr::scene::ISceneNode* node, EnemyId id)
+{
+    forget(node, &Entry::enemy, id);
+}
+
+void EntityIndex::forgetGameObject(irr::scene::ISceneNode* node, GameObjectId id)
+{
+    forget(node, &Entry::gameObject, id);
+}
+
+std::optional<uint64_t> EntityIndex::findDrawable(irr::scene::ISceneNode* node) const
+{
+    return find(node, &Entry::drawable);
+}
+
+std::optional<EnemyId> EntityIndex::findEnemy(irr::scene::ISceneNode* node) const
+{
+    return find(node, &Entry::enemy);
+}
+
+std::optional<GameObjectId> EntityIndex::findGameObject(irr::scene::ISceneNode* node) const
+{
+    return find(node, &Entry::gameObject);
+}
+
+void EntityIndex::forget(irr::scene::ISceneNode* node,
+                         std::optional<uint64_t> Entry::*field,
+                         uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(node);
+    if (it == entries.end() || it->second.*field != id) {
+        return;
+    }
+    (it->second.*field).reset();
+    const auto& entry = it->second;
+    if (!entry.drawable && !entry.enemy && !entry.gameObject) {
+        entries.erase(it);
+    }
+}
+
+std::optional<uint64_t> EntityIndex::find(irr::scene::ISceneNode* node,
+                                          std::optional<uint64_t> Entry::*field) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(node);
+    if (it == entries.end()) {
+        return {};
+    }
+    return it->second.*field;
+}
+
+EntityIndex& getEntityIndex()
+{
+    static EntityIndex index;
+    return index;
+}
@@ -1,6 +1,5 @@
 #include <chrono>
 #include <cmath>
-#include <future>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -11,13 +10,16 @@
 #include <modbox/core/dyntype.hpp>
 #include <modbox/core/event_manager.hpp>
 #include <modbox/core/init.hpp>
+#include <modbox/core/options.hpp>
 #include <modbox/game/enemy.hpp>
 #include <modbox/game/game_loop.hpp>
 #include <modbox/game/player.hpp>
 #include <modbox/game/solid_object.hpp>
+#include <modbox/game/tick_scheduler.hpp>
 #include <modbox/game/weapon.hpp>
 #include <modbox/graphics/graphics.hpp>
 #include <modbox/log/log.hpp>
+#include <modbox/util/frame_timing.hpp>
 #include <modbox/util/util.hpp>
 #include <modbox/world/terrain.hpp>
 
@@ -30,12 +32,20 @@ std::atomic<bool> canPlaceObject(true);
 std::atomic<bool> gameStarted(false);
 std::atomic<bool> safeDrawFunctionsRun(false); // Костыль, но работает (теперь нет)
 
-std::vector<std::pair<std::string, uint64_t>> eachTickFuncs;
+// Each-tick callbacks and terrain autoloading happen at this rate
+static const double tickRate = 10.0;
 
-std::recursive_mutex drawFunctionsMutex;
-std::vector<std::packaged_task<void()>> drawFunctions;
+static double getSimulationRate()
+{
+    static const double rate = std::stod(getOption("sim-rate", "60"));
+    return rate;
+}
 
-static const int desiredFps = 60;
+static double getFrameRate()
+{
+    static const double rate = std::stod(getOption("fps", "60"));
+    return rate;
+}
 
 static std::optional<std::thread::id> drawThreadId;
 std::thread::id getDrawThreadId()
@@ -52,16 +62,59 @@ Player& getPlayer()
     return player;
 }
 
-std::recursive_mutex& getDrawFunctionsMutex()
+MpscQueue<DrawTask>& getDrawTaskQueue()
 {
-    return drawFunctionsMutex;
+    static MpscQueue<DrawTask> queue;
+    return queue;
+}
+
+void DrawTaskCompletion::complete(std::exception_ptr _exception) noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    exception = _exception;
+    done = true;
+    // Notified under the lock: the waiter destroys this object as soon as it sees `done`
+    condition.notify_one();
+}
+
+void DrawTaskCompletion::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this]() { return done; });
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
 }
+
+// Draw tasks may take this long per frame. The ones left are run in the next frames
+static std::chrono::steady_clock::duration getDrawTaskBudget()
+{
+    static const auto budget = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::milli>(
+                    std::stod(getOption("draw-task-budget-ms", "4"))));
+    return budget;
+}
+
+static void runDrawTasks()
+{
+    auto deadline = std::chrono::steady_clock::now() + getDrawTaskBudget();
+    DrawTask task;
+    // At least one task is run every frame, however slow the frames are
+    while (getDrawTaskQueue().pop(task)) {
+        task.run(task);
+        if (std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+    }
+}
+
 std::recursive_mutex& getIrrlichtMutex()
 {
     return irrlichtMutex;
 }
 
-static void processKeys(Player& player)
+// Speeds below are per second, `dt` is the simulation step
+static void processKeys(Player& player, double dt)
 {
     // XXX: This is stub, camera movement and rotation should be done by class like Player
     IrrEventReceiver& receiver = getEventReceiver();
@@ -83,8 +136,7 @@ static void processKeys(Player& player)
         }
 
         double directionOffset = 0;
-        // TODO: Убрать зависимость от fps
-        double speed = 10.0 / desiredFps * 30;
+        double speed = 300.0 * dt;
         switch (dx * 10 + dz) {
         case -10 + -1: // back, left
             directionOffset = -0.75 * M_PI;
@@ -124,13 +176,14 @@ static void processKeys(Player& player)
         if (receiver.isKeyPressed(irr::KEY_SPACE)) {
             // Не спрашивайте, как я до этого дошёл и почему это должно работать
             // Но оно работает, и высота прыжка почти не зависит от FPS
-            const double jumpHeight = 10.0 / pow(desiredFps, 0.33) * pow(30, 0.33);
+            const double jumpHeight = 10.0 * pow(30 * dt, 0.33);
             player.jump(jumpHeight);
         }
     }
 
     // Camera rotation
     {
+        const double speed = 60.0 * dt;
         double dx = 0, dy = 0;
         if (receiver.isKeyPressed(irr::KEY_UP)) {
             dx -= 1.0;
@@ -145,13 +198,11 @@ static void processKeys(Player& player)
             dy -= 1.0;
         }
 
+        // The mouse has moved by this much since the previous step, however long ago it was
         auto mouseDelta = receiver.getMouseDelta();
         const double mouseSensivity = 0.2;
-        dx += mouseDelta.X * mouseSensivity;
-        dy += mouseDelta.Y * mouseSensivity;
-
-        const double speed = 2.0 / desiredFps * 30;
-        player.turn(speed * dx, speed * dy);
+        player.turn(speed * dx + mouseDelta.X * mouseSensivity,
+                    speed * dy + mouseDelta.Y * mouseSensivity);
     }
 }
 
@@ -235,59 +286,33 @@ void gameLoop()
                 }
             });
 
-    int counter = 0;
-    double i = 0;
+    // Missed ticks are not made up for: the tick scheduler coalesces them anyway
+    FixedTimestep ticks(tickRate, 1);
+    FramePacer pacer(getSimulationRate());
+    auto previousIteration = std::chrono::steady_clock::now();
     while (true) /* irrDeviceRun() can cause segfault */ {
-        size_t idx = 0;
-        std::vector<size_t> toRemove;
-        ++counter;
-        if (counter == desiredFps / 10) {
-            counter = 0;
+        auto now = std::chrono::steady_clock::now();
+        if (ticks.advance(std::chrono::duration<double>(now - previousIteration).count()) > 0) {
+            getTickScheduler().tick();
             terrainManager.autoLoad(player.getPosition().x, player.getPosition().z);
-            for (const auto& fp : eachTickFuncs) {
-                try {
-                    auto arg = DyntypeCaster<std::string>::get(fp.second);
-                    auto ret = getFuncProvider(fp.first)({arg});
-                    if (ret.data.size() != 0) {
-                        LOG("ret.data.size() != 0");
-                    }
-                } catch (const std::exception& e) {
-                    LOG("Exception caught at game_loop(): " << wstring_cast(e.what()));
-                    logStackTrace();
-                    LOG("This funcProvider will be removed from each-tick execution list");
-                    toRemove.push_back(idx);
-                    break;
-                }
-                ++idx;
-            }
-        }
-
-        for (const auto& i : toRemove) {
-            LOG("Removing entry " << i << " from each-tick execution list");
-            eachTickFuncs.erase(eachTickFuncs.begin() + i);
         }
-        toRemove.clear();
+        previousIteration = now;
 
         std::ignore = graphicsGetPlacePosition(player.getPosition(), player.getCameraTarget());
-        double timeForFrame = 1.0 / desiredFps;
-        i += timeForFrame;
-        usleep(1000000 / 60);
+        pacer.wait();
     }
     destroy();
 }
 
-void eachTickWithParam(const std::string& name, uint64_t param)
-{
-    eachTickFuncs.emplace_back(name, param);
-}
-
 void drawLoop()
 {
     drawThreadId = std::this_thread::get_id();
-    int fpsCounter = 0;
-    double oneSecondCounter = 0.0;
 
-    double timeForFrame = 1.0 / desiredFps;
+    // The simulation runs in fixed steps, as many of them per frame as it takes to keep up
+    // with the real time. Rendering is interpolated between the last two steps
+    FixedTimestep simulation(getSimulationRate());
+    FramePacer pacer(getFrameRate());
+    auto previousFrame = std::chrono::steady_clock::now();
 
     safeDrawFunctionsRun = true;
     while (irrDeviceRun()) {
@@ -295,56 +320,39 @@ void drawLoop()
             break;
         }
 
-        {
-            std::lock_guard<std::recursive_mutex> lock(drawFunctionsMutex);
-            for (auto& func : drawFunctions) {
-                try {
-                    func();
-                } catch (const std::exception& e) {
-                    LOG("draw function: exception: " << wstring_cast(e.what()));
-                    throw e;
-                }
-            }
-            drawFunctions.clear();
-        }
+        runDrawTasks();
 
-        auto timeBefore = std::chrono::high_resolution_clock::now();
+        auto frameStart = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(frameStart - previousFrame).count();
+        previousFrame = frameStart;
         {
             std::lock_guard<std::recursive_mutex> lock(irrlichtMutex);
-            graphicsDraw();
             if (gameStarted) {
-                processKeys(getPlayer());
-                try {
-                    enemyManager.processAi();
-                } catch (const std::exception& e) {
-                    LOG("Exception caught at enemyManager.processAi(): " << e.what());
+                size_t steps = simulation.advance(elapsed);
+                for (size_t step = 0; step < steps; ++step) {
+                    processKeys(getPlayer(), simulation.getStep());
+                    getPlayer().step();
+                    try {
+                        enemyManager.processAi(simulation.getStep());
+                    } catch (const std::exception& e) {
+                        LOG("Exception caught at enemyManager.processAi(): " << e.what());
+                    }
                 }
-                // getPlayer().moveForward(0, 0);
-                // getPlayer().turn(0, 0);
+                if (steps > 0) {
+                    getGameObjectManager().updatePositions();
+                }
+                getPlayer().interpolate(simulation.getAlpha());
             }
+            graphicsDraw();
         }
-        ++fpsCounter;
-
-        auto timeAfter = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::duration<double>>(timeAfter
-                                                                                  - timeBefore);
-        double timeToSleep = timeForFrame - duration.count();
-        if (oneSecondCounter > 1.0) {
-            fpsCounter = 0;
-            oneSecondCounter = 0.0;
-        }
-        if (timeToSleep < 0.0) {
+
+        auto frameTime = std::chrono::steady_clock::now() - frameStart;
+        if (frameTime > pacer.getPeriod()) {
             // Comment it out to prevent spamming about low FPS. TODO: make it a config option
-            LOG("Warning: frame rendering took longer than 1 / " << desiredFps << " s");
-            LOG("Time to sleep is " << timeToSleep);
-        } else {
-            usleep(static_cast<int>(timeToSleep * 1e+6));
+            LOG("Warning: frame took " << std::chrono::duration<double>(frameTime).count()
+                                       << " s, longer than 1 / " << getFrameRate() << " s");
         }
-
-        auto timeAfterSleep = std::chrono::high_resolution_clock::now();
-        auto fullDuration = std::chrono::duration_cast<std::chrono::duration<double>>(timeAfterSleep
-                                                                                      - timeBefore);
-        oneSecondCounter += fullDuration.count();
+        pacer.wait();
     }
     destroy();
 }
@@ -2,12 +2,15 @@
 
 #include <modbox/core/core.hpp>
 #include <modbox/core/event_manager.hpp>
+#include <modbox/core/typed_func_provider.hpp>
+#include <modbox/game/entity_index.hpp>
 #include <modbox/game/game_object.hpp>
 #include <modbox/graphics/graphics.hpp>
 #include <modbox/log/log.hpp>
 #include <modbox/modules/module_io.hpp>
 #include <modbox/util/handle_storage.hpp>
 #include <modbox/util/util.hpp>
+#include <modbox/world/terrain.hpp>
 
 GameObject::GameObject(irr::scene::ISceneNode* _node, const std::string& _kind, GameObjectId _id)
         : node(_node), kind(_kind), id(_id)
@@ -81,6 +84,8 @@ GameObjectId GameObjectManager::createGameObject(const std::string& kind,
     std::lock_guard<std::recursive_mutex> lock(mutex);
     ++idCounter;
     gameObjects.emplace(idCounter, GameObject(model, kind, idCounter));
+    getEntityIndex().addGameObject(model, idCounter);
+    terrainManager.trackObject(idCounter);
     getEventManager().raiseEvent("gameObject.create",
                                  {{"kind", kind}, {"id", std::to_string(idCounter)}});
     return idCounter;
@@ -92,6 +97,8 @@ void GameObjectManager::deleteGameObject(GameObjectId id)
     getEventManager().raiseEvent(
             "gameObject.delete",
             {{"kind", gameObjects.at(id).getKind()}, {"id", std::to_string(id)}});
+    getEntityIndex().forgetGameObject(gameObjects.at(id).sceneNode(), id);
+    terrainManager.forgetObject(id);
     gameObjects.erase(id);
 }
 
@@ -106,6 +113,19 @@ GameObject& GameObjectManager::mutableAccess(GameObjectId id)
     return gameObjects.at(id);
 }
 
+void GameObjectManager::updatePositions()
+{
+    // The mutex is held while events are raised, which call modules, and they may wait for
+    // the render thread. The positions will be updated the next time instead
+    std::unique_lock<std::recursive_mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    for (const auto& [id, object] : gameObjects) {
+        terrainManager.updateObject(id);
+    }
+}
+
 GameObjectManager& getGameObjectManager()
 {
     static GameObjectManager manager;
@@ -124,93 +144,56 @@ void GameObjectManager::addKind(const std::string& kind)
 
 std::optional<GameObjectId> GameObjectManager::reverseLookup(irr::scene::ISceneNode* drawable)
 {
-    std::lock_guard<std::recursive_mutex> lock(mutex);
-    for (auto [id, object] : gameObjects) {
-        if (object.sceneNode() == drawable) {
-            return id;
-        }
-    }
-    return {};
+    return getEntityIndex().findGameObject(drawable);
 }
-FuncResult handlerAddGameObjectKind(const std::vector<std::string>& args)
+void handlerAddGameObjectKind(const std::string& kind)
 {
-    FuncResult ret;
-    if (args.size() != 1) {
-        throw std::logic_error("Wrong number of arguments for handlerAddGameObjectKind()");
-    }
-
-    auto kind = getArgument<std::string>(args, 0);
     getGameObjectManager().addKind(kind);
-    return ret;
 }
-FuncResult handlerAddGameObject(const std::vector<std::string>& args)
+uint64_t handlerAddGameObject(const std::string& kind, uint64_t drawableHandle)
 {
-    FuncResult ret;
-    ret.data.resize(1);
-    if (args.size() != 2) {
-        throw std::logic_error("Wrong number of arguments for handlerAddGameObject()");
-    }
-
-    auto kind = getArgument<std::string>(args, 0);
-    auto drawableHandle = getArgument<uint64_t>(args, 1);
-
-    auto gameObjectId = getGameObjectManager().createGameObject(
-            kind, drawablesManager.access(drawableHandle));
-
-    setReturn(ret, 0, gameObjectId);
-    return ret;
+    return getGameObjectManager().createGameObject(kind, drawablesManager.access(drawableHandle));
 }
-FuncResult handlerRemoveGameObject(const std::vector<std::string>& args)
+void handlerRemoveGameObject(uint64_t gameObjectId)
 {
-    FuncResult ret;
-    if (args.size() != 1) {
-        throw std::logic_error("Wrong number of arguments for handlerRemoveGameObject()");
-    }
-
-    auto gameObjectId = getArgument<uint64_t>(args, 0);
     getGameObjectManager().deleteGameObject(gameObjectId);
-    return ret;
 }
-FuncResult handlerGameObjectAddRecipe(const std::vector<std::string>& args)
+void handlerGameObjectAddRecipe(const std::string& kind,
+                                const std::string& partKind,
+                                const std::string& resultingKind)
 {
-    FuncResult ret;
-    if (args.size() != 3) {
-        throw std::logic_error("Wrong number of arguments for handlerGameObjectAddRecipe()");
-    }
-
-    auto kind = getArgument<std::string>(args, 0);
-    auto partKind = getArgument<std::string>(args, 1);
-    auto resultingKind = getArgument<std::string>(args, 2);
     getGameObjectManager().addRecipe(kind, partKind, resultingKind);
-    return ret;
 }
-FuncResult handlerGameObjectAttachPart(const std::vector<std::string>& args)
+// Both return a blob of NUL-terminated fields: the id, x, y and z of each game object found
+std::vector<uint8_t> handlerFindGameObjectsInRadius(double x, double y, double z, double radius)
+{
+    std::vector<SpatialIndex::Entry> found;
+    terrainManager.getObjectIndex().findInRadius({x, y, z}, radius, found);
+    return packSpatialEntries(found);
+}
+std::vector<uint8_t> handlerFindGameObjectsInBox(
+        double lowX, double lowY, double lowZ, double highX, double highY, double highZ)
+{
+    std::vector<SpatialIndex::Entry> found;
+    terrainManager.getObjectIndex().findInBox({lowX, lowY, lowZ}, {highX, highY, highZ}, found);
+    return packSpatialEntries(found);
+}
+int64_t handlerGameObjectAttachPart(uint64_t id, const std::string& partKind)
 {
-    FuncResult ret;
-    if (args.size() != 2) {
-        throw std::logic_error("Wrong number of arguments for handlerGameObjectAddRecipe()");
-    }
-    ret.data.resize(1);
-
-    auto id = getArgument<uint64_t>(args, 0);
-    auto partKind = getArgument<std::string>(args, 1);
-
     bool ok = getGameObjectManager().mutableAccess(id).attachPart(partKind);
-    setReturn(ret, 0, ok ? 1 : 0);
-
-    return ret;
+    return ok ? 1 : 0;
 }
 
 void initializeGameObjects()
 {
     addSelectorKind("gameObjects");
-    registerFuncProvider(FuncProvider("gameObject.addKind", handlerAddGameObjectKind), "s", "");
-    registerFuncProvider(FuncProvider("gameObject.add", handlerAddGameObject), "su", "u");
-    registerFuncProvider(FuncProvider("gameObject.remove", handlerRemoveGameObject), "su", "");
-    registerFuncProvider(
-            FuncProvider("gameObject.addRecipe", handlerGameObjectAddRecipe), "sss", "");
-    registerFuncProvider(
-            FuncProvider("gameObject.attachPart", handlerGameObjectAttachPart), "us", "i");
+    registerFuncProvider("gameObject.addKind", handlerAddGameObjectKind);
+    registerFuncProvider("gameObject.add", handlerAddGameObject);
+    registerFuncProvider("gameObject.remove", handlerRemoveGameObject);
+    registerFuncProvider("gameObject.addRecipe", handlerGameObjectAddRecipe);
+    registerFuncProvider("gameObject.attachPart", handlerGameObjectAttachPart);
+    registerFuncProvider("gameObject.findInRadius", handlerFindGameObjectsInRadius);
+    registerFuncProvider("gameObject.findInBox", handlerFindGameObjectsInBox);
 }
 
 void GameObjectManager::addRecipe(const std::string& kind,
@@ -16,7 +16,8 @@ Player::Player(irr::scene::ICameraSceneNode* _camera, irr::scene::ISceneNode* _p
         : camera(_camera)
         , pseudoCamera(_pseudoCamera)
         , rotation({0, 0, 0})
-        , cachedPosition(_pseudoCamera->getPosition())
+        , previousStepPosition(_pseudoCamera->getPosition())
+        , lastStepPosition(_pseudoCamera->getPosition())
 {
 }
 
@@ -24,10 +25,23 @@ void Player::move(double dx, double dz)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex);
     pseudoCamera->setPosition(pseudoCamera->getPosition() + irr::core::vector3df(dx, 0, dz));
-    // camera->updateAbsolutePosition();
-    camera->setPosition(cachedPosition);
-    // camera->updateAbsolutePosition();
-    cachedPosition = pseudoCamera->getPosition();
+}
+
+void Player::step()
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    // Taken on every step, moving or not, so that a standing player is not drawn between two
+    // stale positions. Collisions and gravity move the pseudo camera when a frame is drawn,
+    // they are picked up by the next step
+    previousStepPosition = lastStepPosition;
+    lastStepPosition = pseudoCamera->getPosition();
+}
+
+void Player::interpolate(double alpha)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    camera->setPosition(previousStepPosition
+                        + (lastStepPosition - previousStepPosition) * static_cast<float>(alpha));
 }
 
 void Player::moveForward(double delta, double directionOffset)
@@ -82,7 +96,7 @@ void Player::jump(double speed)
 GamePosition Player::getPosition()
 {
     std::lock_guard<std::recursive_mutex> lock(mutex);
-    return GamePosition(camera->getPosition());
+    return GamePosition(lastStepPosition);
 }
 
 core::vector3df Player::getRotation()
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+
+#include <modbox/core/core.hpp>
+#include <modbox/core/dyntype.hpp>
+#include <modbox/core/options.hpp>
+#include <modbox/core/typed_func_provider.hpp>
+#include <modbox/game/game_loop.hpp>
+#include <modbox/game/tick_scheduler.hpp>
+#include <modbox/log/log.hpp>
+#include <modbox/modules/module_manager.hpp>
+#include <modbox/util/util.hpp>
+
+TickScheduler::TickScheduler(size_t threadCount, std::chrono::steady_clock::duration _budget)
+        : budget(_budget), pool(threadCount)
+{
+}
+
+uint64_t TickScheduler::add(const std::string& command, uint64_t param, const std::string& laneName)
+{
+    CommandId id = resolveCommand(command);
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t handle = callbacks.insert(Callback{id, command, param, laneName, {}});
+    lanes[laneName].callbacks.push_back(handle);
+    LOG("Each-tick callback '" << command << "' added to lane '" << laneName << "'");
+    return handle;
+}
+
+void TickScheduler::remove(uint64_t handle)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    removeLocked(handle);
+}
+
+void TickScheduler::removeLocked(uint64_t handle)
+{
+    const auto& callback = callbacks.access(handle);
+    const auto& stats = callback.stats;
+    LOG("Removing each-tick callback '"
+        << callback.commandName << "': " << stats.calls << " calls, "
+        << (stats.calls > 0 ? stats.totalSeconds / stats.calls * 1000.0 : 0.0) << " ms average, "
+        << stats.maxSeconds * 1000.0 << " ms max, " << stats.overruns << " overruns, "
+        << stats.skipped << " skipped");
+
+    auto laneIt = lanes.find(callback.laneName);
+    auto& laneCallbacks = laneIt->second.callbacks;
+    laneCallbacks.erase(std::find(laneCallbacks.begin(), laneCallbacks.end(), handle));
+    if (laneCallbacks.empty() && !laneIt->second.running) {
+        lanes.erase(laneIt);
+    }
+    callbacks.remove(handle);
+}
+
+TickCallbackStats TickScheduler::getStats(uint64_t handle)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return callbacks.access(handle).stats;
+}
+
+void TickScheduler::tick()
+{
+    auto deadline = Clock::now() + budget;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& [laneName, lane] : lanes) {
+        if (lane.running) {
+            // Coalesced into the tick the lane is still busy with
+            for (uint64_t handle : lane.callbacks) {
+                ++callbacks.mutableAccess(handle).stats.skipped;
+            }
+            continue;
+        }
+        if (lane.callbacks.empty()) {
+            continue;
+        }
+
+        std::vector<uint64_t> order = lane.callbacks;
+        auto first = std::find(order.begin(), order.end(), lane.resumeFrom);
+        if (first != order.end()) {
+            std::rotate(order.begin(), first, order.end());
+        }
+        lane.running = true;
+        pool.submit([this, laneName = laneName, order = std::move(order), deadline]() {
+            runLane(laneName, order, deadline);
+        });
+    }
+}
+
+void TickScheduler::runLane(const std::string& laneName,
+                            const std::vector<uint64_t>& order,
+                            Clock::time_point deadline)
+{
+    uint64_t resumeFrom = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        uint64_t handle = order[i];
+        // The first callback always runs, even if the lane has been dispatched late (e. g.
+        // queued behind busy lanes), or the lane could be skipped whole on every tick
+        if (i > 0 && Clock::now() >= deadline) {
+            resumeFrom = handle;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t j = i; j < order.size(); ++j) {
+                if (callbacks.contains(order[j])) {
+                    ++callbacks.mutableAccess(order[j]).stats.skipped;
+                }
+            }
+            break;
+        }
+
+        CommandId command;
+        std::string commandName;
+        std::string arg;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!callbacks.contains(handle)) {
+                // Removed since the lane was dispatched
+                continue;
+            }
+            const auto& callback = callbacks.access(handle);
+            command = callback.command;
+            commandName = callback.commandName;
+            arg = DyntypeCaster<std::string>::get(callback.param);
+        }
+
+        auto start = Clock::now();
+        try {
+            auto ret = getFuncProviderEntry(command).provider({arg});
+            if (ret.data.size() != 0) {
+                LOG("Each-tick callback '" << commandName << "' returned something, ignored");
+            }
+        } catch (const std::exception& e) {
+            LOG("Exception caught in each-tick callback '" << commandName
+                                                           << "': " << wstring_cast(e.what()));
+            logStackTrace();
+            LOG("This funcProvider will be removed from each-tick execution list");
+            std::lock_guard<std::mutex> lock(mutex);
+            if (callbacks.contains(handle)) {
+                removeLocked(handle);
+            }
+            continue;
+        }
+        auto finish = Clock::now();
+        finishCall(handle,
+                   std::chrono::duration<double>(finish - start).count(),
+                   finish > deadline);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto laneIt = lanes.find(laneName);
+    laneIt->second.running = false;
+    laneIt->second.resumeFrom = resumeFrom;
+    if (laneIt->second.callbacks.empty()) {
+        lanes.erase(laneIt);
+    }
+}
+
+void TickScheduler::finishCall(uint64_t handle, double seconds, bool overrun)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!callbacks.contains(handle)) {
+        return;
+    }
+    auto& callback = callbacks.mutableAccess(handle);
+    auto& stats = callback.stats;
+    ++stats.calls;
+    stats.totalSeconds += seconds;
+    stats.maxSeconds = std::max(stats.maxSeconds, seconds);
+    if (overrun) {
+        ++stats.overruns;
+        // Powers of two only, a callback which is always late would flood the log otherwise
+        if ((stats.overruns & (stats.overruns - 1)) == 0) {
+            LOG("Each-tick callback '" << callback.commandName << "' overran the tick budget ("
+                                       << seconds * 1000.0 << " ms), " << stats.overruns
+                                       << " times so far");
+        }
+    }
+}
+
+TickScheduler& getTickScheduler()
+{
+    // Never destroyed: a module that hangs in a callback must not hang the exit
+    static TickScheduler* scheduler = new TickScheduler(
+            []() {
+                auto threads = getOption("tick-threads");
+                if (threads.has_value()) {
+                    return std::max(1ul, std::stoul(*threads));
+                }
+                return std::max(2ul,
+                                static_cast<unsigned long>(std::thread::hardware_concurrency()));
+            }(),
+            std::chrono::milliseconds(std::stoul(getOption("tick-budget-ms", "100"))));
+    return *scheduler;
+}
+
+// Callbacks added by a module go to its lane, the ones added by the engine get a lane each
+static std::string getCurrentLaneName(const std::string& command)
+{
+    try {
+        return "module:" + moduleManager.getCurrentModuleWorker().getModule().getName();
+    } catch (const std::logic_error& e) {
+        return "engine:" + command;
+    }
+}
+
+uint64_t eachTickWithParam(const std::string& name, uint64_t param)
+{
+    return getTickScheduler().add(name, param, getCurrentLaneName(name));
+}
+
+void handlerEachTickRemove(uint64_t handle)
+{
+    getTickScheduler().remove(handle);
+}
+
+std::tuple<uint64_t, uint64_t, uint64_t, double, double> handlerEachTickStats(uint64_t handle)
+{
+    auto stats = getTickScheduler().getStats(handle);
+    double average = stats.calls > 0 ? stats.totalSeconds / stats.calls : 0.0;
+    return {stats.calls, stats.skipped, stats.overruns, average, stats.maxSeconds};
+}
+
+void initializeTickScheduler()
+{
+    registerFuncProvider("game.eachTick.add", eachTickWithParam);
+    registerFuncProvider("game.eachTick.remove", handlerEachTickRemove);
+    registerFuncProvider("game.eachTick.stats", handlerEachTickStats);
+}
@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+#include <modbox/core/core.hpp>
+#include <modbox/core/dyntype.hpp>
+#include <modbox/core/options.hpp>
+#include <modbox/core/typed_func_provider.hpp>
+#include <modbox/game/timer_service.hpp>
+#include <modbox/log/log.hpp>
+#include <modbox/modules/module_manager.hpp>
+#include <modbox/util/util.hpp>
+
+TimerService::TimerService(std::chrono::steady_clock::duration _resolution, size_t threadCount)
+        : start(Clock::now()), resolution(_resolution), pool(threadCount)
+{
+    // Never joined, like the module reactor thread: it dies with the process
+    thread = std::thread(&TimerService::loop, this);
+    thread.detach();
+}
+
+uint64_t TimerService::tickAt(Clock::time_point time) const
+{
+    return (time - start) / resolution;
+}
+
+uint64_t TimerService::ticksFor(double seconds) const
+{
+    double ticks = std::ceil(seconds / std::chrono::duration<double>(resolution).count());
+    return std::max(1.0, ticks);
+}
+
+uint64_t TimerService::add(const std::string& owner,
+                           const std::string& callback,
+                           uint64_t param,
+                           double delay,
+                           double period)
+{
+    if (!(delay >= 0.0) || !(period >= 0.0)) {
+        throw std::runtime_error("Timer delay and period must not be negative");
+    }
+    const auto& entry = getFuncProviderEntry(callback);
+    if (entry.argsSpec != "b") {
+        throw std::runtime_error("Timer callback '" + callback + "' must take a single blob");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t now = tickAt(Clock::now());
+    if (wheel.size() == 0) {
+        // The wheel has been idle, catch it up before scheduling relative to it
+        std::vector<TimerWheel::Expiration> none;
+        wheel.advance(now, none);
+    }
+    uint64_t periodTicks = period > 0.0 ? ticksFor(period) : 0;
+    uint64_t timer = timers.insert(Timer{owner, entry.id, param, periodTicks, 0});
+    timers.mutableAccess(timer).wheelTimer = wheel.schedule(now + ticksFor(delay), timer);
+    condition.notify_one();
+    return timer;
+}
+
+bool TimerService::cancel(uint64_t timer, const std::string& owner)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!timers.contains(timer)) {
+        return false;
+    }
+    if (timers.access(timer).owner != owner) {
+        throw std::runtime_error("Timer " + std::to_string(timer) + " belongs to '"
+                                 + timers.access(timer).owner + "', not to '" + owner + "'");
+    }
+    wheel.cancel(timers.access(timer).wheelTimer);
+    timers.remove(timer);
+    return true;
+}
+
+size_t TimerService::cancelOwned(const std::string& owner)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return cancelOwnedLocked(owner, nullptr);
+}
+
+size_t TimerService::cancelOwnedLocked(const std::string& owner, const CommandId* callback)
+{
+    std::vector<uint64_t> cancelled;
+    for (const auto& [handle, timer] : timers) {
+        if (timer.owner == owner && (callback == nullptr || timer.callback == *callback)) {
+            cancelled.push_back(handle);
+        }
+    }
+    for (uint64_t handle : cancelled) {
+        wheel.cancel(timers.access(handle).wheelTimer);
+        timers.remove(handle);
+    }
+    // Expirations that have not been delivered yet are dropped too. Every batch in the map is
+    // being delivered, deliver() erases it when it finds the blob empty
+    for (auto& [batchKey, batch] : batches) {
+        if (batch.owner == owner && (callback == nullptr || batch.callback == *callback)) {
+            batch.blob.clear();
+        }
+    }
+    return cancelled.size();
+}
+
+void TimerService::loop() noexcept
+{
+    std::vector<TimerWheel::Expiration> expired;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        if (wheel.size() == 0) {
+            condition.wait(lock);
+        } else {
+            // Wake up only when something may expire, not on every tick
+            condition.wait_until(lock, start + wheel.getNextExpiryBound() * resolution);
+        }
+
+        expired.clear();
+        wheel.advance(tickAt(Clock::now()), expired);
+        for (const auto& expiration : expired) {
+            expire(expiration);
+        }
+    }
+}
+
+void TimerService::expire(const TimerWheel::Expiration& expiration)
+{
+    uint64_t handle = expiration.payload;
+    auto& timer = timers.mutableAccess(handle);
+
+    std::string batchKey = timer.owner + '\0' + std::to_string(timer.callback);
+    auto& batch = batches[batchKey];
+    batch.owner = timer.owner;
+    batch.callback = timer.callback;
+    appendBlobField(batch.blob, std::to_string(handle));
+    appendBlobField(batch.blob, std::to_string(timer.param));
+    if (!batch.running) {
+        batch.running = true;
+        pool.submit([this, batchKey]() { deliver(batchKey); });
+    }
+
+    if (timer.periodTicks == 0) {
+        timers.remove(handle);
+    } else {
+        uint64_t next = expiration.expiry + timer.periodTicks;
+        uint64_t now = wheel.getCurrentTick();
+        if (next <= now) {
+            next += (now - next) / timer.periodTicks * timer.periodTicks + timer.periodTicks;
+        }
+        timer.wheelTimer = wheel.schedule(next, handle);
+    }
+}
+
+void TimerService::deliver(const std::string& batchKey) noexcept
+{
+    while (true) {
+        std::string owner;
+        CommandId callback;
+        std::vector<uint8_t> blob;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto& batch = batches.at(batchKey);
+            if (batch.blob.empty()) {
+                batches.erase(batchKey);
+                return;
+            }
+            owner = batch.owner;
+            callback = batch.callback;
+            blob.swap(batch.blob);
+        }
+
+        try {
+            getFuncProviderEntry(callback).provider({DyntypeCaster<std::string>::get(blob)});
+        } catch (const std::exception& e) {
+            LOG("Timer callback #" << callback << " threw exception: " << wstring_cast(e.what()));
+            // Most likely the module has crashed or gone away, a periodic timer would keep
+            // failing forever
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t cancelled = cancelOwnedLocked(owner, &callback);
+            LOG("Cancelled " << cancelled << " timers of '" << owner << "' calling it");
+        }
+    }
+}
+
+TimerService& getTimerService()
+{
+    // Never destroyed: its thread lives as long as the process
+    static TimerService* service = new TimerService(
+            std::chrono::milliseconds(
+                    std::max(1ul, std::stoul(getOption("timer-resolution-ms", "10")))),
+            std::max(1ul, std::stoul(getOption("timer-threads", "2"))));
+    return *service;
+}
+
+static std::string getModuleOwnerName(const std::string& moduleName)
+{
+    return "module:" + moduleName;
+}
+
+// Timers added by a module belong to it, expirations are coalesced per owner
+static std::string getCurrentOwnerName()
+{
+    try {
+        return getModuleOwnerName(moduleManager.getCurrentModuleWorker().getModule().getName());
+    } catch (const std::logic_error& e) {
+        return "engine";
+    }
+}
+
+uint64_t handlerAddTimer(const std::string& callback, uint64_t param, double delay, double period)
+{
+    return getTimerService().add(getCurrentOwnerName(), callback, param, delay, period);
+}
+
+uint64_t handlerCancelTimer(uint64_t timer)
+{
+    return getTimerService().cancel(timer, getCurrentOwnerName()) ? 1 : 0;
+}
+
+void initializeTimerService()
+{
+    registerFuncProvider("timer.add", handlerAddTimer);
+    registerFuncProvider("timer.cancel", handlerCancelTimer);
+}
+
+void cancelModuleTimers(const std::string& moduleName)
+{
+    size_t cancelled = getTimerService().cancelOwned(getModuleOwnerName(moduleName));
+    if (cancelled > 0) {
+        LOG("Cancelled " << cancelled << " timers of module '" << moduleName << "'");
+    }
+}
@@ -68,7 +68,7 @@ GamePosition& GamePosition::operator+=(const GamePosition& other)
 
 std::pair<int64_t, int64_t> GamePosition::getChunk() const
 {
-    return {floor(x) / CHUNK_SIZE_IRRLICHT, floor(z) / CHUNK_SIZE_IRRLICHT};
+    return {floor(x / CHUNK_SIZE_IRRLICHT), floor(z / CHUNK_SIZE_IRRLICHT)};
 }
 
 std::wostream& operator<<(std::wostream& out, const GamePosition& pos)
@@ -1,3 +1,4 @@
+#include <modbox/game/entity_index.hpp>
 #include <modbox/graphics/graphics.hpp>
 
 irr::scene::ISceneNode* DrawablesManager::access(uint64_t handle)
@@ -11,21 +12,19 @@ irr::scene::ISceneNode* DrawablesManager::access(uint64_t handle)
 
 uint64_t DrawablesManager::track(irr::scene::ISceneNode* drawable)
 {
-    return drawables.insert(drawable);
+    uint64_t handle = drawables.insert(drawable);
+    getEntityIndex().addDrawable(drawable, handle);
+    return handle;
 }
 
 std::optional<uint64_t> DrawablesManager::reverseLookup(irr::scene::ISceneNode* drawable)
 {
-    for (auto& [handle, value] : drawables) {
-        if (value == drawable) {
-            return handle;
-        }
-    }
-    return {};
+    return getEntityIndex().findDrawable(drawable);
 }
 
 void DrawablesManager::forget(uint64_t handle)
 {
+    getEntityIndex().forgetDrawable(access(handle), handle);
     drawables.remove(handle);
 }
 
@@ -8,6 +8,7 @@
 
 #include <modbox/core/core.hpp>
 #include <modbox/core/event_manager.hpp>
+#include <modbox/core/typed_func_provider.hpp>
 #include <modbox/game/game_loop.hpp>
 #include <modbox/game/game_object.hpp>
 #include <modbox/geometry/geometry.hpp>
@@ -46,6 +47,8 @@ namespace graphics
 
     std::unordered_map<std::string, irr::video::ITexture*> textureCache;
 
+    // Drawn in the order they were added, so that the later ones overlap the earlier ones.
+    // Removing one must not reorder the others: use removeKeepingOrder()
     HandleStorage<uint64_t, std::pair<irr::core::rectf, irr::video::SColor>> rectangles;
     HandleStorage<uint64_t, std::pair<irr::core::line2df, irr::video::SColor>> lines;
     HandleStorage<uint64_t, std::pair<irr::core::rectf, irr::video::ITexture*>> images;
@@ -192,62 +195,26 @@ void IrrEventReceiver::deleteEventHandler(uint64_t id)
 static void initializeIrrlicht(std::vector<std::string>& args);
 
 // Внешнее API: перемещение оъекта
-FuncResult handlerGraphicsMoveObject(const std::vector<std::string>& args)
+void handlerGraphicsMoveObject(uint64_t objectHandle, double x, double y, double z)
 {
-    if (args.size() != 4) {
-        throw std::logic_error("Wrong number of arguments for handlerGraphicsMoveObject()");
-    }
-    FuncResult ret;
-
-    uint64_t objectHandle = getArgument<uint64_t>(args, 0);
-
-    double x = getArgument<double>(args, 1);
-    double y = getArgument<double>(args, 2);
-    double z = getArgument<double>(args, 3);
-
     std::lock_guard<std::recursive_mutex> lock(irrlichtMutex);
     graphicsMoveObject(getGameObjectManager().mutableAccess(objectHandle).sceneNode(),
                        GamePosition(x, y, z));
-
-    return ret;
 }
 
 // Внешнее API: удаление оъекта
-FuncResult handlerGraphicsDeleteObject(const std::vector<std::string>& args)
+void handlerGraphicsDeleteObject(uint64_t objectHandle)
 {
-    if (args.size() != 1) {
-        throw std::logic_error("Wrong number of arguments for handlerGraphicsDeleteObject()");
-    }
-    FuncResult ret;
-
-    uint64_t objectHandle = getArgument<uint64_t>(args, 0);
-
     std::lock_guard<std::recursive_mutex> lock(irrlichtMutex);
     getGameObjectManager().deleteGameObject(objectHandle);
-
-    return ret;
 }
 
 // Внешнее API: вращение оъекта
-FuncResult handlerGraphicsRotateObject(const std::vector<std::string>& args)
+void handlerGraphicsRotateObject(uint64_t objectHandle, double pitch, double roll, double yaw)
 {
-    if (args.size() != 4) {
-        throw std::logic_error("Wrong number of arguments for handlerGraphicsRotateObject()");
-    }
-
-    FuncResult ret;
-
-    uint64_t objectHandle = getArgument<uint64_t>(args, 0);
-
-    double pitch = getArgument<double>(args, 1);
-    double roll = getArgument<double>(args, 2);
-    double yaw = getArgument<double>(args, 3);
-
     std::lock_guard<std::recursive_mutex> lock(irrlichtMutex);
     graphicsRotateObject(getGameObjectManager().mutableAccess(objectHandle).sceneNode(),
                          core::vector3df(pitch, roll, yaw));
-
-    return ret;
 }
 
 // Внешнее API: загрузить текстуру из файла
@@ -808,33 +775,24 @@ FuncResult handlerGraphicsGetRayIntersectionEnemy(const std::vector<std::string>
     return ret;
 }
 
-FuncResult handlerGraphicsScaleDrawable(const std::vector<std::string>& args)
+void handlerGraphicsScaleDrawable(uint64_t drawableHandle,
+                                  double scaleX,
+                                  double scaleY,
+                                  double scaleZ)
 {
     std::lock_guard<std::recursive_mutex> lock(irrlichtMutex);
-    FuncResult ret;
-    if (args.size() != 4) {
-        throw std::logic_error("Invalid number of arguments for handlerGraphicsScaleDrawable()");
-    }
-
-    auto drawableHandle = getArgument<uint64_t>(args, 0);
-    auto scaleX = getArgument<float>(args, 1);
-    auto scaleY = getArgument<float>(args, 2);
-    auto scaleZ = getArgument<float>(args, 3);
-
-    drawablesManager.access(drawableHandle)->setScale({scaleX, scaleY, scaleZ});
-
-    return ret;
+    drawablesManager.access(drawableHandle)
+            ->setScale(core::vector3df(static_cast<float>(scaleX),
+                                       static_cast<float>(scaleY),
+                                       static_cast<float>(scaleZ)));
 }
 
 // Инициализация внешнего API
 static inline void initializeGraphicsFuncProviders()
 {
-    registerFuncProvider(
-            FuncProvider("graphics.moveObject", handlerGraphicsMoveObject), "ufff", "");
-    registerFuncProvider(
-            FuncProvider("graphics.rotateObject", handlerGraphicsRotateObject), "ufff", "");
-    registerFuncProvider(
-            FuncProvider("graphics.deleteObject", handlerGraphicsDeleteObject), "u", "");
+    registerFuncProvider("graphics.moveObject", handlerGraphicsMoveObject);
+    registerFuncProvider("graphics.rotateObject", handlerGraphicsRotateObject);
+    registerFuncProvider("graphics.deleteObject", handlerGraphicsDeleteObject);
     registerFuncProvider(
             FuncProvider("graphics.texture.loadFromFile", handlerGraphicsLoadTexture), "s", "u");
     registerFuncProvider(
@@ -863,8 +821,7 @@ static inline void initializeGraphicsFuncProviders()
             FuncProvider("graphics.drawable.disableCollisions", handlerDrawableDisableCollisions),
             "u",
             "");
-    registerFuncProvider(
-            FuncProvider("graphics.drawable.setScale", handlerGraphicsScaleDrawable), "ufff", "");
+    registerFuncProvider("graphics.drawable.setScale", handlerGraphicsScaleDrawable);
     registerFuncProvider(
             FuncProvider("graphics.2d.addRectangle", handlerAdd2DRectangle), "ffffiiii", "u");
     registerFuncProvider(FuncProvider("graphics.2d.addLine", handlerAdd2DLine), "ffffiiii", "u");
@@ -1541,20 +1498,20 @@ uint64_t graphicsAdd2DText(const irr::core::rectf& rect, const std::string& text
 
 void graphicsRemove2DRectangle(uint64_t handle)
 {
-    graphics::rectangles.remove(handle);
+    graphics::rectangles.removeKeepingOrder(handle);
 }
 void graphicsRemove2DLine(uint64_t handle)
 {
-    graphics::lines.remove(handle);
+    graphics::lines.removeKeepingOrder(handle);
 }
 void graphicsRemove2DImage(uint64_t handle)
 {
     graphics::images.access(handle).second->drop();
-    graphics::images.remove(handle);
+    graphics::images.removeKeepingOrder(handle);
 }
 void graphicsRemove2DText(uint64_t handle)
 {
-    graphics::texts.remove(handle);
+    graphics::texts.removeKeepingOrder(handle);
 }
 
 void graphicsModify2DRectangle(uint64_t handle,
@@ -1,30 +1,31 @@
 #include <modbox/modules/module.hpp>
 
-#include <unistd.h>
-
-Module::Module(int _mainSocket,
-               int _reverseSocket,
+Module::Module(std::shared_ptr<Connection> _mainConnection,
+               std::shared_ptr<Connection> _reverseConnection,
                const std::string& _name,
-               const std::vector<std::string>& _dependencies)
-        : mainSocket(_mainSocket)
-        , reverseSocket(_reverseSocket)
+               const std::vector<std::string>& _dependencies,
+               ModuleProtocol _protocol)
+        : mainConnection(_mainConnection)
+        , reverseConnection(_reverseConnection)
         , name(_name)
         , dependencies(_dependencies)
+        , protocol(_protocol)
 {
 }
 
 Module::Module(const Module& other)
-        : mainSocket(other.mainSocket)
-        , reverseSocket(other.reverseSocket)
+        : mainConnection(other.mainConnection)
+        , reverseConnection(other.reverseConnection)
         , name(other.name)
         , dependencies(other.dependencies)
+        , protocol(other.protocol)
 {
 }
 
 void Module::cleanup() noexcept
 {
-    close(mainSocket);
-    close(reverseSocket);
+    mainConnection->close();
+    reverseConnection->close();
 }
 
 std::string Module::getName() const
@@ -33,15 +34,15 @@ std::string Module::getName() const
     return name;
 }
 
-int Module::getMainSocket() const
+std::shared_ptr<Connection> Module::getMainConnection() const
 {
     std::lock_guard<std::recursive_mutex> lock(mtx);
-    return mainSocket;
+    return mainConnection;
 }
-int Module::getReverseSocket() const
+std::shared_ptr<Connection> Module::getReverseConnection() const
 {
     std::lock_guard<std::recursive_mutex> lock(mtx);
-    return reverseSocket;
+    return reverseConnection;
 }
 
 std::vector<std::string> Module::getDependencies() const
@@ -49,3 +50,9 @@ std::vector<std::string> Module::getDependencies() const
     std::lock_guard<std::recursive_mutex> lock(mtx);
     return dependencies;
 }
+
+ModuleProtocol Module::getProtocol() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    return protocol;
+}
@@ -4,28 +4,245 @@
 
 #include <modbox/log/log.hpp>
 #include <modbox/modules/module_io.hpp>
-#include <modbox/net/socketlib.hpp>
+#include <modbox/util/base64.hpp>
 #include <modbox/util/util.hpp>
 
-void readModuleHeader(int sock)
+// A frame larger than that is most likely garbage, so we do not try to allocate memory for it
+static const uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+static void encodeUint32(uint8_t* bytes, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+static uint32_t decodeUint32(const uint8_t* bytes)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<uint32_t>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+ModuleProtocol readModuleHeader(Connection& conn)
 {
     char buf[8];
-    recvBuf(sock, buf, 8);
-    if (memcmp(buf, "ModBox/m", 8ull) != 0) {
-        throw std::runtime_error("Invalid module header");
+    conn.recv(buf, 8);
+    if (memcmp(buf, "ModBox/m", 8ull) == 0) {
+        return mpText;
+    } else if (memcmp(buf, "ModBv2/m", 8ull) == 0) {
+        return mpBinary;
     }
+    throw std::runtime_error("Invalid module header");
 }
 
-void readReverseModuleHeader(int sock)
+ModuleProtocol readReverseModuleHeader(Connection& conn)
 {
     char buf[8];
-    recvBuf(sock, buf, 8);
-    if (memcmp(buf, "ModBox/r", 8ull) != 0) {
-        throw std::runtime_error("Invalid reverse module header");
+    conn.recv(buf, 8);
+    if (memcmp(buf, "ModBox/r", 8ull) == 0) {
+        return mpText;
+    } else if (memcmp(buf, "ModBv2/r", 8ull) == 0) {
+        return mpBinary;
+    }
+    throw std::runtime_error("Invalid reverse module header");
+}
+
+std::string readModuleName(Connection& conn)
+{
+    return conn.recvString();
+}
+
+void MessageWriter::writeRaw(const void* data, size_t length)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    payload.insert(payload.end(), bytes, bytes + length);
+}
+
+void MessageWriter::writeByte(uint8_t value)
+{
+    payload.push_back(value);
+}
+
+void MessageWriter::writeUint32(uint32_t value)
+{
+    uint8_t bytes[4];
+    encodeUint32(bytes, value);
+    writeRaw(bytes, 4);
+}
+
+void MessageWriter::writeUint(uint64_t value)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; ++i) {
+        bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+    writeRaw(bytes, 8);
+}
+
+void MessageWriter::writeInt(int64_t value)
+{
+    writeUint(static_cast<uint64_t>(value));
+}
+
+void MessageWriter::writeFloat(double value)
+{
+    static_assert(sizeof(double) == sizeof(uint64_t), "double is expected to be 64 bits long");
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeUint(bits);
+}
+
+void MessageWriter::writeString(const std::string& value)
+{
+    uint8_t bytes[4];
+    encodeUint32(bytes, value.length());
+    writeRaw(bytes, 4);
+    writeRaw(value.data(), value.length());
+}
+
+void MessageWriter::writeBlob(const std::vector<uint8_t>& value)
+{
+    uint8_t bytes[4];
+    encodeUint32(bytes, value.size());
+    writeRaw(bytes, 4);
+    writeRaw(value.data(), value.size());
+}
+
+void MessageWriter::writeValue(char type, const std::string& value)
+{
+    switch (type) {
+    case 'i':
+        writeInt(DyntypeCaster<int64_t>::get(value));
+        break;
+    case 'u':
+        writeUint(DyntypeCaster<uint64_t>::get(value));
+        break;
+    case 'f':
+        writeFloat(DyntypeCaster<double>::get(value));
+        break;
+    case 's':
+        writeString(value);
+        break;
+    case 'b':
+        // Blobs are kept base64-encoded inside the engine, only the wire gets raw bytes
+        writeBlob(base64_decode(value));
+        break;
+    default:
+        throw std::logic_error(std::string("Unknown type: '") + type + "'");
+    }
+}
+
+void MessageWriter::send(Connection& conn) const
+{
+    if (payload.size() > MAX_FRAME_SIZE) {
+        throw std::runtime_error("Message is too large");
+    }
+    uint8_t header[4];
+    encodeUint32(header, payload.size());
+    conn.send(header, 4);
+    conn.send(payload.data(), payload.size());
+}
+
+MessageReader::MessageReader(Connection& conn)
+{
+    uint8_t header[4];
+    conn.recv(header, 4);
+    uint32_t length = decodeUint32(header);
+    if (length > MAX_FRAME_SIZE) {
+        throw std::runtime_error("Message is too large: " + std::to_string(length) + " bytes");
+    }
+    payload.resize(length);
+    conn.recv(payload.data(), length);
+}
+
+void MessageReader::readRaw(void* data, size_t length)
+{
+    if (payload.size() - position < length) {
+        throw std::runtime_error("Unexpected end of message");
+    }
+    memcpy(data, payload.data() + position, length);
+    position += length;
+}
+
+uint8_t MessageReader::readByte()
+{
+    uint8_t value;
+    readRaw(&value, 1);
+    return value;
+}
+
+uint32_t MessageReader::readUint32()
+{
+    uint8_t bytes[4];
+    readRaw(bytes, 4);
+    return decodeUint32(bytes);
+}
+
+uint64_t MessageReader::readUint()
+{
+    uint8_t bytes[8];
+    readRaw(bytes, 8);
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+int64_t MessageReader::readInt()
+{
+    return static_cast<int64_t>(readUint());
+}
+
+double MessageReader::readFloat()
+{
+    uint64_t bits = readUint();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+std::string MessageReader::readString()
+{
+    uint8_t bytes[4];
+    readRaw(bytes, 4);
+    uint32_t length = decodeUint32(bytes);
+    if (payload.size() - position < length) {
+        throw std::runtime_error("Unexpected end of message");
+    }
+    std::string value(payload.begin() + position, payload.begin() + position + length);
+    position += length;
+    return value;
+}
+
+std::vector<uint8_t> MessageReader::readBlob()
+{
+    std::string value = readString();
+    return std::vector<uint8_t>(value.begin(), value.end());
+}
+
+std::string MessageReader::readValue(char type)
+{
+    switch (type) {
+    case 'i':
+        return std::to_string(readInt());
+    case 'u':
+        return std::to_string(readUint());
+    case 'f':
+        return DyntypeCaster<std::string>::get(readFloat());
+    case 's':
+        return readString();
+    case 'b':
+        return base64_encode(readBlob());
+    default:
+        throw std::logic_error(std::string("Unknown type: '") + type + "'");
     }
 }
 
-std::string readModuleName(int sock)
+bool MessageReader::atEnd() const
 {
-    return recvString(sock);
+    return position == payload.size();
 }
@@ -1,24 +1,33 @@
 #include <regex>
 #include <unordered_map>
 
+#include <modbox/core/options.hpp>
 #include <modbox/modules/module_manager.hpp>
+#include <modbox/net/connection.hpp>
+#include <modbox/net/net.hpp>
+#include <modbox/net/shm_connection.hpp>
 
 #include <boost/filesystem.hpp>
+#include <fcntl.h>
 #include <spawn.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-static std::unordered_map<std::thread::id, ModuleWorker&> moduleWorkers;
+// Requests of a module may be executed by pool threads as well as by its own worker thread,
+// so the worker is tracked per thread while it runs a request
+static thread_local ModuleWorker* currentModuleWorker = nullptr;
 
-ModuleWorker& ModuleManager::getModuleWorkerByThreadId(std::thread::id threadId)
+ModuleWorker& ModuleManager::getCurrentModuleWorker()
 {
-    std::lock_guard<std::recursive_mutex> lock(mutex);
-    return moduleWorkers.at(threadId);
+    if (currentModuleWorker == nullptr) {
+        throw std::logic_error("The current thread is not serving any module");
+    }
+    return *currentModuleWorker;
 }
 
-void ModuleManager::registerModuleWorker(ModuleWorker& worker, std::thread::id threadId)
+void ModuleManager::setCurrentModuleWorker(ModuleWorker* worker)
 {
-    std::lock_guard<std::recursive_mutex> lock(mutex);
-    moduleWorkers.insert({threadId, worker});
+    currentModuleWorker = worker;
 }
 
 void ModuleManager::registerModule(const Module& module)
@@ -39,8 +48,31 @@ void ModuleManager::unregisterModule(const std::string& moduleName)
     modules.erase(moduleName);
 }
 
+// Both ends are close-on-exec, so that modules spawned later do not inherit them
+static void createSocketPair(int fds[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        LOG("socketpair() failed: " << strerror(errno));
+        throw std::runtime_error("socketpair() failed: " + std::string(strerror(errno)));
+    }
+}
+
 void ModuleManager::loadModule(const std::string& moduleName, const std::vector<std::string>& _args)
 {
+    // By default the module gets one end of a socketpair per channel. With "shm" it gets
+    // a shared memory segment instead, and with "tcp" it connects to the module listener,
+    // which is useful for modules started by hand
+    std::string transport = getOption("module-transport", "unix");
+    if (transport != "unix" && transport != "shm" && transport != "tcp") {
+        throw std::runtime_error("Unknown module transport: '" + transport + "'");
+    }
+
+    // Element 0 is our end, element 1 is passed to the module
+    int mainSockets[2] = {-1, -1};
+    int reverseSockets[2] = {-1, -1};
+    std::shared_ptr<ShmSegment> segment;
+    pid_t pid;
+
     do {
         std::lock_guard<std::recursive_mutex> lock(mutex);
         auto args = _args; // Copy _args
@@ -58,18 +90,53 @@ void ModuleManager::loadModule(const std::string& moduleName, const std::vector<
         }
         std::vector<const char*> argv{"start", nullptr};
 
+        std::vector<std::string> transportArgs;
+        if (transport == "unix") {
+            createSocketPair(mainSockets);
+            try {
+                createSocketPair(reverseSockets);
+            } catch (...) {
+                close(mainSockets[0]);
+                close(mainSockets[1]);
+                throw;
+            }
+            transportArgs.push_back("--main-fd=" + std::to_string(mainSockets[1]));
+            transportArgs.push_back("--reverse-fd=" + std::to_string(reverseSockets[1]));
+        } else if (transport == "shm") {
+            segment = ShmSegment::create();
+            transportArgs.push_back("--shm-fd=" + std::to_string(segment->getFd()));
+        } else {
+            transportArgs.push_back("--main-port=44145");
+            transportArgs.push_back("--reverse-port=54144");
+        }
+
         LOG("Forking...");
-        auto pid = fork();
+        pid = fork();
         if (pid == -1) {
             LOG("fork() failed: " << strerror(errno));
+            if (transport == "unix") {
+                close(mainSockets[0]);
+                close(mainSockets[1]);
+                close(reverseSockets[0]);
+                close(reverseSockets[1]);
+            }
             throw std::runtime_error("fork() failed: " + std::string(strerror(errno)));
         } else if (pid == 0) {
+            // Let the module's descriptors survive execv()
+            if (transport == "unix") {
+                fcntl(mainSockets[1], F_SETFD, 0);
+                fcntl(reverseSockets[1], F_SETFD, 0);
+            } else if (transport == "shm") {
+                fcntl(segment->getFd(), F_SETFD, 0);
+            }
+
             std::vector<char*> raw_argv;
-            raw_argv.reserve(args.size() + 4);
+            raw_argv.reserve(args.size() + transportArgs.size() + 2);
 
             raw_argv.emplace_back(const_cast<char*>(modulePath.c_str()));
-            raw_argv.emplace_back(const_cast<char*>("--main-port=44145"));
-            raw_argv.emplace_back(const_cast<char*>("--reverse-port=54144"));
+            for (const std::string& arg : transportArgs) {
+                raw_argv.emplace_back(const_cast<char*>(arg.c_str()));
+            }
             for (const std::string& arg : args) {
                 // Надеюсь, оно не упадёт из-за этого
                 raw_argv.emplace_back(const_cast<char*>(arg.c_str()));
@@ -89,9 +156,26 @@ void ModuleManager::loadModule(const std::string& moduleName, const std::vector<
             // Parent process
             LOG("Child process [" << pid
                                   << "] created successfully. Waiting until module is ready...");
+            if (transport == "unix") {
+                close(mainSockets[1]);
+                close(reverseSockets[1]);
+            }
             break;
         }
     } while (false);
+
+    // If the module dies before introducing itself, we get an error here instead of waiting
+    // forever
+    if (transport == "unix") {
+        connectSpawnedModule(moduleName, std::make_shared<SocketConnection>(mainSockets[0]),
+                             std::make_shared<SocketConnection>(reverseSockets[0]));
+    } else if (transport == "shm") {
+        connectSpawnedModule(
+                moduleName,
+                std::make_shared<ShmConnection>(segment, SHM_RING_MAIN_IN, SHM_RING_MAIN_OUT, pid),
+                std::make_shared<ShmConnection>(
+                        segment, SHM_RING_REVERSE_IN, SHM_RING_REVERSE_OUT, pid));
+    }
     // Так хитро, чтобы lock_guard в этой функции не мешал потом вызвать addReadyModule()
     while (!isReady(moduleName)) {
         std::this_thread::yield();
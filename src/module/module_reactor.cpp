@@ -0,0 +1,122 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <modbox/log/log.hpp>
+#include <modbox/modules/module_reactor.hpp>
+#include <modbox/net/connection.hpp>
+#include <modbox/util/util.hpp>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+ModuleReactor::ModuleReactor(size_t workerCount) : pool(workerCount)
+{
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        throw std::runtime_error(std::string("epoll_create1() failed: ") + strerror(errno));
+    }
+    // Never joined, like the listener thread: it dies with the process
+    thread = std::thread(&ModuleReactor::loop, this);
+    thread.detach();
+    LOG(L"Module reactor started with " << workerCount << L" worker threads");
+}
+
+void ModuleReactor::addModule(Module&& module)
+{
+    auto conn = std::dynamic_pointer_cast<SocketConnection>(module.getMainConnection());
+    if (conn == nullptr) {
+        throw std::logic_error("ModuleReactor can only serve socket connections");
+    }
+    int sock = conn->getSocket();
+    auto worker = std::make_shared<ModuleWorker>(std::move(module));
+    LOG(L"Module '" << worker->getModule().getName() << L"' connected");
+    uint32_t generation;
+    {
+        std::lock_guard<std::mutex> lock(workersMutex);
+        generation = nextGeneration++;
+        workers[sock] = {worker, generation};
+    }
+
+    try {
+        arm(sock, generation, EPOLL_CTL_ADD);
+    } catch (...) {
+        removeModule(sock, worker);
+        throw;
+    }
+}
+
+void ModuleReactor::arm(int sock, uint32_t generation, int operation)
+{
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.u64 = (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(sock);
+    if (epoll_ctl(epollFd, operation, sock, &event) < 0) {
+        throw std::runtime_error(std::string("epoll_ctl() failed: ") + strerror(errno));
+    }
+}
+
+void ModuleReactor::loop() noexcept
+{
+    const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        int eventCount = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (eventCount < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(L"FATAL error: epoll_wait() failed in the module reactor: "
+                << wstring_cast(strerror(errno)));
+            return;
+        }
+        for (int i = 0; i < eventCount; ++i) {
+            int sock = static_cast<int>(events[i].data.u64 & 0xffffffff);
+            uint32_t generation = events[i].data.u64 >> 32;
+            std::shared_ptr<ModuleWorker> worker;
+            {
+                std::lock_guard<std::mutex> lock(workersMutex);
+                auto it = workers.find(sock);
+                if (it == workers.end() || it->second.generation != generation) {
+                    // The module has been removed after the event had been reported
+                    continue;
+                }
+                worker = it->second.worker;
+            }
+            pool.submit([this, sock, generation, worker]() { serve(sock, generation, worker); });
+        }
+    }
+}
+
+void ModuleReactor::serve(int sock,
+                          uint32_t generation,
+                          std::shared_ptr<ModuleWorker> worker) noexcept
+{
+    moduleManager.setCurrentModuleWorker(worker.get());
+    try {
+        auto conn = worker->getModule().getMainConnection();
+        // Serve what has already arrived, but let other modules have their turn after a while
+        for (size_t i = 0; i < MAX_REQUESTS_PER_TURN && conn->hasIncomingData(); ++i) {
+            worker->serveRequest();
+        }
+        arm(sock, generation, EPOLL_CTL_MOD);
+    } catch (const std::exception& e) {
+        LOG(L"Module error: ModuleWorker::serveRequest() threw exception: '"
+            << wstring_cast(e.what()) << L"'");
+        removeModule(sock, worker);
+    }
+    moduleManager.setCurrentModuleWorker(nullptr);
+}
+
+void ModuleReactor::removeModule(int sock, std::shared_ptr<ModuleWorker> worker) noexcept
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, sock, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(workersMutex);
+        workers.erase(sock);
+    }
+    worker->finish();
+    // The socket is closed only now, so that its number cannot be reused while it is still in
+    // the epoll set or in the map
+    worker->getModule().cleanup();
+}
@@ -1,18 +1,22 @@
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <exception>
+#include <functional>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <modbox/core/core.hpp>
+#include <modbox/core/options.hpp>
+#include <modbox/game/timer_service.hpp>
 #include <modbox/log/log.hpp>
 #include <modbox/modules/module_io.hpp>
 #include <modbox/modules/module_manager.hpp>
-#include <modbox/net/socketlib.hpp>
+#include <modbox/util/thread_pool.hpp>
 #include <modbox/util/util.hpp>
 
-#include <sys/socket.h>
-#include <unistd.h>
-
 ModuleWorker::ModuleWorker(Module&& _module) : module(_module)
 {
     moduleManager.registerModule(module);
@@ -24,16 +28,38 @@ ModuleWorker::~ModuleWorker()
 
 void ModuleWorker::please_work() noexcept
 {
+    LOG(L"Module '" << module.getName() << L"' connected");
+    moduleManager.setCurrentModuleWorker(this);
     try {
         work();
     } catch (std::exception& e) {
         LOG(L"Module error: ModuleWorker::work() threw exception: '" << wstring_cast(e.what())
                                                                      << L"'");
-        return;
     } catch (...) {
         LOG(L"Module error: ModuleWorker::work() threw something we don't care about");
-        return;
     }
+    moduleManager.setCurrentModuleWorker(nullptr);
+    finish();
+}
+
+void ModuleWorker::finish() noexcept
+{
+    // Pool threads may still be executing requests of this module, they use this object
+    waitForPendingRequests();
+    // Nobody is left to handle them
+    cancelModuleTimers(module.getName());
+    // The module is gone, so are the replies to the reverse calls. Wake up whoever waits for them
+    module.getReverseConnection()->shutdown();
+    LOG(L"Module '" << module.getName() << L"': main send lock contended "
+                    << mainSendMutex.getContentions() << L" of " << mainSendMutex.getAcquisitions()
+                    << L" times, reverse send lock contended " << reverseMutex.getContentions()
+                    << L" of " << reverseMutex.getAcquisitions() << L" times");
+}
+
+void ModuleWorker::waitForPendingRequests()
+{
+    std::unique_lock<std::mutex> lock(pendingMutex);
+    pendingCondition.wait(lock, [this]() { return pendingRequests == 0; });
 }
 
 Module& ModuleWorker::getModule()
@@ -41,54 +67,196 @@ Module& ModuleWorker::getModule()
     return module;
 }
 
-void sendError(int sock, const std::string& errorMessage, uint8_t exitCode = 1)
+// Executes pipelined requests of all modules
+static ThreadPool& getRequestPool()
 {
-    sendString(sock, DyntypeCaster<std::string>::get(exitCode));
-    sendString(sock, errorMessage);
-    flushBuffer(sock);
+    static ThreadPool pool([]() {
+        auto threads = getOption("module-request-threads");
+        if (threads.has_value()) {
+            return std::max(1ul, std::stoul(*threads));
+        }
+        return std::max(2ul, static_cast<unsigned long>(std::thread::hardware_concurrency()));
+    }());
+    return pool;
 }
 
-void ModuleWorker::work()
+static void sendError(const Module& module,
+                      Connection& conn,
+                      uint32_t requestId,
+                      const std::string& errorMessage)
 {
-    int sock = module.getMainSocket();
-    LOG(L"Module '" << module.getName() << L"' connected");
+    if (module.getProtocol() == mpBinary) {
+        MessageWriter reply;
+        reply.writeUint32(requestId);
+        reply.writeByte(1);
+        reply.writeString(errorMessage);
+        reply.send(conn);
+    } else {
+        conn.sendString("1");
+        conn.sendString(errorMessage);
+    }
+    conn.flush();
+}
 
+static void sendResult(const Module& module,
+                       Connection& conn,
+                       uint32_t requestId,
+                       const ArgsSpec& retSpec,
+                       const std::vector<std::string>& values)
+{
+    if (module.getProtocol() == mpBinary) {
+        MessageWriter reply;
+        reply.writeUint32(requestId);
+        reply.writeByte(0);
+        for (size_t i = 0; i < retSpec.length(); ++i) {
+            reply.writeValue(retSpec[i], values.at(i));
+        }
+        reply.send(conn);
+    } else {
+        conn.sendString("0");
+        for (size_t i = 0; i < retSpec.length(); ++i) {
+            conn.sendString(values.at(i));
+        }
+    }
+    conn.flush();
+}
+
+void ModuleWorker::work()
+{
     while (true) {
-        std::string command = recvString(sock);
+        serveRequest();
+    }
+}
 
-        // Prepare to run it
-        FuncProvider prov = getFuncProvider(command);
-        ArgsSpec argsSpec = getArgsSpec(command);
+void ModuleWorker::serveRequest()
+{
+    auto conn = module.getMainConnection();
+    const FuncProviderEntry* entry;
+    std::vector<std::string> args;
+    uint32_t requestId = 0;
 
-        // Read its arguments
-        std::vector<std::string> args;
-        args.reserve(argsSpec.length());
-        for (UNUSED char i : argsSpec) {
-            args.push_back(recvString(sock));
+    if (module.getProtocol() == mpBinary) {
+        // The whole request comes in one frame. An empty command name is followed by the ID
+        // of the command, as returned by core.funcProvider.resolve
+        MessageReader request(*conn);
+        requestId = request.readUint32();
+        std::string command = request.readString();
+        if (command.empty()) {
+            entry = &getFuncProviderEntry(request.readUint32());
+        } else {
+            entry = &getFuncProviderEntry(command);
         }
 
-        // Run it
-        FuncResult result;
+        if (entry->binaryProvider) {
+            // Typed FuncProvider: the arguments are decoded by the provider itself
+            if (requestId == 0) {
+                executeBinaryRequest(requestId, *entry, request);
+                return;
+            }
+            auto sharedRequest = std::make_shared<MessageReader>(std::move(request));
+            submitRequest(requestId, [this, requestId, entry, sharedRequest]() {
+                executeBinaryRequest(requestId, *entry, *sharedRequest);
+            });
+            return;
+        }
+
+        args.reserve(entry->argsSpec.length());
+        for (char type : entry->argsSpec) {
+            args.push_back(request.readValue(type));
+        }
+        if (!request.atEnd()) {
+            // The same error as callTypedFromBinary() throws, replied the same way. The frame has
+            // been read whole, so the module can go on
+            std::logic_error error("Wrong number of arguments for " + entry->provider.getCommand());
+            LOG("ModuleWorker: exception caught: " << error.what());
+            std::lock_guard<CountingMutex> lock(mainSendMutex);
+            sendError(module, *conn, requestId, error.what());
+            return;
+        }
+    } else {
+        entry = &getFuncProviderEntry(conn->recvString());
+        args.reserve(entry->argsSpec.length());
+        for (UNUSED char i : entry->argsSpec) {
+            args.push_back(conn->recvString());
+        }
+    }
+
+    if (requestId == 0) {
+        // Plain request: run it right here, in order
+        executeRequest(requestId, *entry, args);
+        return;
+    }
+    submitRequest(requestId, [this, requestId, entry, args]() {
+        executeRequest(requestId, *entry, args);
+    });
+}
+
+void ModuleWorker::submitRequest(uint32_t requestId, std::function<void()> execute)
+{
+    // Pipelined request: the module does not wait for the reply before sending the next
+    // one, so run it concurrently. Replies are matched to requests by their IDs
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        ++pendingRequests;
+    }
+    getRequestPool().submit([this, requestId, execute]() {
+        moduleManager.setCurrentModuleWorker(this);
         try {
-            result = prov(args);
+            execute();
         } catch (const std::exception& e) {
-            LOG("ModuleWorker: exception caught: " << e.what());
-            sendString(sock, "1");
-            sendString(sock, e.what());
-            continue;
+            LOG(L"Module error: failed to reply to request " << requestId << L": "
+                                                             << wstring_cast(e.what()));
         }
+        moduleManager.setCurrentModuleWorker(nullptr);
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        --pendingRequests;
+        pendingCondition.notify_all();
+    });
+}
 
-        sendString(sock, "0");
+void ModuleWorker::executeBinaryRequest(uint32_t requestId,
+                                        const FuncProviderEntry& entry,
+                                        MessageReader& request)
+{
+    auto conn = module.getMainConnection();
 
-        // Send result back
-        ArgsSpec retSpec = getRetSpec(command);
-        for (size_t i = 0; i < retSpec.length(); ++i) {
-            sendString(sock, result.data.at(i));
-        }
-        flushBuffer(sock);
+    MessageWriter reply;
+    reply.writeUint32(requestId);
+    reply.writeByte(0);
+    try {
+        entry.binaryProvider(request, reply);
+    } catch (const std::exception& e) {
+        LOG("ModuleWorker: exception caught: " << e.what());
+        std::lock_guard<CountingMutex> lock(mainSendMutex);
+        sendError(module, *conn, requestId, e.what());
+        return;
     }
 
-    LOG(L"Exiting module worker");
+    std::lock_guard<CountingMutex> lock(mainSendMutex);
+    reply.send(*conn);
+    conn->flush();
+}
+
+void ModuleWorker::executeRequest(uint32_t requestId,
+                                  const FuncProviderEntry& entry,
+                                  const std::vector<std::string>& args)
+{
+    auto conn = module.getMainConnection();
+
+    // Run it
+    FuncResult result;
+    try {
+        result = entry.provider(args);
+    } catch (const std::exception& e) {
+        LOG("ModuleWorker: exception caught: " << e.what());
+        std::lock_guard<CountingMutex> lock(mainSendMutex);
+        sendError(module, *conn, requestId, e.what());
+        return;
+    }
+
+    // Send result back
+    std::lock_guard<CountingMutex> lock(mainSendMutex);
+    sendResult(module, *conn, requestId, entry.retSpec, result.data);
 }
 
 std::vector<std::string> ModuleWorker::runModuleFunc(const std::string& command,
@@ -96,6 +264,9 @@ std::vector<std::string> ModuleWorker::runModuleFunc(const std::string& command,
                                                      const std::string& retTypes,
                                                      const std::vector<std::string> arguments)
 {
+    // The reply may need other requests to be served first (the module can call back into the
+    // engine before replying), so do not hold a pool thread the engine may be short of
+    ThreadPool::BlockingSection blocking;
     try {
         if (argTypes.size() != arguments.size()) {
             LOG("Error at ModuleWorker::runModuleFunc(): arguments.size() != argTypes.size()  @ "
@@ -103,36 +274,156 @@ std::vector<std::string> ModuleWorker::runModuleFunc(const std::string& command,
                 << wstring_cast(argTypes) << ", arguments.size == " << arguments.size());
             throw std::logic_error("arguments.size() != argTypes.size()");
         }
-        std::lock_guard<std::mutex> lock(reverseMutex);
-        int sock = module.getReverseSocket();
+        if (module.getProtocol() == mpBinary) {
+            return runModuleFuncMultiplexed(command, argTypes, retTypes, arguments);
+        }
+
+        std::lock_guard<CountingMutex> lock(reverseMutex);
+        auto conn = module.getReverseConnection();
+
+        std::vector<std::string> result;
+        result.reserve(retTypes.length());
 
-        sendString(sock, command);
+        conn->sendString(command);
         for (size_t i = 0; i < argTypes.length(); ++i) {
-            sendString(sock, arguments.at(i));
+            conn->sendString(arguments.at(i));
         }
-        flushBuffer(sock);
+        conn->flush();
 
-        int exitCode = DyntypeCaster<int>::get(recvString(sock));
+        int exitCode = DyntypeCaster<int>::get(conn->recvString());
         if (exitCode != 0) {
             throw std::runtime_error(std::string("Module function exit code is ")
                                      + std::to_string(exitCode));
         }
 
-        std::vector<std::string> result;
-        result.reserve(retTypes.length());
         for (UNUSED char i : retTypes) {
-            result.push_back(recvString(sock));
+            result.push_back(conn->recvString());
         }
         return result;
     } catch (const std::exception& e) {
         LOG("Exception happened at ModuleWorker::runModuleFunc(): " << wstring_cast(e.what()));
-        close(module.getMainSocket());
-        close(module.getReverseSocket());
+        // Do not close the connections here: the worker thread may still be reading from the
+        // main one. Shutting them down makes it fail and clean up the module itself
+        module.getMainConnection()->shutdown();
+        module.getReverseConnection()->shutdown();
         logStackTrace();
         std::rethrow_exception(std::current_exception());
     }
 }
 
+std::vector<std::string> ModuleWorker::runModuleFuncMultiplexed(
+        const std::string& command,
+        const std::string& argTypes,
+        const std::string& retTypes,
+        const std::vector<std::string>& arguments)
+{
+    ReverseCall call;
+    call.retTypes = retTypes;
+    uint32_t callId;
+    {
+        std::lock_guard<std::mutex> lock(reverseCallsMutex);
+        if (reverseBroken) {
+            throw std::runtime_error("Reverse connection is broken: " + reverseError);
+        }
+        callId = nextReverseCallId;
+        // 0 is never used, so that a zeroed frame cannot be taken for a reply
+        nextReverseCallId = callId == UINT32_MAX ? 1 : callId + 1;
+        reverseCalls[callId] = &call;
+    }
+
+    try {
+        MessageWriter request;
+        request.writeUint32(callId);
+        request.writeString(command);
+        for (size_t i = 0; i < argTypes.length(); ++i) {
+            request.writeValue(argTypes[i], arguments.at(i));
+        }
+        std::lock_guard<CountingMutex> lock(reverseMutex);
+        auto conn = module.getReverseConnection();
+        request.send(*conn);
+        conn->flush();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(reverseCallsMutex);
+        reverseCalls.erase(callId);
+        throw;
+    }
+
+    // There is no reader thread: one of the waiting callers reads the replies and hands them
+    // out until its own one arrives, then another waiting caller takes over
+    std::unique_lock<std::mutex> lock(reverseCallsMutex);
+    while (!call.done) {
+        if (reverseReading) {
+            reverseCallsCondition.wait(lock);
+            continue;
+        }
+        reverseReading = true;
+        lock.unlock();
+        try {
+            readReverseReply();
+        } catch (const std::exception& e) {
+            failReverseCalls(e.what());
+        }
+        lock.lock();
+        reverseReading = false;
+        reverseCallsCondition.notify_all();
+    }
+    if (call.failed) {
+        throw std::runtime_error(call.error);
+    }
+    return std::move(call.result);
+}
+
+void ModuleWorker::readReverseReply()
+{
+    MessageReader reply(*module.getReverseConnection());
+    uint32_t callId = reply.readUint32();
+
+    std::lock_guard<std::mutex> lock(reverseCallsMutex);
+    auto it = reverseCalls.find(callId);
+    if (it == reverseCalls.end()) {
+        throw std::runtime_error("Reply to unknown reverse call " + std::to_string(callId));
+    }
+    ReverseCall& call = *it->second;
+    reverseCalls.erase(it);
+    // The caller will not look at the call until we release the lock
+    call.done = true;
+    reverseCallsCondition.notify_all();
+
+    try {
+        int exitCode = reply.readByte();
+        if (exitCode != 0) {
+            std::string message = reply.atEnd() ? std::string() : reply.readString();
+            call.failed = true;
+            call.error = std::string("Module function exit code is ") + std::to_string(exitCode)
+                         + ": " + message;
+            return;
+        }
+        call.result.reserve(call.retTypes.length());
+        for (char type : call.retTypes) {
+            call.result.push_back(reply.readValue(type));
+        }
+    } catch (const std::exception& e) {
+        call.failed = true;
+        call.error = e.what();
+        throw;
+    }
+}
+
+void ModuleWorker::failReverseCalls(const std::string& error)
+{
+    // Fail every call still waiting, and every call made from now on
+    std::lock_guard<std::mutex> lock(reverseCallsMutex);
+    reverseBroken = true;
+    reverseError = error;
+    for (auto& [callId, call] : reverseCalls) {
+        call->failed = true;
+        call->error = "Reverse connection is broken: " + reverseError;
+        call->done = true;
+    }
+    reverseCalls.clear();
+    reverseCallsCondition.notify_all();
+}
+
 std::function<FuncResult(const std::vector<std::string>&)> ModuleWorker::registerModuleFuncProvider(
         const std::string& name,
         std::string argTypes,
@@ -0,0 +1,77 @@
+#include <string>
+
+#include <modbox/net/connection.hpp>
+#include <modbox/net/socketlib.hpp>
+
+#include <sys/socket.h>
+
+void Connection::sendString(const std::string& s)
+{
+    // std::string keeps a NUL after its last character, we send it as the terminator
+    send(s.c_str(), s.length() + 1);
+}
+
+void Connection::sendFixed(const std::string& s)
+{
+    send(s.data(), s.length());
+}
+
+SocketConnection::SocketConnection(int _sock) : sock(_sock)
+{
+}
+
+void SocketConnection::send(const void* data, size_t length)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    if (length < SOCKET_DIRECT_SEND_SIZE) {
+        sendBuffer.insert(sendBuffer.end(), bytes, bytes + length);
+        return;
+    }
+    iovec iov[2];
+    iov[0].iov_base = sendBuffer.data();
+    iov[0].iov_len = sendBuffer.size();
+    iov[1].iov_base = const_cast<uint8_t*>(bytes);
+    iov[1].iov_len = length;
+    sendBufs(sock, stats, iov, 2);
+    sendBuffer.clear();
+}
+
+void SocketConnection::flush()
+{
+    if (sendBuffer.empty()) {
+        return;
+    }
+    // clear() keeps the capacity, so a busy connection stops allocating after a while
+    sendBuf(sock, stats, sendBuffer.data(), sendBuffer.size());
+    sendBuffer.clear();
+}
+
+void SocketConnection::recv(void* data, size_t length)
+{
+    recvBuf(sock, readBuffer, stats, data, length);
+}
+
+std::string SocketConnection::recvString()
+{
+    return ::recvString(sock, readBuffer, stats);
+}
+
+bool SocketConnection::hasIncomingData()
+{
+    return ::hasIncomingData(sock, readBuffer);
+}
+
+void SocketConnection::shutdown() noexcept
+{
+    ::shutdown(sock, SHUT_RDWR);
+}
+
+void SocketConnection::close() noexcept
+{
+    closeSocket(sock, stats);
+}
+
+int SocketConnection::getSocket() const
+{
+    return sock;
+}
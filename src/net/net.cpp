@@ -1,22 +1,32 @@
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <mutex>
 #include <stdexcept>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <modbox/core/memory_manager.hpp>
+#include <modbox/core/options.hpp>
 #include <modbox/log/log.hpp>
 #include <modbox/misc/die.hpp>
 #include <modbox/modules/module.hpp>
 #include <modbox/modules/module_io.hpp>
 #include <modbox/modules/module_manager.hpp>
+#include <modbox/modules/module_reactor.hpp>
+#include <modbox/net/connection.hpp>
 #include <modbox/net/net.hpp>
 #include <modbox/net/socketlib.hpp>
 #include <modbox/util/util.hpp>
 
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -66,8 +76,38 @@ void joinModuleListenerThread()
     LOG(L"All them are dead");
 }
 
+// Number of threads serving socket-connected modules, 0 means a thread per module
+static size_t getModuleWorkerCount()
+{
+    auto workers = getOption("module-workers");
+    if (workers.has_value()) {
+        return std::stoul(*workers);
+    }
+    return std::max(2u, std::thread::hardware_concurrency());
+}
+
+static ModuleReactor* getModuleReactor()
+{
+    // Never destroyed: its threads live as long as the process, like the listener thread
+    static ModuleReactor* reactor
+            = getModuleWorkerCount() > 0 ? new ModuleReactor(getModuleWorkerCount()) : nullptr;
+    return reactor;
+}
+
 void createModuleServerThread(Module&& module)
 {
+    // Shared memory connections have nothing to wait on with epoll, they keep their own threads
+    ModuleReactor* reactor = getModuleReactor();
+    if (reactor != nullptr
+        && std::dynamic_pointer_cast<SocketConnection>(module.getMainConnection()) != nullptr) {
+        try {
+            reactor->addModule(std::move(module));
+        } catch (const std::exception& e) {
+            LOG(L"Unable to serve module: " << wstring_cast(e.what()));
+        }
+        return;
+    }
+
     std::lock_guard<std::mutex> lock(serverThreadMutex);
     std::thread* thr = new std::thread(moduleServerThreadFunc, module);
     if (thr == nullptr) {
@@ -122,22 +162,90 @@ int createListeningSocket(uint64_t port)
         throw std::runtime_error(strerror(errno));
     }
 
-    listen(listenSocket, 1);
+    listen(listenSocket, SOMAXCONN);
     LOG(L"Listening on 0.0.0.0:" << port);
     return listenSocket;
 }
 
+// Returns -1 if there are no more connections to accept right now
 int acceptSocket(int listenSocket)
 {
-    int clientSocket = accept(listenSocket, nullptr, nullptr);
-    LOG(L"Client connected");
+    // Non-blocking until the handshake is over. Modules we spawn must not inherit the socket
+    int clientSocket = accept4(listenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (clientSocket < 0) {
-        LOG(L"Unable to accept the connection from the client: accept() returned " << clientSocket);
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR) {
+            return -1;
+        }
+        LOG(L"Unable to accept the connection from the client: " << wstring_cast(strerror(errno)));
         throw std::runtime_error("accept() failed");
     }
+    LOG(L"Client connected");
+    // Requests and replies are small, do not let Nagle's algorithm hold them back
+    int enable = 1;
+    if (setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int))) {
+        LOG("WARNING: setsockopt(TCP_NODELAY) failed");
+    }
     return clientSocket;
 }
 
+// A module has that long to introduce itself on both ports
+static const auto HANDSHAKE_TIMEOUT = std::chrono::seconds(10);
+
+// Header and module name, including the terminating NUL
+static const size_t MAX_HANDSHAKE_SIZE = 8 + 4096;
+
+/// A connection which has not introduced itself yet
+struct PendingHandshake
+{
+    std::shared_ptr<SocketConnection> connection;
+    bool reverse;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+/// A module which has completed the handshake on one of the ports only
+struct HalfConnectedModule
+{
+    std::shared_ptr<SocketConnection> connection;
+    ModuleProtocol protocol;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+static void setBlocking(int sock, bool blocking)
+{
+    int flags = fcntl(sock, F_GETFL);
+    if (flags < 0
+        || fcntl(sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) < 0) {
+        throw std::runtime_error(std::string("fcntl() failed: ") + strerror(errno));
+    }
+}
+
+/**
+ * Checks if the whole handshake (header and name) has arrived, without consuming it
+ *
+ * Only then is it read with the usual blocking functions, so that a slow module never
+ * blocks the listener. Whatever the module sends after the handshake stays in the socket
+ */
+static bool isHandshakeComplete(int sock)
+{
+    char buf[MAX_HANDSHAKE_SIZE];
+    ssize_t length = recv(sock, buf, sizeof(buf), MSG_PEEK);
+    if (length == 0) {
+        throw std::runtime_error("Connection closed during the handshake");
+    } else if (length < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return false;
+        }
+        throw std::runtime_error(std::string("recv() failed: ") + strerror(errno));
+    }
+    if (length > 8 && memchr(buf + 8, 0, length - 8) != nullptr) {
+        return true;
+    }
+    if (static_cast<size_t>(length) == sizeof(buf)) {
+        throw std::runtime_error("Module name is too long");
+    }
+    return false;
+}
+
 static void moduleListenerThreadFunc()
 {
     //    LOG(moduleListenerThread->native_handle());
@@ -147,70 +255,184 @@ static void moduleListenerThreadFunc()
     try {
         const uint16_t mainPort = 44145;    // int('MODBOX', 36) % 65536
         const uint16_t reversePort = 54144; // reversed("44145")
-        int mainListeningSocket = createListeningSocket(mainPort);
-        int reverseListeningSocket = createListeningSocket(reversePort);
-
-        // Модули, которые уже подключились к первому сокету, но ещё не подключились ко второму
-        // Ключ - имя модуля, значение - сокет
-        std::unordered_map<std::string, int> pendingModules;
-
-        while (true) {
-            // TODO: переписать с асинхронным IO или потоками
-
-            // Ждём, пока кто-то постучится в основной порт
-            int mainClientSocket = acceptSocket(mainListeningSocket);
-            // Читаем служебную информацию, в том числе имя модуля
-            sendFixed(mainClientSocket, std::string("ModBox/M"));
-            flushBuffer(mainClientSocket);
-            readModuleHeader(mainClientSocket);
-            std::string moduleName = recvString(mainClientSocket);
-
-            // Запоминаем, что он подключился к основному порту
-            pendingModules.insert({moduleName, mainClientSocket});
-
-            // Ждём, пока кто-то постучится в обратный порт
-            int reverseClientSocket = acceptSocket(reverseListeningSocket);
-            // Читаем служебную информацию, в том числе имя модуля
-            sendFixed(reverseClientSocket, std::string("ModBox/R"));
-            flushBuffer(reverseClientSocket);
-            readReverseModuleHeader(reverseClientSocket);
-            std::string reverseModuleName = recvString(reverseClientSocket);
-            // Смотрим, подключился ли он к основному порту
-            if (pendingModules.count(reverseModuleName) == 0) {
-                // Если нет, то что-то тут не так. Надо придумать защиту от дурака,
-                // Но с синхронным IO в один поток это сложно. Поэтому просто вываливаемся
-
-                // TODO: написать RAII-обёртку над сокетаими
-                // Либо использовать готовую библиотеку
-                close(mainClientSocket);
-                close(reverseClientSocket);
+        int mainListeningSocket = -1;
+        int reverseListeningSocket = -1;
+        try {
+            mainListeningSocket = createListeningSocket(mainPort);
+            reverseListeningSocket = createListeningSocket(reversePort);
+        } catch (const std::runtime_error& e) {
+            // Spawned modules talk to us over socketpairs, so we can live without the listener
+            // (e.g. when another engine on this host has already taken the ports)
+            if (getOption("module-transport", "unix") == "tcp") {
+                throw;
+            }
+            LOG(L"WARNING: TCP module listener disabled: " << wstring_cast(e.what()));
+            if (mainListeningSocket >= 0) {
                 close(mainListeningSocket);
-                close(reverseListeningSocket);
-                throw std::runtime_error("Module connected to reverse port but not to main");
             }
+            return;
+        }
 
-            // Удаляем его из списка pending
-            int mainModuleSocket = pendingModules.at(reverseModuleName);
-            int reverseModuleSocket = reverseClientSocket;
-            pendingModules.erase(reverseModuleName);
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            throw std::runtime_error(std::string("epoll_create1() failed: ") + strerror(errno));
+        }
+        auto watch = [epollFd](int sock, uint32_t events) {
+            epoll_event event;
+            event.events = events;
+            event.data.fd = sock;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &event) < 0) {
+                throw std::runtime_error(std::string("epoll_ctl() failed: ") + strerror(errno));
+            }
+        };
+        setBlocking(mainListeningSocket, false);
+        setBlocking(reverseListeningSocket, false);
+        watch(mainListeningSocket, EPOLLIN);
+        watch(reverseListeningSocket, EPOLLIN);
+
+        // Connections that are still introducing themselves, by socket
+        std::unordered_map<int, PendingHandshake> handshakes;
+
+        // Modules connected to one of the ports only, by name
+        std::unordered_map<std::string, HalfConnectedModule> mainHalves;
+        std::unordered_map<std::string, HalfConnectedModule> reverseHalves;
+
+        auto dropHandshake = [&](int sock) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, sock, nullptr);
+            handshakes.at(sock).connection->close();
+            handshakes.erase(sock);
+        };
+
+        auto acceptAll = [&](int listeningSocket, bool reverse) {
+            int sock;
+            while ((sock = acceptSocket(listeningSocket)) >= 0) {
+                auto connection = std::make_shared<SocketConnection>(sock);
+                try {
+                    // A few bytes into a fresh socket, this is not going to block
+                    connection->sendFixed(reverse ? "ModBox/R" : "ModBox/M");
+                    connection->flush();
+                    // Edge-triggered: we only peek at the data, so it stays readable
+                    watch(sock, EPOLLIN | EPOLLRDHUP | EPOLLET);
+                } catch (const std::exception& e) {
+                    LOG(L"Module handshake failed: " << wstring_cast(e.what()));
+                    connection->close();
+                    continue;
+                }
+                handshakes.insert({sock, {connection, reverse,
+                                          std::chrono::steady_clock::now() + HANDSHAKE_TIMEOUT}});
+            }
+        };
+
+        auto finishHandshake = [&](int sock) {
+            PendingHandshake handshake = handshakes.at(sock);
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, sock, nullptr);
+            handshakes.erase(sock);
+
+            ModuleProtocol protocol;
+            std::string moduleName;
+            try {
+                auto& connection = *handshake.connection;
+                setBlocking(sock, true);
+                protocol = handshake.reverse ? readReverseModuleHeader(connection)
+                                             : readModuleHeader(connection);
+                moduleName = readModuleName(connection);
+            } catch (...) {
+                handshake.connection->close();
+                throw;
+            }
+            HalfConnectedModule current{handshake.connection, protocol,
+                                        std::chrono::steady_clock::now() + HANDSHAKE_TIMEOUT};
+
+            auto& halves = handshake.reverse ? reverseHalves : mainHalves;
+            auto& otherHalves = handshake.reverse ? mainHalves : reverseHalves;
+            auto other = otherHalves.find(moduleName);
+            if (other == otherHalves.end()) {
+                auto previous = halves.find(moduleName);
+                if (previous != halves.end()) {
+                    LOG(L"Module '" << wstring_cast(moduleName)
+                                    << L"' connected twice, dropping the older connection");
+                    previous->second.connection->close();
+                    halves.erase(previous);
+                }
+                halves.insert({moduleName, current});
+                return;
+            }
 
-            // Получаем список зависимостей
+            HalfConnectedModule main = handshake.reverse ? other->second : current;
+            HalfConnectedModule reverse = handshake.reverse ? current : other->second;
+            otherHalves.erase(other);
+
+            // Both connections must speak the same version of the protocol
+            if (main.protocol != reverse.protocol) {
+                LOG(L"Module '" << wstring_cast(moduleName)
+                                << L"' uses different protocols on its main and reverse sockets");
+                main.connection->close();
+                reverse.connection->close();
+                return;
+            }
 
-            // И запускаем moduleWorker
             LOG(L"Spawning client thread");
-
             // TODO: dependencies
             createModuleServerThread(
-                    Module(mainModuleSocket, reverseModuleSocket, reverseModuleName, {}));
-
-            // COMBAK: old code
-            // dependencies.reserve(dependenciesCount);
-            // for (uint64_t i = 0; i < dependenciesCount; ++i) {
-            //     dependencies.emplace_back(recvString(mainModuleSocket));
-            // }
-            // createModuleServerThread(
-            //         Module(mainModuleSocket, reverseModuleSocket, reverseModuleName,
-            //         dependencies));
+                    Module(main.connection, reverse.connection, moduleName, {}, main.protocol));
+        };
+
+        auto dropExpired = [&]() {
+            auto now = std::chrono::steady_clock::now();
+            std::vector<int> expired;
+            for (const auto& [sock, handshake] : handshakes) {
+                if (handshake.deadline < now) {
+                    expired.push_back(sock);
+                }
+            }
+            for (int sock : expired) {
+                LOG(L"Module handshake timed out");
+                dropHandshake(sock);
+            }
+            for (auto* halves : {&mainHalves, &reverseHalves}) {
+                for (auto it = halves->begin(); it != halves->end();) {
+                    if (it->second.deadline < now) {
+                        LOG(L"Module '" << wstring_cast(it->first)
+                                        << L"' has not connected to the other port in time");
+                        it->second.connection->close();
+                        it = halves->erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+        };
+
+        const int MAX_EVENTS = 64;
+        epoll_event events[MAX_EVENTS];
+        while (true) {
+            int eventCount = epoll_wait(epollFd, events, MAX_EVENTS, 1000);
+            if (eventCount < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("epoll_wait() failed: ") + strerror(errno));
+            }
+            for (int i = 0; i < eventCount; ++i) {
+                int sock = events[i].data.fd;
+                if (sock == mainListeningSocket || sock == reverseListeningSocket) {
+                    acceptAll(sock, sock == reverseListeningSocket);
+                    continue;
+                }
+                try {
+                    if (isHandshakeComplete(sock)) {
+                        finishHandshake(sock);
+                    } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                        throw std::runtime_error("Connection closed during the handshake");
+                    }
+                } catch (const std::exception& e) {
+                    LOG(L"Module handshake failed: " << wstring_cast(e.what()));
+                    if (handshakes.count(sock) > 0) {
+                        dropHandshake(sock);
+                    }
+                }
+            }
+            dropExpired();
         }
     } catch (std::exception& e) {
         LOG(L"FATAL error (at " __FILE__ "): " << wstring_cast(e.what()));
@@ -230,7 +452,36 @@ static void moduleServerThreadFunc(Module&& module)
         LOG(L"module error: ModuleWorker threw something which we don't care about");
     }
     */
-    moduleManager.registerModuleWorker(worker);
     worker.please_work();
     module.cleanup();
 }
+
+void connectSpawnedModule(const std::string& expectedName,
+                          std::shared_ptr<Connection> mainConnection,
+                          std::shared_ptr<Connection> reverseConnection)
+{
+    // The module does not wait for our headers here, it just sends its own ones
+    try {
+        ModuleProtocol protocol = readModuleHeader(*mainConnection);
+        std::string moduleName = readModuleName(*mainConnection);
+        ModuleProtocol reverseProtocol = readReverseModuleHeader(*reverseConnection);
+        std::string reverseModuleName = readModuleName(*reverseConnection);
+
+        if (moduleName != expectedName || reverseModuleName != expectedName) {
+            throw std::runtime_error("Module '" + expectedName + "' introduced itself as '"
+                                     + moduleName + "' / '" + reverseModuleName + "'");
+        }
+        if (reverseProtocol != protocol) {
+            throw std::runtime_error("Module '" + expectedName + "' uses different protocols "
+                                     + "on its main and reverse sockets");
+        }
+
+        LOG(L"Spawning client thread");
+        createModuleServerThread(
+                Module(mainConnection, reverseConnection, moduleName, {}, protocol));
+    } catch (...) {
+        mainConnection->close();
+        reverseConnection->close();
+        throw;
+    }
+}
@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <modbox/log/log.hpp>
+#include <modbox/net/shm_connection.hpp>
+
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char SHM_MAGIC[8] = {'M', 'o', 'd', 'B', 's', 'h', 'm', '1'};
+static const size_t SHM_HEADER_SIZE = 256;
+
+// How many times we check the ring before going to sleep. Spinning only makes sense when
+// the other side can run at the same time
+static const int SPIN_ITERATIONS = std::thread::hardware_concurrency() > 1 ? 2000 : 0;
+
+// A sleeping side wakes up that often to check if the peer is still alive
+static const long WAIT_TIMEOUT_NS = 10 * 1000 * 1000;
+
+struct ShmSegmentHeader
+{
+    char magic[8];
+    uint32_t ringCapacity;
+    std::atomic<uint32_t> shutDown;
+};
+
+static_assert(sizeof(ShmRingHeader) == 256, "ShmRingHeader layout is shared with pymodbox");
+static_assert(sizeof(ShmSegmentHeader) <= SHM_HEADER_SIZE, "ShmSegmentHeader is too large");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared atomics must be lock-free");
+
+static size_t ringStride(size_t ringCapacity)
+{
+    return sizeof(ShmRingHeader) + ringCapacity;
+}
+
+static void futexWait(std::atomic<uint32_t>& word, uint32_t expected)
+{
+    timespec timeout{0, WAIT_TIMEOUT_NS};
+    // Not FUTEX_PRIVATE: the word is shared with another process
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr,
+            0);
+}
+
+static void futexWake(std::atomic<uint32_t>& word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+}
+
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static bool isProcessAlive(pid_t pid)
+{
+    siginfo_t info;
+    info.si_pid = 0;
+    // WNOWAIT leaves the zombie alone, whoever reaps children will still find it
+    if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0) {
+        return info.si_pid == 0;
+    }
+    // Not our child (e.g. we are the module and `pid` is the engine)
+    return kill(pid, 0) == 0;
+}
+
+ShmSegment::ShmSegment(int _fd, size_t _size, uint8_t* _memory)
+        : fd(_fd), size(_size), memory(_memory)
+{
+}
+
+std::shared_ptr<ShmSegment> ShmSegment::create(size_t ringCapacity)
+{
+    if (ringCapacity == 0 || (ringCapacity & (ringCapacity - 1)) != 0) {
+        throw std::logic_error("Ring capacity must be a power of two");
+    }
+    int fd = memfd_create("modbox-module", MFD_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("memfd_create() failed: ") + strerror(errno));
+    }
+    size_t size = SHM_HEADER_SIZE + SHM_RING_COUNT * ringStride(ringCapacity);
+    if (ftruncate(fd, size) < 0) {
+        ::close(fd);
+        throw std::runtime_error(std::string("ftruncate() failed: ") + strerror(errno));
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error(std::string("mmap() failed: ") + strerror(errno));
+    }
+
+    // ftruncate() fills the file with zeros, which is a valid initial state of the rings
+    auto header = static_cast<ShmSegmentHeader*>(memory);
+    memcpy(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    header->ringCapacity = ringCapacity;
+
+    return std::shared_ptr<ShmSegment>(new ShmSegment(fd, size, static_cast<uint8_t*>(memory)));
+}
+
+std::shared_ptr<ShmSegment> ShmSegment::open(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        throw std::runtime_error(std::string("fstat() failed: ") + strerror(errno));
+    }
+    size_t size = st.st_size;
+    if (size < SHM_HEADER_SIZE) {
+        throw std::runtime_error("Shared memory segment is too small");
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        throw std::runtime_error(std::string("mmap() failed: ") + strerror(errno));
+    }
+    auto header = static_cast<ShmSegmentHeader*>(memory);
+    size_t ringCapacity = header->ringCapacity;
+    if (memcmp(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0
+        || size != SHM_HEADER_SIZE + SHM_RING_COUNT * ringStride(ringCapacity)) {
+        munmap(memory, size);
+        throw std::runtime_error("Invalid shared memory segment");
+    }
+    return std::shared_ptr<ShmSegment>(new ShmSegment(fd, size, static_cast<uint8_t*>(memory)));
+}
+
+ShmSegment::~ShmSegment()
+{
+    munmap(memory, size);
+    ::close(fd);
+}
+
+int ShmSegment::getFd() const
+{
+    return fd;
+}
+
+size_t ShmSegment::getRingCapacity() const
+{
+    return reinterpret_cast<const ShmSegmentHeader*>(memory)->ringCapacity;
+}
+
+ShmRingHeader& ShmSegment::getRing(size_t index)
+{
+    if (index >= SHM_RING_COUNT) {
+        throw std::logic_error("No such ring: " + std::to_string(index));
+    }
+    return *reinterpret_cast<ShmRingHeader*>(memory + SHM_HEADER_SIZE
+                                             + index * ringStride(getRingCapacity()));
+}
+
+uint8_t* ShmSegment::getRingData(size_t index)
+{
+    return reinterpret_cast<uint8_t*>(&getRing(index)) + sizeof(ShmRingHeader);
+}
+
+void ShmSegment::shutdown() noexcept
+{
+    reinterpret_cast<ShmSegmentHeader*>(memory)->shutDown.store(1);
+    for (size_t i = 0; i < SHM_RING_COUNT; ++i) {
+        ShmRingHeader& ring = getRing(i);
+        ring.dataWaiting.store(0);
+        futexWake(ring.dataWaiting);
+        ring.spaceWaiting.store(0);
+        futexWake(ring.spaceWaiting);
+    }
+}
+
+bool ShmSegment::isShutDown() const
+{
+    return reinterpret_cast<const ShmSegmentHeader*>(memory)->shutDown.load() != 0;
+}
+
+ShmConnection::ShmConnection(std::shared_ptr<ShmSegment> _segment,
+                             size_t inRing,
+                             size_t outRing,
+                             pid_t _peer)
+        : segment(_segment)
+        , in(_segment->getRing(inRing))
+        , inData(_segment->getRingData(inRing))
+        , out(_segment->getRing(outRing))
+        , outData(_segment->getRingData(outRing))
+        , mask(_segment->getRingCapacity() - 1)
+        , peer(_peer)
+{
+}
+
+void ShmConnection::checkAlive(bool checkPeer) const
+{
+    if (segment->isShutDown()) {
+        throw std::runtime_error("Shared memory connection is shut down");
+    }
+    if (checkPeer && !isProcessAlive(peer)) {
+        throw std::runtime_error("Peer process " + std::to_string(peer) + " has exited");
+    }
+}
+
+void ShmConnection::waitForData()
+{
+    uint64_t tail = in.tail.load(std::memory_order_relaxed);
+    for (int i = 0; i < SPIN_ITERATIONS; ++i) {
+        if (in.head.load(std::memory_order_acquire) != tail) {
+            return;
+        }
+        cpuRelax();
+    }
+    // Looking for the peer process costs a syscall, so we only do it after sleeping in vain
+    bool slept = false;
+    while (in.head.load(std::memory_order_acquire) == tail) {
+        checkAlive(slept);
+        // Raise the flag first and check again, so that the writer either sees the flag or
+        // we see its data
+        in.dataWaiting.store(1);
+        if (in.head.load() != tail) {
+            break;
+        }
+        ++futexWaits;
+        futexWait(in.dataWaiting, 1);
+        slept = true;
+    }
+}
+
+void ShmConnection::waitForSpace()
+{
+    uint64_t head = out.head.load(std::memory_order_relaxed);
+    auto full = [&]() { return head - out.tail.load(std::memory_order_acquire) > mask; };
+    for (int i = 0; i < SPIN_ITERATIONS; ++i) {
+        if (!full()) {
+            return;
+        }
+        cpuRelax();
+    }
+    bool slept = false;
+    while (full()) {
+        checkAlive(slept);
+        out.spaceWaiting.store(1);
+        if (!full()) {
+            break;
+        }
+        ++futexWaits;
+        futexWait(out.spaceWaiting, 1);
+        slept = true;
+    }
+}
+
+void ShmConnection::consume(uint64_t newTail)
+{
+    in.tail.store(newTail, std::memory_order_release);
+    if (in.spaceWaiting.exchange(0) != 0) {
+        ++futexWakes;
+        futexWake(in.spaceWaiting);
+    }
+}
+
+void ShmConnection::send(const void* data, size_t length)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    sendBuffer.insert(sendBuffer.end(), bytes, bytes + length);
+}
+
+void ShmConnection::flush()
+{
+    size_t sent = 0;
+    while (sent < sendBuffer.size()) {
+        waitForSpace();
+        uint64_t head = out.head.load(std::memory_order_relaxed);
+        uint64_t tail = out.tail.load(std::memory_order_acquire);
+        size_t offset = head & mask;
+        size_t chunk = std::min({sendBuffer.size() - sent,
+                                 static_cast<size_t>(mask + 1 - (head - tail)),
+                                 static_cast<size_t>(mask + 1 - offset)});
+        memcpy(outData + offset, sendBuffer.data() + sent, chunk);
+        out.head.store(head + chunk, std::memory_order_release);
+        sent += chunk;
+        bytesSent += chunk;
+
+        if (out.dataWaiting.exchange(0) != 0) {
+            ++futexWakes;
+            futexWake(out.dataWaiting);
+        }
+    }
+    sendBuffer.clear();
+}
+
+void ShmConnection::recv(void* data, size_t length)
+{
+    auto bytes = static_cast<uint8_t*>(data);
+    size_t received = 0;
+    while (received < length) {
+        waitForData();
+        uint64_t tail = in.tail.load(std::memory_order_relaxed);
+        uint64_t head = in.head.load(std::memory_order_acquire);
+        size_t offset = tail & mask;
+        size_t chunk = std::min(
+                {length - received, static_cast<size_t>(head - tail), mask + 1 - offset});
+        memcpy(bytes + received, inData + offset, chunk);
+        received += chunk;
+        bytesReceived += chunk;
+        consume(tail + chunk);
+    }
+}
+
+std::string ShmConnection::recvString()
+{
+    std::string s;
+    while (true) {
+        waitForData();
+        uint64_t tail = in.tail.load(std::memory_order_relaxed);
+        uint64_t head = in.head.load(std::memory_order_acquire);
+        while (tail != head) {
+            size_t offset = tail & mask;
+            size_t chunk = std::min(static_cast<size_t>(head - tail), mask + 1 - offset);
+            auto begin = reinterpret_cast<const char*>(inData + offset);
+            auto terminator = static_cast<const char*>(memchr(begin, 0, chunk));
+            if (terminator != nullptr) {
+                s.append(begin, terminator);
+                bytesReceived += terminator - begin + 1;
+                consume(tail + (terminator - begin) + 1);
+                return s;
+            }
+            s.append(begin, chunk);
+            bytesReceived += chunk;
+            tail += chunk;
+        }
+        consume(tail);
+    }
+}
+
+bool ShmConnection::hasIncomingData()
+{
+    return in.head.load(std::memory_order_acquire) != in.tail.load(std::memory_order_relaxed)
+           || segment->isShutDown();
+}
+
+void ShmConnection::shutdown() noexcept
+{
+    segment->shutdown();
+}
+
+void ShmConnection::close() noexcept
+{
+    LOG("Closing shared memory connection: " << bytesReceived << " bytes received, "
+                                             << bytesSent << " bytes sent, " << futexWaits
+                                             << " futex waits, " << futexWakes
+                                             << " futex wakes");
+    // The memory stays mapped until the last connection using it is destroyed
+    segment->shutdown();
+}
@@ -1,114 +1,167 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
 #include <cstring>
 #include <exception>
 #include <string>
-#include <unordered_map>
 
 #include <modbox/log/log.hpp>
 #include <modbox/net/socketlib.hpp>
 #include <modbox/util/util.hpp>
 
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-std::recursive_mutex netMutex;
-std::unordered_map<int, std::vector<uint8_t>> buffers;
+// Size of the chunk requested from the kernel by a single recv() call
+static const size_t READ_CHUNK_SIZE = 64 * 1024;
 
-void putBuffer(int sock, const std::vector<uint8_t>& data)
+SocketStats AtomicSocketStats::get() const
 {
-    std::lock_guard<decltype(netMutex)> lock(netMutex);
-    if (buffers.count(sock) == 0) {
-        buffers.insert({sock, data});
-    } else {
-        buffers.at(sock).insert(buffers.at(sock).end(), data.begin(), data.end());
-    }
-}
-
-template <typename Iterator>
-void putBuffer(int sock, const Iterator& begin, const Iterator& end)
-{
-    std::lock_guard<decltype(netMutex)> lock(netMutex);
-    if (buffers.count(sock) == 0) {
-        buffers.insert({sock, {}});
-    }
-    buffers.at(sock).insert(buffers.at(sock).end(), begin, end);
+    return {sendCalls, sendBytes, recvCalls, recvBytes};
 }
 
-void flushBuffer(int sock)
+void sendBuf(int sock, AtomicSocketStats& stats, const void* buf, size_t length)
 {
-    std::lock_guard<decltype(netMutex)> lock(netMutex);
-    if (buffers.count(sock) == 0) {
-        throw std::logic_error(std::string("No such socket: ") + std::to_string(sock));
-    }
-    sendBuf(sock, buffers.at(sock).data(), buffers.at(sock).size());
-    buffers.at(sock).clear();
+    iovec iov;
+    iov.iov_base = const_cast<void*>(buf);
+    iov.iov_len = length;
+    sendBufs(sock, stats, &iov, 1);
 }
 
-void sendBuf(int sock, const void* buf, size_t length)
+void sendBufs(int sock, AtomicSocketStats& stats, iovec* iov, size_t count)
 {
-    size_t sent = 0;
-    while (sent < length) {
-        int remain = length - sent;
-        const void* data = static_cast<const uint8_t*>(buf) + sent;
-        int sent_now = send(sock, data, remain, 0);
+    while (count > 0) {
+        msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = std::min(count, static_cast<size_t>(IOV_MAX));
+        // sendmsg() is writev() with flags: a module may go away at any moment, that must not
+        // kill us with SIGPIPE
+        ssize_t sent_now = sendmsg(sock, &message, MSG_NOSIGNAL);
+        ++stats.sendCalls;
 
         if (sent_now == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             // log("sendBuf: error sending data");
             throw std::runtime_error("sendBuf: error sending data");
         }
-        sent += sent_now;
+        stats.sendBytes += sent_now;
+
+        // Skip what has been sent, the rest goes in the next call
+        size_t sent = sent_now;
+        while (count > 0 && sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
+    }
+}
+
+// Reads at most `length` bytes from the socket. Blocks until at least one byte is available
+static size_t recvSome(int sock, AtomicSocketStats& stats, void* buf, size_t length)
+{
+    ssize_t received_now;
+    while (true) {
+        received_now = recv(sock, buf, length, 0);
+        ++stats.recvCalls;
+        if (received_now != -1 || errno != EINTR) {
+            break;
+        }
+    }
+
+    if (received_now == -1) {
+        // log("recvBuf: error receiving data");
+        throw std::runtime_error("recvBuf: error receiving data");
+    } else if (received_now == 0) {
+        throw std::runtime_error("recvBuf: EOF reached");
+    }
+    stats.recvBytes += received_now;
+    return received_now;
+}
+
+// Makes sure that the read buffer has some unread data in it
+static void fillReadBuffer(int sock, ReadBuffer& rb, AtomicSocketStats& stats)
+{
+    if (rb.begin < rb.end) {
+        return;
+    }
+    if (rb.data.size() < READ_CHUNK_SIZE) {
+        rb.data.resize(READ_CHUNK_SIZE);
     }
+    rb.begin = 0;
+    rb.end = recvSome(sock, stats, rb.data.data(), rb.data.size());
 }
 
-void recvBuf(int sock, void* buf, size_t length)
+void recvBuf(int sock, ReadBuffer& rb, AtomicSocketStats& stats, void* buf, size_t length)
 {
+    auto out = static_cast<uint8_t*>(buf);
     size_t received = 0;
     while (received < length) {
-        int remain = length - received;
-        void* data = static_cast<uint8_t*>(buf) + received;
-        int received_now = recv(sock, data, remain, 0);
-
-        if (received_now == -1) {
-            // log("recvBuf: error receiving data");
-            throw std::runtime_error("recvBuf: error receiving data");
-        } else if (received_now == 0) {
-            throw std::runtime_error("recvBuf: EOF reached");
+        size_t remain = length - received;
+        if (rb.begin == rb.end && remain >= READ_CHUNK_SIZE) {
+            // Large block: no reason to copy it through the buffer
+            received += recvSome(sock, stats, out + received, remain);
+            continue;
         }
-        received += received_now;
+        fillReadBuffer(sock, rb, stats);
+        size_t chunk = std::min(remain, rb.end - rb.begin);
+        memcpy(out + received, rb.data.data() + rb.begin, chunk);
+        rb.begin += chunk;
+        received += chunk;
     }
 }
 
-std::string recvString(int sock)
+std::string recvString(int sock, ReadBuffer& rb, AtomicSocketStats& stats)
 {
     std::string s;
-    char c;
-    // TODO: maybe add buffers
     while (true) {
-        recvBuf(sock, &c, 1);
-        if (c == 0) {
+        fillReadBuffer(sock, rb, stats);
+        auto begin = reinterpret_cast<const char*>(rb.data.data()) + rb.begin;
+        auto end = reinterpret_cast<const char*>(rb.data.data()) + rb.end;
+        auto terminator = static_cast<const char*>(memchr(begin, 0, end - begin));
+        if (terminator != nullptr) {
+            s.append(begin, terminator);
+            rb.begin += terminator - begin + 1;
             break;
         }
-        s += c;
+        s.append(begin, end);
+        rb.begin = rb.end;
     }
     return s;
 }
 
-void sendString(int sock, const std::string& s)
+uint8_t recvByte(int sock, ReadBuffer& rb, AtomicSocketStats& stats)
 {
-    putBuffer(sock, s.begin(), s.end());
-    putBuffer(sock, {0});
-}
-void sendFixed(int sock, const std::string& s)
-{
-    putBuffer(sock, s.begin(), s.end());
+    char byte;
+    recvBuf(sock, rb, stats, &byte, 1);
+    return static_cast<uint8_t>(byte);
 }
 
-inline void sendByte(int sock, uint8_t byte)
+bool hasIncomingData(int sock, const ReadBuffer& rb)
 {
-    putBuffer(sock, {byte});
+    if (rb.begin < rb.end) {
+        return true;
+    }
+    // EOF and errors count too: the next read reports them right away
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) != 0;
 }
 
-uint8_t recvByte(int sock)
+void closeSocket(int sock, const AtomicSocketStats& atomicStats)
 {
-    char byte;
-    recvBuf(sock, &byte, 1);
-    return static_cast<uint8_t>(byte);
+    auto stats = atomicStats.get();
+    LOG("Closing socket " << sock << ": " << stats.recvBytes << " bytes in " << stats.recvCalls
+                          << " recv() calls, " << stats.sendBytes << " bytes in "
+                          << stats.sendCalls << " send() calls");
+    close(sock);
 }
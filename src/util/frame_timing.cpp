@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+
+#include <modbox/util/frame_timing.hpp>
+
+FixedTimestep::FixedTimestep(double rate, size_t _maxSteps) : step(1.0 / rate), maxSteps(_maxSteps)
+{
+    if (!(rate > 0.0) || maxSteps == 0) {
+        throw std::invalid_argument("FixedTimestep: the rate and the step limit must be positive");
+    }
+}
+
+size_t FixedTimestep::advance(double seconds)
+{
+    accumulator += std::max(0.0, seconds);
+    size_t steps = static_cast<size_t>(accumulator / step);
+    if (steps > maxSteps) {
+        steps = maxSteps;
+        accumulator = std::fmod(accumulator, step);
+    } else {
+        accumulator -= steps * step;
+    }
+    return steps;
+}
+
+double FixedTimestep::getStep() const
+{
+    return step;
+}
+
+double FixedTimestep::getAlpha() const
+{
+    return std::min(1.0, accumulator / step);
+}
+
+FramePacer::FramePacer(double rate, Clock::duration _spin)
+        : period(std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(1.0 / rate)))
+        , spin(_spin)
+        , deadline(Clock::now())
+{
+    if (!(rate > 0.0)) {
+        throw std::invalid_argument("FramePacer: the rate must be positive");
+    }
+}
+
+void FramePacer::wait()
+{
+    deadline += period;
+    auto now = Clock::now();
+    if (now >= deadline) {
+        // Late: start counting from now instead of rushing through the frames we have missed
+        if (now - deadline > period) {
+            deadline = now;
+        }
+        return;
+    }
+
+    if (deadline - now > spin) {
+        std::this_thread::sleep_until(deadline - spin);
+    }
+    while (Clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+}
+
+FramePacer::Clock::duration FramePacer::getPeriod() const
+{
+    return period;
+}
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+
+#include <modbox/log/log.hpp>
+#include <modbox/util/thread_pool.hpp>
+
+// The pool whose thread this is, if any
+static thread_local ThreadPool* currentPool = nullptr;
+
+ThreadPool::ThreadPool(size_t _threadCount) : threadCount(_threadCount)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    threads.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i) {
+        spawnThread();
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    std::vector<std::thread> toJoin;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        toJoin = std::move(threads);
+    }
+    condition.notify_all();
+    for (auto& thread : toJoin) {
+        thread.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    condition.notify_one();
+}
+
+size_t ThreadPool::getThreadCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return liveCount;
+}
+
+// Must be called with the mutex locked
+void ThreadPool::spawnThread()
+{
+    for (auto id : exitedThreads) {
+        auto it = std::find_if(threads.begin(), threads.end(), [id](const std::thread& thread) {
+            return thread.get_id() == id;
+        });
+        if (it != threads.end()) {
+            it->join();
+            threads.erase(it);
+        }
+    }
+    exitedThreads.clear();
+    threads.emplace_back(&ThreadPool::threadFunc, this);
+    ++liveCount;
+}
+
+void ThreadPool::beginBlocking()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ++blockedCount;
+    if (!stopping && liveCount - blockedCount < threadCount) {
+        spawnThread();
+        if (liveCount == threadCount * 2 + 1) {
+            LOG("ThreadPool: " << blockedCount << " threads are blocked, the pool has grown to "
+                               << liveCount << " threads");
+        }
+    }
+}
+
+void ThreadPool::endBlocking()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --blockedCount;
+    }
+    // Surplus threads may exit now
+    condition.notify_all();
+}
+
+ThreadPool::BlockingSection::BlockingSection() : pool(currentPool)
+{
+    if (pool != nullptr) {
+        // Nested sections are the same blocked thread
+        currentPool = nullptr;
+        pool->beginBlocking();
+    }
+}
+
+ThreadPool::BlockingSection::~BlockingSection()
+{
+    if (pool != nullptr) {
+        pool->endBlocking();
+        currentPool = pool;
+    }
+}
+
+void ThreadPool::threadFunc()
+{
+    currentPool = this;
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto hasWork = [this]() { return stopping || !tasks.empty(); };
+            while (!hasWork()) {
+                if (liveCount - blockedCount <= threadCount) {
+                    condition.wait(lock);
+                    continue;
+                }
+                // An extra thread, and the blocked ones are not all blocked any more
+                if (!condition.wait_for(lock,
+                                        std::chrono::milliseconds(SURPLUS_IDLE_MS),
+                                        hasWork)
+                    && liveCount - blockedCount > threadCount) {
+                    --liveCount;
+                    exitedThreads.push_back(std::this_thread::get_id());
+                    return;
+                }
+            }
+            if (tasks.empty()) {
+                --liveCount;
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        try {
+            task();
+        } catch (const std::exception& e) {
+            LOG("ThreadPool: task threw exception: " << e.what());
+        } catch (...) {
+            LOG("ThreadPool: task threw something we don't care about");
+        }
+    }
+}
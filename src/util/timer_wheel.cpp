@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <limits>
+
+#include <modbox/util/timer_wheel.hpp>
+
+TimerWheel::TimerWheel(uint64_t _currentTick) : currentTick(_currentTick)
+{
+}
+
+uint64_t TimerWheel::schedule(uint64_t expiry, uint64_t payload)
+{
+    if (expiry <= currentTick) {
+        expiry = currentTick + 1;
+    }
+    uint64_t timer = timers.insert(Timer{expiry, payload});
+    place(timer, expiry);
+    return timer;
+}
+
+bool TimerWheel::cancel(uint64_t timer)
+{
+    if (!timers.contains(timer)) {
+        return false;
+    }
+    timers.remove(timer);
+    return true;
+}
+
+void TimerWheel::place(uint64_t timer, uint64_t expiry)
+{
+    uint64_t delta = expiry - currentTick;
+    for (size_t level = 0; level < LEVELS; ++level) {
+        if (delta < (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+            wheels[level][(expiry >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(timer);
+            return;
+        }
+    }
+    // Too far away: park it in the last slot the top level reaches, it is placed again
+    // from there
+    uint64_t parkAt = currentTick + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+    wheels[LEVELS - 1][(parkAt >> (SLOT_BITS * (LEVELS - 1))) & (SLOTS - 1)].push_back(timer);
+}
+
+void TimerWheel::cascade(size_t level)
+{
+    auto& slot = wheels[level][(currentTick >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    std::vector<uint64_t> moving;
+    moving.swap(slot);
+    for (uint64_t timer : moving) {
+        if (timers.contains(timer)) {
+            place(timer, timers.access(timer).expiry);
+        }
+    }
+}
+
+void TimerWheel::step(std::vector<Expiration>& expired)
+{
+    ++currentTick;
+
+    // Higher levels first: what they cascade may have to cascade further right away
+    size_t cascadeLevels = 0;
+    while (cascadeLevels + 1 < LEVELS
+           && (currentTick & ((uint64_t(1) << (SLOT_BITS * (cascadeLevels + 1))) - 1)) == 0) {
+        ++cascadeLevels;
+    }
+    for (size_t level = cascadeLevels; level > 0; --level) {
+        cascade(level);
+    }
+
+    auto& slot = wheels[0][currentTick & (SLOTS - 1)];
+    std::vector<uint64_t> due;
+    due.swap(slot);
+    for (uint64_t timer : due) {
+        if (!timers.contains(timer)) {
+            continue;
+        }
+        Timer t = timers.access(timer);
+        timers.remove(timer);
+        expired.push_back({timer, t.payload, t.expiry});
+    }
+}
+
+void TimerWheel::advance(uint64_t tick, std::vector<Expiration>& expired)
+{
+    if (timers.empty() && tick > currentTick) {
+        // Nothing can expire, only the stale handles of cancelled timers would be dropped
+        for (auto& wheel : wheels) {
+            for (auto& slot : wheel) {
+                slot.clear();
+            }
+        }
+        currentTick = tick;
+        return;
+    }
+    while (currentTick < tick) {
+        uint64_t next = getNextExpiryBound();
+        if (next > tick) {
+            // No occupied slot comes round before `tick`, so the timers stay where they are
+            currentTick = tick;
+            return;
+        }
+        currentTick = next - 1;
+        step(expired);
+    }
+}
+
+uint64_t TimerWheel::getNextExpiryBound() const
+{
+    if (timers.empty()) {
+        return std::numeric_limits<uint64_t>::max();
+    }
+    uint64_t bound = std::numeric_limits<uint64_t>::max();
+    for (size_t level = 0; level < LEVELS; ++level) {
+        // A slot of this level is processed (expired or cascaded) when the time enters the
+        // span of SLOTS ^ level ticks it covers. The first of the next SLOTS spans is what
+        // the slots of this level can hold
+        size_t shift = SLOT_BITS * level;
+        uint64_t span = currentTick >> shift;
+        for (uint64_t k = 1; k <= SLOTS; ++k) {
+            if (!wheels[level][(span + k) & (SLOTS - 1)].empty()) {
+                bound = std::min(bound, (span + k) << shift);
+                break;
+            }
+        }
+    }
+    return bound;
+}
+
+uint64_t TimerWheel::getCurrentTick() const
+{
+    return currentTick;
+}
+
+size_t TimerWheel::size() const
+{
+    return timers.size();
+}
@@ -12,19 +12,3 @@ irr::scene::ITerrainSceneNode* Chunk::sceneNode() const
 {
     return terrain;
 }
-
-void Chunk::trackMob(EnemyId mobId)
-{
-    mobs.insert(mobId);
-}
-void Chunk::forgetMob(EnemyId mobId)
-{
-    mobs.erase(mobId);
-}
-
-void Chunk::mobsAi()
-{
-    for (EnemyId mobId : mobs) {
-        enemyManager.mutableAccessEnemy(mobId).ai();
-    }
-}
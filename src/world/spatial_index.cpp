@@ -0,0 +1,177 @@
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include <modbox/core/core.hpp>
+#include <modbox/world/spatial_index.hpp>
+
+bool SpatialIndex::Cell::operator==(const Cell& other) const
+{
+    return x == other.x && y == other.y && z == other.z;
+}
+
+size_t SpatialIndex::CellHash::operator()(const Cell& cell) const
+{
+    // Large odd multipliers, so that neighbouring cells do not collide
+    uint64_t hash = static_cast<uint64_t>(cell.x) * 0x9E3779B97F4A7C15ULL;
+    hash ^= static_cast<uint64_t>(cell.y) * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= static_cast<uint64_t>(cell.z) * 0x165667B19E3779F9ULL;
+    return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
+SpatialIndex::SpatialIndex(double _cellSize) : cellSize(_cellSize)
+{
+    if (!(cellSize > 0)) {
+        throw std::runtime_error("Spatial index cell size must be positive");
+    }
+}
+
+SpatialIndex::Cell SpatialIndex::getCell(const GamePosition& position) const
+{
+    return {static_cast<int64_t>(std::floor(position.x / cellSize)),
+            static_cast<int64_t>(std::floor(position.y / cellSize)),
+            static_cast<int64_t>(std::floor(position.z / cellSize))};
+}
+
+void SpatialIndex::update(uint64_t id, const GamePosition& position)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Cell cell = getCell(position);
+    auto location = locations.find(id);
+    if (location != locations.end()) {
+        if (location->second.cell == cell) {
+            cells.at(cell)[location->second.slot].position = position;
+            return;
+        }
+        removeFromCell(location);
+    } else {
+        location = locations.emplace(id, Location{}).first;
+    }
+    auto& entries = cells[cell];
+    location->second = {cell, entries.size()};
+    entries.push_back({id, position});
+}
+
+void SpatialIndex::remove(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto location = locations.find(id);
+    if (location == locations.end()) {
+        return;
+    }
+    removeFromCell(location);
+    locations.erase(location);
+}
+
+void SpatialIndex::removeFromCell(std::unordered_map<uint64_t, Location>::iterator location)
+{
+    auto cell = cells.find(location->second.cell);
+    auto& entries = cell->second;
+    size_t slot = location->second.slot;
+    if (slot + 1 != entries.size()) {
+        entries[slot] = entries.back();
+        locations.at(entries[slot].id).slot = slot;
+    }
+    entries.pop_back();
+    if (entries.empty()) {
+        cells.erase(cell);
+    }
+}
+
+template <typename Visit>
+void SpatialIndex::forEachInCells(const GamePosition& low,
+                                  const GamePosition& high,
+                                  Visit visit) const
+{
+    double lowX = std::floor(low.x / cellSize);
+    double lowY = std::floor(low.y / cellSize);
+    double lowZ = std::floor(low.z / cellSize);
+    double highX = std::floor(high.x / cellSize);
+    double highY = std::floor(high.y / cellSize);
+    double highZ = std::floor(high.z / cellSize);
+    if (lowX > highX || lowY > highY || lowZ > highZ) {
+        return;
+    }
+
+    // A box larger than the occupied area would mostly visit empty cells, so the occupied
+    // ones are scanned instead. So is a box too far away for its cell indices to fit int64_t
+    const double maxIndex = 1e18;
+    auto fits = [maxIndex](double index) { return std::fabs(index) < maxIndex; };
+    double boxCells = (highX - lowX + 1) * (highY - lowY + 1) * (highZ - lowZ + 1);
+    if (!(boxCells <= static_cast<double>(cells.size())) || !fits(lowX) || !fits(lowY)
+        || !fits(lowZ) || !fits(highX) || !fits(highY) || !fits(highZ)) {
+        for (const auto& [cell, entries] : cells) {
+            if (cell.x >= lowX && cell.x <= highX && cell.y >= lowY && cell.y <= highY
+                && cell.z >= lowZ && cell.z <= highZ) {
+                for (const auto& entry : entries) {
+                    visit(entry);
+                }
+            }
+        }
+        return;
+    }
+
+    for (auto x = static_cast<int64_t>(lowX); x <= static_cast<int64_t>(highX); ++x) {
+        for (auto y = static_cast<int64_t>(lowY); y <= static_cast<int64_t>(highY); ++y) {
+            for (auto z = static_cast<int64_t>(lowZ); z <= static_cast<int64_t>(highZ); ++z) {
+                auto cell = cells.find({x, y, z});
+                if (cell == cells.end()) {
+                    continue;
+                }
+                for (const auto& entry : cell->second) {
+                    visit(entry);
+                }
+            }
+        }
+    }
+}
+
+void SpatialIndex::findInBox(const GamePosition& low,
+                             const GamePosition& high,
+                             std::vector<Entry>& found) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    forEachInCells(low, high, [&](const Entry& entry) {
+        const auto& position = entry.position;
+        if (position.x >= low.x && position.x <= high.x && position.y >= low.y
+            && position.y <= high.y && position.z >= low.z && position.z <= high.z) {
+            found.push_back(entry);
+        }
+    });
+}
+
+void SpatialIndex::findInRadius(const GamePosition& center,
+                                double radius,
+                                std::vector<Entry>& found) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    GamePosition low{center.x - radius, center.y - radius, center.z - radius};
+    GamePosition high{center.x + radius, center.y + radius, center.z + radius};
+    double radiusSquared = radius * radius;
+    forEachInCells(low, high, [&](const Entry& entry) {
+        double dx = entry.position.x - center.x;
+        double dy = entry.position.y - center.y;
+        double dz = entry.position.z - center.z;
+        if (dx * dx + dy * dy + dz * dz <= radiusSquared) {
+            found.push_back(entry);
+        }
+    });
+}
+
+size_t SpatialIndex::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return locations.size();
+}
+
+std::vector<uint8_t> packSpatialEntries(const std::vector<SpatialIndex::Entry>& entries)
+{
+    std::vector<uint8_t> blob;
+    for (const auto& entry : entries) {
+        appendBlobField(blob, std::to_string(entry.id));
+        appendBlobField(blob, std::to_string(entry.position.x));
+        appendBlobField(blob, std::to_string(entry.position.y));
+        appendBlobField(blob, std::to_string(entry.position.z));
+    }
+    return blob;
+}
@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <sstream>
 #include <string>
 
@@ -142,37 +143,42 @@ void TerrainManager::deleteChunk(offset_t off_x, offset_t off_y)
 
 void TerrainManager::trackMob(EnemyId mobId)
 {
-    auto chunk = enemyManager.accessEnemy(mobId).getPosition().getChunk();
-    enemies.insert({mobId, chunk});
-    getOrCreateChunk(chunk.first, chunk.second).trackMob(mobId);
+    mobIndex.update(mobId, enemyManager.accessEnemy(mobId).getPosition());
 }
 void TerrainManager::updateMob(EnemyId mobId)
 {
-    GamePosition pos = enemyManager.accessEnemy(mobId).getPosition();
-    auto realChunkPos = pos.getChunk();
-    auto currentChunkPos = enemies.at(mobId);
-    if (realChunkPos != currentChunkPos) {
-        chunks.at(currentChunkPos).forgetMob(mobId);
-        chunks.at(realChunkPos).trackMob(mobId);
-    }
+    mobIndex.update(mobId, enemyManager.accessEnemy(mobId).getPosition());
 }
 void TerrainManager::forgetMob(EnemyId mobId)
 {
-    auto chunkPos = enemies.at(mobId);
-    chunks.at(chunkPos).forgetMob(mobId);
+    mobIndex.remove(mobId);
 }
 
-bool TerrainManager::hasChunk(offset_t off_x, offset_t off_y)
+void TerrainManager::trackObject(GameObjectId objectId)
 {
-    return chunks.count({off_x, off_y}) > 0;
+    objectIndex.update(objectId, getGameObjectManager().access(objectId).getPosition());
+}
+void TerrainManager::updateObject(GameObjectId objectId)
+{
+    objectIndex.update(objectId, getGameObjectManager().access(objectId).getPosition());
+}
+void TerrainManager::forgetObject(GameObjectId objectId)
+{
+    objectIndex.remove(objectId);
 }
 
-void TerrainManager::mobsAi()
+const SpatialIndex& TerrainManager::getMobIndex() const
 {
-    for (auto& kv : chunks) {
-        Chunk& v = kv.second;
-        v.mobsAi();
-    }
+    return mobIndex;
+}
+const SpatialIndex& TerrainManager::getObjectIndex() const
+{
+    return objectIndex;
+}
+
+bool TerrainManager::hasChunk(offset_t off_x, offset_t off_y)
+{
+    return chunks.count({off_x, off_y}) > 0;
 }
 
 irr::video::IImage* defaultTerrainGenerator(UNUSED TerrainManager::offset_t xc,
@@ -259,10 +265,6 @@ std::string TerrainManager::getCreateTerrainFilename(offset_t x, offset_t y)
            + ".png";
 }
 
-// void TerrainManager::trackObject(GameObjectId objectId);
-// void TerrainManager::updateObject(GameObjectId objectId);
-// void TerrainManager::forgetObject(GameObjectId objectId);
-
 void TerrainManager::autoLoad(double px, double py)
 {
     try {
@@ -270,14 +272,13 @@ void TerrainManager::autoLoad(double px, double py)
         offset_t cy = floor(py / CHUNK_SIZE_IRRLICHT);
         std::vector<std::pair<offset_t, offset_t>> chunklist;
         chunklist.emplace_back(cx, cy);
-        chunklist.emplace_back(cx - 1, cy);
-        chunklist.emplace_back(cx + 1, cy);
-        chunklist.emplace_back(cx, cy - 1);
-        chunklist.emplace_back(cx, cy + 1);
-        chunklist.emplace_back(cx - 1, cy - 1);
-        chunklist.emplace_back(cx + 1, cy - 1);
-        chunklist.emplace_back(cx - 1, cy + 1);
-        chunklist.emplace_back(cx + 1, cy + 1);
+        for (offset_t dx = -AUTOLOAD_RADIUS; dx <= AUTOLOAD_RADIUS; ++dx) {
+            for (offset_t dy = -AUTOLOAD_RADIUS; dy <= AUTOLOAD_RADIUS; ++dy) {
+                if (dx != 0 || dy != 0) {
+                    chunklist.emplace_back(cx + dx, cy + dy);
+                }
+            }
+        }
         setLoaded(chunklist);
     } catch (const std::exception& e) {
         LOG("Exception caught at TerrainManager::autoLoad(): " << e.what());
@@ -285,6 +286,13 @@ void TerrainManager::autoLoad(double px, double py)
     }
 }
 
+bool TerrainManager::isInLoadedArea(const GamePosition& position, const GamePosition& center)
+{
+    auto [x, y] = position.getChunk();
+    auto [cx, cy] = center.getChunk();
+    return std::abs(x - cx) <= AUTOLOAD_RADIUS && std::abs(y - cy) <= AUTOLOAD_RADIUS;
+}
+
 void TerrainManager::setLoaded(const std::vector<std::pair<offset_t, offset_t>> chunklist)
 {
     for (auto [cx, cy] : chunklist) {